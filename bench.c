@@ -0,0 +1,765 @@
+/*
+ * Copyright (C) 2022, LiuYuguang <l13660020946@live.com>
+ */
+/**
+ * @brief 性能测试：按数据块大小、key类型、value大小、key分布与线程数的组合，依次执行各个负载
+ * 每个负载输出吞吐量、延迟的p50/p99/p999、文件大小与每次操作的读写系统调用数，-c时输出CSV便于比较不同版本
+ *
+ * ./filedb_bench [-n keys] [-o ops] [-b block sizes] [-k key types] [-v value sizes] [-d distributions]
+ *                [-t threads] [-w workloads] [-f flags] [-r fill] [-p path] [-c]
+ * 列表参数用逗号分隔，例如 -k int32,string -d uniform,zipf -t 1,4
+ *   key types     int32, int64, string, bytes
+ *   distributions seq（顺序）, uniform（均匀）, zipf（Zipfian，theta=0.99，打散到整个key空间）
+ *   workloads     load（插入n个key，seq时按顺序，否则乱序）, a（50%查询/50%修改）, b（95%查询/5%修改）, c（只查询）,
+ *                 many（每次db_search_many查询BENCH_BATCH个key，延迟按每次调用计）,
+ *                 miss（查询不存在的key）, view（同c，用db_get_view取得视图后释放）,
+ *                 batch（同load，每BENCH_BATCH个key一次db_write_batch，延迟按每次调用计，需要wal）,
+ *                 scan（丢弃页缓存后重新打开，游标顺序遍历）, delete（删除全部key，顺序同load）
+ *   flags         mmap, wal, uring, lz（创建时指定DB_COMPRESS）, bloom（打开后建立布隆过滤器）,
+ *                 inline（创建时指定DB_INLINE_VALUE(BENCH_INLINE)），用+组合，例如 wal+uring+lz
+ *   fill          db_options.fill，节点的填充率，flags中显示为fill
+ * value是类似JSON的文本，压缩率与实际的记录相近
+ */
+
+#define _GNU_SOURCE            // for posix_fadvise()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "filedb.h"
+
+#define BENCH_KEYS    100000       // 默认的key数
+#define BENCH_OPS     200000       // a、b、c负载默认的操作数
+#define BENCH_THREAD  64           // 最多的线程数
+#define BENCH_LIST    16           // 每个列表参数最多的项数
+#define BENCH_HIST    (64 * 16)    // 延迟直方图的桶数：按2的幂分段，每段16个桶
+#define BENCH_THETA   0.99         // Zipfian分布的参数，同YCSB
+#define BENCH_KEY_LEN 32           // string与bytes类型的key长度
+#define BENCH_BATCH   100          // many负载每次查询、batch负载每次写入的key数
+#define BENCH_BLOOM   10           // bloom选项的布隆过滤器每个key的位数
+#define BENCH_INLINE  64           // inline选项存放在关键字槽中的value的最大长度
+
+/**
+ * @brief 延迟直方图（纳秒），每段内线性划分，相对误差不超过1/16
+ */
+typedef struct{
+    uint64_t count[BENCH_HIST];
+    uint64_t total;
+}bench_hist;
+
+/**
+ * @brief Zipfian分布的参数，同YCSB的ZipfianGenerator，只读，线程间共享
+ */
+typedef struct{
+    long n;
+    double zetan;
+    double alpha;
+    double eta;
+    double half;       /** 1 + 0.5^theta */
+}bench_zipf;
+
+/**
+ * @brief 一组测试的参数
+ */
+typedef struct{
+    char *path;
+    db_options options;
+    int create_flags;  /** db_create_ex的flags */
+    size_t bloom_bits; /** 打开后按每个key的位数建立布隆过滤器，0表示不使用 */
+    size_t block_size;
+    int key_type;
+    size_t key_size;
+    size_t value_size;
+    int dist;
+    int threads;
+    long keys;
+    long ops;
+    int *order;        /** load与delete的key顺序 */
+    bench_zipf zipf;
+}bench_conf;
+
+/**
+ * @brief 每个线程的状态
+ */
+typedef struct{
+    bench_conf *conf;
+    db_t *db;
+    int workload;
+    int id;
+    uint64_t rng;
+    long begin;        /** load、delete负责的区间[begin, end)，a、b、c的操作数为end-begin */
+    long end;
+    bench_hist hist;
+    int failed;
+}bench_worker;
+
+#define DIST_SEQ     0
+#define DIST_UNIFORM 1
+#define DIST_ZIPF    2
+
+#define WORK_LOAD   0
+#define WORK_A      1
+#define WORK_B      2
+#define WORK_C      3
+#define WORK_SCAN   4
+#define WORK_DELETE 5
+#define WORK_MANY   6
+#define WORK_MISS   7
+#define WORK_VIEW   8
+#define WORK_BATCH  9
+
+static const char *dist_name[] = {"seq", "uniform", "zipf"};
+static const char *work_name[] = {"load", "a", "b", "c", "scan", "delete", "many", "miss", "view", "batch"};
+static const char *key_name[] = {"string", "bytes", "int32", "int64"}; // 按DB_STRINGKEY等的值排列
+
+static int csv;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * @brief xorshift64*，每个线程一个状态
+ */
+static uint64_t rng_next(uint64_t *s){
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717UL;
+}
+
+static double rng_double(uint64_t *s){
+    return (rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void hist_add(bench_hist *h, uint64_t ns){
+    int msb, i;
+    if(ns < 16){
+        i = ns;
+    }else{
+        msb = 63 - __builtin_clzl(ns);
+        i = (msb - 3) * 16 + ((ns >> (msb - 4)) & 15);
+    }
+    h->count[i < BENCH_HIST ? i : BENCH_HIST - 1]++;
+    h->total++;
+}
+
+/**
+ * @return 第p分位的延迟（纳秒），取桶的下界
+ */
+static uint64_t hist_percentile(bench_hist *h, double p){
+    uint64_t want = (uint64_t)ceil(h->total * p), seen = 0;
+    int i;
+    for(i=0;i<BENCH_HIST;i++){
+        seen += h->count[i];
+        if(seen >= want && seen > 0){
+            return i < 16 ? (uint64_t)i : (uint64_t)(16 + i % 16) << (i / 16 - 1);
+        }
+    }
+    return 0;
+}
+
+static void zipf_init(bench_zipf *z, long n){
+    long i;
+    double zeta2 = 1 + pow(0.5, BENCH_THETA);
+    z->n = n;
+    z->zetan = 0;
+    for(i=1;i<=n;i++){
+        z->zetan += 1 / pow((double)i, BENCH_THETA);
+    }
+    z->alpha = 1 / (1 - BENCH_THETA);
+    z->eta = (1 - pow(2.0 / n, 1 - BENCH_THETA)) / (1 - zeta2 / z->zetan);
+    z->half = zeta2;
+}
+
+/**
+ * @brief Zipfian分布的名次，再用FNV哈希打散，热点不集中在小的key上
+ */
+static long zipf_next(bench_zipf *z, uint64_t *s){
+    double u = rng_double(s), uz = u * z->zetan;
+    long rank = uz < 1 ? 0 : uz < z->half ? 1 : (long)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    uint64_t h = 14695981039346656037UL;
+    int i;
+    for(i=0;i<8;i++){
+        h = (h ^ ((uint64_t)rank >> (i * 8) & 0xff)) * 1099511628211UL;
+    }
+    return h % z->n;
+}
+
+/**
+ * @brief 生成第k个key，string与bytes补齐到相同长度，保证顺序与k一致
+ */
+static void* bench_key(int key_type, long k, char *key){
+    switch (key_type)
+    {
+    case DB_INT32KEY:
+        *(int32_t*)key = k;
+        break;
+    case DB_INT64KEY:
+        *(int64_t*)key = (int64_t)k << 32;
+        break;
+    default:
+        memset(key, 0, BENCH_KEY_LEN);
+        sprintf(key, "key-%012ld", k);
+        break;
+    }
+    return key;
+}
+
+/**
+ * @brief 填充value：类似JSON的记录，字段名重复、字段值由k与version伪随机选出，version不同时内容不同
+ */
+static void bench_value(char *value, size_t size, long k, long version){
+    static const char *words[] = {"alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+        "india", "juliet", "kilo", "lima", "mike", "november", "oscar", "papa"};
+    char field[128];
+    uint64_t s = (uint64_t)k * 0x9E3779B97F4A7C15ULL + (uint64_t)version;
+    size_t i = 0, n;
+    int f = 0;
+    while(i < size){
+        s ^= s << 13;
+        s ^= s >> 7;
+        s ^= s << 17;
+        n = snprintf(field, sizeof(field), "%s\"field%d\":{\"id\":%ld,\"name\":\"%s-%s\",\"score\":%u}",
+            f == 0 ? "{" : ",", f, k, words[s % 16], words[(s >> 4) % 16], (unsigned)(s >> 8) % 100000);
+        n = n < size - i ? n : size - i;
+        memcpy(value + i, field, n);
+        i += n;
+        f++;
+    }
+}
+
+/**
+ * @brief 第i次请求的key
+ */
+static long bench_next(bench_worker *w, long i){
+    bench_conf *conf = w->conf;
+    switch (conf->dist)
+    {
+    case DIST_SEQ:
+        return (w->begin + i) % conf->keys;
+    case DIST_UNIFORM:
+        return rng_next(&w->rng) % conf->keys;
+    default:
+        return zipf_next(&conf->zipf, &w->rng);
+    }
+}
+
+/**
+ * @brief many负载，key的分布同c，每BENCH_BATCH个key一次db_search_many
+ */
+static void* bench_run_many(bench_worker *w){
+    bench_conf *conf = w->conf;
+    char (*key)[BENCH_KEY_LEN] = malloc(BENCH_KEY_LEN * BENCH_BATCH);
+    char *value = malloc((conf->value_size + 1) * BENCH_BATCH);
+    void *keys[BENCH_BATCH], *values[BENCH_BATCH];
+    size_t sizes[BENCH_BATCH];
+    int results[BENCH_BATCH], j, n;
+    long i;
+    uint64_t t;
+    if(key == NULL || value == NULL){
+        w->failed = 1;
+        goto out;
+    }
+    for(j=0;j<BENCH_BATCH;j++){
+        keys[j] = key[j];
+        values[j] = value + (conf->value_size + 1) * j;
+        sizes[j] = conf->value_size + 1;
+    }
+    for(i=0;i<w->end-w->begin && !w->failed;i+=n){
+        n = w->end - w->begin - i < BENCH_BATCH ? w->end - w->begin - i : BENCH_BATCH;
+        for(j=0;j<n;j++){
+            bench_key(conf->key_type, bench_next(w, i + j), key[j]);
+        }
+        t = now_ns();
+        if(db_search_many(w->db, n, keys, values, sizes, results) != n){
+            fprintf(stderr, "many failed: %s\n", strerror(errno));
+            w->failed = 1;
+        }
+        hist_add(&w->hist, now_ns() - t);
+    }
+out:
+    free(key);
+    free(value);
+    return NULL;
+}
+
+/**
+ * @brief batch负载，key的顺序同load，每BENCH_BATCH个key一次db_write_batch
+ */
+static void* bench_run_batch(bench_worker *w){
+    bench_conf *conf = w->conf;
+    char (*key)[BENCH_KEY_LEN] = malloc(BENCH_KEY_LEN * BENCH_BATCH);
+    char *value = malloc((conf->value_size + 1) * BENCH_BATCH);
+    db_batch_op ops[BENCH_BATCH];
+    int j, n;
+    long i, k;
+    uint64_t t;
+    if(key == NULL || value == NULL){
+        w->failed = 1;
+        goto out;
+    }
+    for(j=0;j<BENCH_BATCH;j++){
+        ops[j].type = DB_BATCH_PUT;
+        ops[j].key = key[j];
+        ops[j].value = value + (conf->value_size + 1) * j;
+        ops[j].value_size = conf->value_size;
+    }
+    for(i=0;i<w->end-w->begin && !w->failed;i+=n){
+        n = w->end - w->begin - i < BENCH_BATCH ? w->end - w->begin - i : BENCH_BATCH;
+        for(j=0;j<n;j++){
+            k = conf->order[w->begin + i + j];
+            bench_key(conf->key_type, k, key[j]);
+            bench_value(ops[j].value, conf->value_size, k, i + j);
+        }
+        t = now_ns();
+        if(db_write_batch(w->db, n, ops) != n){
+            fprintf(stderr, "batch failed: %s\n", strerror(errno));
+            w->failed = 1;
+        }
+        hist_add(&w->hist, now_ns() - t);
+    }
+out:
+    free(key);
+    free(value);
+    return NULL;
+}
+
+static void* bench_run(void *p){
+    bench_worker *w = p;
+    if(w->workload == WORK_MANY){
+        return bench_run_many(w);
+    }
+    if(w->workload == WORK_BATCH){
+        return bench_run_batch(w);
+    }
+    bench_conf *conf = w->conf;
+    char key[BENCH_KEY_LEN];
+    char *value = malloc(conf->value_size + 1);
+    db_view view;
+    long i, k;
+    int rc, write;
+    uint64_t t;
+    if(value == NULL){
+        w->failed = 1;
+        return NULL;
+    }
+    for(i=0;i<w->end-w->begin && !w->failed;i++){
+        write = 0;
+        switch (w->workload)
+        {
+        case WORK_LOAD:
+        case WORK_DELETE:
+            k = conf->order[w->begin + i];
+            break;
+        case WORK_MISS:
+            // 已加载的key之后的key都不存在
+            k = bench_next(w, i) + conf->keys;
+            break;
+        default:
+            k = bench_next(w, i);
+            write = (w->workload == WORK_A && rng_next(&w->rng) % 100 < 50)
+                || (w->workload == WORK_B && rng_next(&w->rng) % 100 < 5);
+            break;
+        }
+        bench_key(conf->key_type, k, key);
+        if(w->workload == WORK_LOAD || write){
+            bench_value(value, conf->value_size, k, i);
+        }
+        t = now_ns();
+        switch (w->workload)
+        {
+        case WORK_LOAD:
+            rc = db_insert(w->db, key, value, conf->value_size) == 1;
+            break;
+        case WORK_DELETE:
+            rc = db_delete(w->db, key) == 1;
+            break;
+        case WORK_MISS:
+            rc = db_search(w->db, key, value, conf->value_size) == -1 && errno == ENOMSG;
+            break;
+        case WORK_VIEW:
+            rc = db_get_view(w->db, key, &view) == (int)conf->value_size;
+            db_view_release(&view);
+            break;
+        default:
+            rc = write ? db_update(w->db, key, value, conf->value_size) == 1
+                : db_search(w->db, key, value, conf->value_size) == (int)conf->value_size;
+            break;
+        }
+        hist_add(&w->hist, now_ns() - t);
+        if(!rc){
+            fprintf(stderr, "%s key %ld failed: %s\n", work_name[w->workload], k, strerror(errno));
+            w->failed = 1;
+        }
+    }
+    free(value);
+    return NULL;
+}
+
+/**
+ * @brief 进程的读、写系统调用数（/proc/self/io），不支持时为0
+ */
+static uint64_t bench_syscalls(void){
+    FILE *fp = fopen("/proc/self/io", "r");
+    char line[128];
+    unsigned long long n, total = 0;
+    if(fp == NULL){
+        return 0;
+    }
+    while(fgets(line, sizeof(line), fp) != NULL){
+        if(sscanf(line, "syscr: %llu", &n) == 1 || sscanf(line, "syscw: %llu", &n) == 1){
+            total += n;
+        }
+    }
+    fclose(fp);
+    return total;
+}
+
+static void bench_report(bench_conf *conf, int workload, long ops, double sec, bench_hist *hist, uint64_t syscalls){
+    struct stat st;
+    long size = stat(conf->path, &st) == 0 ? (long)st.st_size : -1;
+    char flags[48];
+    snprintf(flags, sizeof(flags), "%s%s%s%s%s%s%s%s",
+        conf->options.flags & DB_MMAP ? "mmap+" : "",
+        conf->options.flags & DB_WAL ? "wal+" : "",
+        conf->options.flags & DB_URING ? "uring+" : "",
+        conf->create_flags & DB_COMPRESS ? "lz+" : "",
+        conf->bloom_bits ? "bloom+" : "",
+        conf->create_flags & DB_INLINE_VALUE(0xff) ? "inline+" : "",
+        conf->options.fill != 0 ? "fill+" : "",
+        conf->options.flags || conf->create_flags || conf->bloom_bits || conf->options.fill != 0 ? "" : "none+");
+    flags[strlen(flags) - 1] = '\0';
+    double p50 = hist_percentile(hist, 0.5) / 1e3, p99 = hist_percentile(hist, 0.99) / 1e3, p999 = hist_percentile(hist, 0.999) / 1e3;
+    double per_op = ops ? (double)syscalls / ops : 0;
+    if(csv){
+        printf("%zu,%s,%s,%zu,%s,%d,%s,%ld,%.0f,%.2f,%.2f,%.2f,%ld,%.3f\n",
+            conf->block_size, flags, key_name[conf->key_type], conf->value_size, dist_name[conf->dist], conf->threads,
+            work_name[workload], ops, ops / sec, p50, p99, p999, size, per_op);
+    }else{
+        printf("%-6zu %-10s %-6s %-7zu %-7s %-3d %-6s %9ld %11.0f %9.2f %9.2f %9.2f %12ld %8.3f\n",
+            conf->block_size, flags, key_name[conf->key_type], conf->value_size, dist_name[conf->dist], conf->threads,
+            work_name[workload], ops, ops / sec, p50, p99, p999, size, per_op);
+    }
+    fflush(stdout);
+}
+
+/**
+ * @brief 冷缓存下游标顺序遍历：关闭数据库，让内核丢弃文件的页缓存，重新打开后遍历
+ */
+static int bench_scan(bench_conf *conf, db_t **db){
+    char key[BENCH_KEY_LEN];
+    char *value = malloc(conf->value_size + 1);
+    db_cursor *cursor;
+    bench_hist *hist = calloc(1, sizeof(bench_hist));
+    long n = 0;
+    int fd, rc = -1;
+    uint64_t begin, t, syscalls;
+    if(value == NULL || hist == NULL){
+        goto out;
+    }
+    db_close(*db);
+    if((fd = open(conf->path, O_RDONLY)) != -1){
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    if(db_open_ex(db, conf->path, &conf->options) == -1){
+        *db = NULL;
+        goto out;
+    }
+    syscalls = bench_syscalls();
+    begin = now_ns();
+    if(db_cursor_open(*db, &cursor, NULL, NULL) == -1){
+        goto out;
+    }
+    for(;;){
+        t = now_ns();
+        if(db_cursor_next(cursor, key, value, conf->value_size + 1) < 0){
+            break;
+        }
+        hist_add(hist, now_ns() - t);
+        n++;
+    }
+    db_cursor_close(cursor);
+    if(errno == ENOMSG && n == conf->keys){
+        bench_report(conf, WORK_SCAN, n, (now_ns() - begin) / 1e9, hist, bench_syscalls() - syscalls);
+        rc = 0;
+    }else{
+        fprintf(stderr, "scan: %ld keys, %s\n", n, strerror(errno));
+    }
+out:
+    free(value);
+    free(hist);
+    return rc;
+}
+
+/**
+ * @brief 按负载启动conf->threads个线程，合并延迟直方图后输出
+ */
+static int bench_workload(bench_conf *conf, db_t *db, int workload){
+    bench_worker *w = calloc(conf->threads, sizeof(bench_worker));
+    pthread_t tid[BENCH_THREAD];
+    bench_hist *hist = calloc(1, sizeof(bench_hist));
+    long total = workload == WORK_LOAD || workload == WORK_DELETE || workload == WORK_BATCH ? conf->keys : conf->ops;
+    int i, j, failed = 0;
+    uint64_t begin, syscalls;
+    if(w == NULL || hist == NULL){
+        free(w);
+        free(hist);
+        return -1;
+    }
+    syscalls = bench_syscalls();
+    begin = now_ns();
+    for(i=0;i<conf->threads;i++){
+        w[i].conf = conf;
+        w[i].db = db;
+        w[i].workload = workload;
+        w[i].id = i;
+        w[i].rng = 0x9e3779b97f4a7c15UL * (i + 1) + workload;
+        w[i].begin = total * i / conf->threads;
+        w[i].end = total * (i + 1) / conf->threads;
+        if(pthread_create(&tid[i], NULL, bench_run, &w[i]) != 0){
+            w[i].failed = 1;
+            break;
+        }
+    }
+    for(j=0;j<i;j++){
+        pthread_join(tid[j], NULL);
+    }
+    double sec = (now_ns() - begin) / 1e9;
+    syscalls = bench_syscalls() - syscalls;
+    for(i=0;i<conf->threads;i++){
+        failed |= w[i].failed;
+        for(j=0;j<BENCH_HIST;j++){
+            hist->count[j] += w[i].hist.count[j];
+        }
+        hist->total += w[i].hist.total;
+    }
+    if(!failed){
+        bench_report(conf, workload, total, sec, hist, syscalls);
+    }
+    free(w);
+    free(hist);
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief 删除数据库与日志文件
+ */
+static void bench_unlink(char *path){
+    char wal[PATH_MAX];
+    snprintf(wal, sizeof(wal), "%s-wal", path);
+    unlink(path);
+    unlink(wal);
+}
+
+/**
+ * @brief 新建数据库，依次执行负载
+ */
+static int bench_case(bench_conf *conf, int *work, int nwork){
+    db_t *db;
+    long i, j;
+    int t, rc = 0;
+    uint64_t s = 88172645463325292UL;
+
+    // 乱序时用Fisher-Yates洗牌
+    for(i=0;i<conf->keys;i++){
+        conf->order[i] = i;
+    }
+    for(i=conf->keys-1;conf->dist!=DIST_SEQ && i>0;i--){
+        j = rng_next(&s) % (i + 1);
+        t = conf->order[i];
+        conf->order[i] = conf->order[j];
+        conf->order[j] = t;
+    }
+
+    bench_unlink(conf->path);
+    if(db_create_ex(conf->path, conf->key_type, conf->key_size, conf->block_size, conf->create_flags) == -1
+        || db_open_ex(&db, conf->path, &conf->options) == -1
+        || (conf->bloom_bits && db_bloom_rebuild(db, conf->bloom_bits) == -1)){
+        fprintf(stderr, "open %s: %s\n", conf->path, strerror(errno));
+        return -1;
+    }
+    for(i=0;i<nwork && rc==0;i++){
+        rc = work[i] == WORK_SCAN ? bench_scan(conf, &db) : bench_workload(conf, db, work[i]);
+    }
+    if(db != NULL){
+        db_close(db);
+    }
+    return rc;
+}
+
+/**
+ * @brief 解析逗号分隔的列表，names为NULL时是数字
+ * @return 项数, ==-1 error
+ */
+static int parse_list(char *arg, const char **names, int nname, long *out){
+    char *save = NULL, *tok;
+    int n = 0, i;
+    for(tok=strtok_r(arg, ",", &save);tok!=NULL;tok=strtok_r(NULL, ",", &save)){
+        if(n == BENCH_LIST){
+            return -1;
+        }
+        if(names == NULL){
+            if((out[n++] = atol(tok)) <= 0){
+                return -1;
+            }
+            continue;
+        }
+        for(i=0;i<nname && strcmp(tok, names[i]);i++);
+        if(i == nname){
+            return -1;
+        }
+        out[n++] = i;
+    }
+    return n;
+}
+
+/**
+ * @brief 解析+连接的选项，打开数据库的选项写入conf->options.flags，创建数据库的写入conf->create_flags
+ * @return ==0 if successful, ==-1 error
+ */
+static int parse_flags(char *arg, bench_conf *conf){
+    char *save = NULL, *tok;
+    conf->options.flags = conf->create_flags = 0;
+    conf->bloom_bits = 0;
+    for(tok=strtok_r(arg, "+", &save);tok!=NULL;tok=strtok_r(NULL, "+", &save)){
+        if(strcmp(tok, "mmap") == 0){
+            conf->options.flags |= DB_MMAP;
+        }else if(strcmp(tok, "wal") == 0){
+            conf->options.flags |= DB_WAL;
+        }else if(strcmp(tok, "uring") == 0){
+            conf->options.flags |= DB_URING;
+        }else if(strcmp(tok, "lz") == 0){
+            conf->create_flags |= DB_COMPRESS;
+        }else if(strcmp(tok, "bloom") == 0){
+            conf->bloom_bits = BENCH_BLOOM;
+        }else if(strcmp(tok, "inline") == 0){
+            conf->create_flags |= DB_INLINE_VALUE(BENCH_INLINE);
+        }else if(strcmp(tok, "none") != 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void usage(char *name){
+    fprintf(stderr,
+        "usage: %s [-n keys] [-o ops] [-b block sizes] [-k key types] [-v value sizes] [-d distributions]\n"
+        "       [-t threads] [-w workloads] [-f flags] [-r fill] [-p path] [-c]\n"
+        "  key types: int32,int64,string,bytes  distributions: seq,uniform,zipf\n"
+        "  workloads: load,a,b,c,many,miss,view,batch,scan,delete  flags: none,mmap,wal,uring,lz,bloom,inline (joined by +)\n", name);
+}
+
+int main(int argc, char *argv[]){
+    bench_conf conf;
+    long block[BENCH_LIST] = {DB_BLOCK_SIZE}, key[BENCH_LIST] = {DB_INT32KEY, DB_INT64KEY, DB_STRINGKEY, DB_BYTESKEY};
+    long value[BENCH_LIST] = {100}, dist[BENCH_LIST] = {DIST_SEQ, DIST_UNIFORM, DIST_ZIPF}, thread[BENCH_LIST] = {1};
+    long work[BENCH_LIST] = {WORK_LOAD, WORK_C, WORK_B, WORK_A, WORK_SCAN, WORK_DELETE};
+    int nblock = 1, nkey = 4, nvalue = 1, ndist = 3, nthread = 1, nwork = 6, w[BENCH_LIST];
+    int b, k, v, d, t, i, opt, rc = 0;
+
+    memset(&conf, 0, sizeof(conf));
+    conf.path = "./bench.db";
+    conf.keys = BENCH_KEYS;
+    conf.ops = BENCH_OPS;
+    while((opt = getopt(argc, argv, "n:o:b:k:v:d:t:w:f:r:p:c")) != -1){
+        switch (opt)
+        {
+        case 'n':
+            conf.keys = atol(optarg);
+            break;
+        case 'o':
+            conf.ops = atol(optarg);
+            break;
+        case 'b':
+            nblock = parse_list(optarg, NULL, 0, block);
+            break;
+        case 'k':
+            nkey = parse_list(optarg, key_name, 4, key);
+            break;
+        case 'v':
+            nvalue = parse_list(optarg, NULL, 0, value);
+            break;
+        case 'd':
+            ndist = parse_list(optarg, dist_name, 3, dist);
+            break;
+        case 't':
+            nthread = parse_list(optarg, NULL, 0, thread);
+            break;
+        case 'w':
+            nwork = parse_list(optarg, work_name, 10, work);
+            break;
+        case 'f':
+            if(parse_flags(optarg, &conf) == -1){
+                nwork = -1;
+            }
+            break;
+        case 'r':
+            conf.options.fill = atof(optarg);
+            break;
+        case 'p':
+            conf.path = optarg;
+            break;
+        case 'c':
+            csv = 1;
+            break;
+        default:
+            nwork = -1;
+            break;
+        }
+    }
+    if(conf.keys <= 0 || conf.keys > INT32_MAX || conf.ops <= 0 || nblock <= 0 || nkey <= 0 || nvalue <= 0 || ndist <= 0 || nthread <= 0 || nwork <= 0){
+        usage(argv[0]);
+        return 2;
+    }
+    for(t=0;t<nthread;t++){
+        if(thread[t] > BENCH_THREAD){
+            thread[t] = BENCH_THREAD;
+        }
+    }
+    for(i=0;i<nwork;i++){
+        w[i] = work[i];
+    }
+    if((conf.order = malloc(sizeof(int) * conf.keys)) == NULL){
+        return 1;
+    }
+    zipf_init(&conf.zipf, conf.keys);
+
+    if(csv){
+        printf("block,flags,key,value,dist,threads,workload,ops,ops_per_sec,p50_us,p99_us,p999_us,file_bytes,syscalls_per_op\n");
+    }else{
+        printf("%-6s %-10s %-6s %-7s %-7s %-3s %-6s %9s %11s %9s %9s %9s %12s %8s\n",
+            "block", "flags", "key", "value", "dist", "thr", "work", "ops", "ops/s", "p50(us)", "p99(us)", "p999(us)", "file(bytes)", "sys/op");
+    }
+    for(b=0;b<nblock && rc==0;b++){
+        for(k=0;k<nkey && rc==0;k++){
+            for(v=0;v<nvalue && rc==0;v++){
+                for(d=0;d<ndist && rc==0;d++){
+                    for(t=0;t<nthread && rc==0;t++){
+                        conf.block_size = block[b];
+                        conf.key_type = key[k];
+                        conf.key_size = key[k] == DB_INT32KEY ? sizeof(int32_t) : key[k] == DB_INT64KEY ? sizeof(int64_t) : BENCH_KEY_LEN;
+                        conf.value_size = value[v];
+                        conf.dist = dist[d];
+                        conf.threads = thread[t];
+                        rc = bench_case(&conf, w, nwork);
+                    }
+                }
+            }
+        }
+    }
+    bench_unlink(conf.path);
+    free(conf.order);
+    return rc == 0 ? 0 : 1;
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2022, LiuYuguang <l13660020946@live.com>
+ */
+/**
+ * @brief 演示：插入、查询、修改、快照、删除、整理、批量写与整理中途崩溃后的恢复，性能测试见bench.c
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "filedb.h"
+
+#define COUNT 100000
+#define PATH "./test.db"
+#define BATCH 1000
+#define EXTENT (128<<10)
+
+int main(int argc, char *argv[]){
+    db_t* db;
+    int i,rc;
+    char value[128];
+
+    // 创建数据库
+    unlink(PATH);
+    assert(db_create(PATH,DB_INT32KEY,sizeof(int)) == 0);
+
+    // 打开数据库
+    assert(db_open(&db,PATH) == 0);
+
+    // 插入操作
+    for(i=0;i<COUNT;i++){
+        sprintf(value,"%d",i);
+        assert(db_insert(db,&i,value,strlen(value)) == 1);
+    }
+    printf("insert key from %d to %d\n",0,COUNT);
+
+    //查询操作
+    i = 0;
+    bzero(value,sizeof(value));
+    rc = db_search(db,&i,value,sizeof(value));
+    assert(rc >= 0);
+    printf("search key: %d value: %.*s\n",i,rc,value);
+
+    // 修改操作，之前打开的快照仍然读到原来的值
+    db_snapshot *snap;
+    assert(db_snapshot_open(db,&snap) == 0);
+    assert(db_update(db,&i,"updated",7) == 1);
+    rc = db_search(db,&i,value,sizeof(value));
+    assert(rc == 7);
+    printf("update key: %d value: %.*s\n",i,rc,value);
+    rc = db_snapshot_search(snap,&i,value,sizeof(value));
+    assert(rc >= 0);
+    printf("snapshot key: %d value: %.*s\n",i,rc,value);
+    db_snapshot_close(snap);
+
+    db_cache_info info;
+    db_cache_stat(db,&info);
+    printf("cache frames: %zu hit: %zu miss: %zu\n",info.frames,info.hit,info.miss);
+
+    // 运行时统计
+    db_stats_info stats;
+    if(db_stats(db,&stats) == 0){
+        printf("height: %zu splits: %zu reads: %zu writes: %zu\n",stats.height,stats.splits,stats.reads,stats.writes);
+    }
+
+    // 删除操作
+    for(i=0;i<COUNT;i++){
+        assert(db_delete(db,&i) == 1);
+    }
+    printf("delete key from %d to %d\n",0,COUNT);
+
+    // 整理，截断已释放的数据块
+    struct stat st;
+    while((rc = db_compact(db,1024)) == 1);
+    assert(rc == 0 && stat(PATH,&st) == 0);
+    printf("compact file size: %ld\n",(long)st.st_size);
+
+    // 批量写：启用预写日志时整批是原子的，中途出错时撤销整批
+    db_close(db);
+    db_options options = {DB_WAL};
+    assert(db_open_ex(&db,PATH,&options) == 0);
+    static int keys[BATCH+1];
+    static db_batch_op ops[BATCH+1];
+    static char big[1<<20];
+    for(i=0;i<=BATCH;i++){
+        keys[i] = i;
+        ops[i].type = DB_BATCH_PUT;
+        ops[i].key = &keys[i];
+        ops[i].value = "batch";
+        ops[i].value_size = 5;
+    }
+    ops[BATCH].value = big;
+    ops[BATCH].value_size = sizeof(big);
+    // 限制文件大小：之前的插入已分裂了叶子节点与根节点，最后的大value写入文件尾时失败
+    struct rlimit limit, saved;
+    assert(getrlimit(RLIMIT_FSIZE,&saved) == 0);
+    signal(SIGXFSZ,SIG_IGN);
+    limit.rlim_cur = st.st_size + (256<<10);
+    limit.rlim_max = saved.rlim_max;
+    assert(setrlimit(RLIMIT_FSIZE,&limit) == 0);
+    rc = db_write_batch(db,BATCH+1,ops);
+    assert(rc == -1 && ops[0].result == 1 && ops[BATCH].result == -1);
+    printf("batch rolled back: %s\n",strerror(errno));
+    assert(setrlimit(RLIMIT_FSIZE,&saved) == 0);
+    i = 0;
+    assert(db_search(db,&i,value,sizeof(value)) == -1 && errno == ENOMSG);
+    assert(db_verify(db) == 0);
+    // 去掉大value之后整批提交
+    rc = db_write_batch(db,BATCH,ops);
+    assert(rc == BATCH);
+    assert(db_verify(db) == 0);
+    printf("batch insert key from %d to %d\n",0,BATCH);
+
+    // 关闭数据库
+    db_close(db);
+
+    // 整理中途崩溃：子进程移动区段之后、提交之前退出，重新打开时恢复为整理之前
+    unlink(PATH);
+    unlink(PATH "-wal");
+    assert(db_create(PATH,DB_INT32KEY,sizeof(int)) == 0);
+    pid_t pid = fork();
+    assert(pid != -1);
+    if(pid == 0){
+        struct stat wal;
+        assert(db_open_ex(&db,PATH,&options) == 0);
+        // 4个区段，删除前3个，最后一个移到前面的空闲数据块
+        for(i=0;i<4;i++){
+            memset(big,'a'+i,EXTENT);
+            assert(db_insert(db,&i,big,EXTENT) == 1);
+        }
+        for(i=0;i<3;i++){
+            assert(db_delete(db,&i) == 1);
+        }
+        // 关闭时做检查点，日志中不再有释放的数据块的镜像，恢复时不会覆盖整理写入的数据块
+        db_close(db);
+        assert(db_open_ex(&db,PATH,&options) == 0);
+        // 原地修改同一个key使日志超过数据库文件，然后限制文件大小：整理写入数据库文件成功，提交写入日志失败
+        i = 4;
+        while(stat(PATH,&st) == 0 && stat(PATH "-wal",&wal) == 0 && wal.st_size <= st.st_size){
+            assert(db_upsert(db,&i,"padding",7) >= 0);
+        }
+        limit.rlim_cur = wal.st_size;
+        assert(setrlimit(RLIMIT_FSIZE,&limit) == 0);
+        assert(db_compact(db,1024) == -1);
+        _exit(0);
+    }
+    assert(waitpid(pid,&rc,0) == pid && WIFEXITED(rc) && WEXITSTATUS(rc) == 0);
+    assert(db_open_ex(&db,PATH,&options) == 0);
+    i = 3;
+    assert(db_search(db,&i,big,sizeof(big)) == EXTENT && big[0] == 'd' && big[EXTENT-1] == 'd');
+    assert(db_verify(db) == 0);
+    while((rc = db_compact(db,1024)) == 1);
+    assert(rc == 0 && db_verify(db) == 0);
+    assert(db_search(db,&i,big,sizeof(big)) == EXTENT && big[0] == 'd' && big[EXTENT-1] == 'd');
+    printf("recovered from crash during compaction\n");
+    db_close(db);
+
+    return 0;
+}
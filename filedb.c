@@ -5,6 +5,7 @@
  * @brief 超简单的文件数据库
  */
 
+#define _GNU_SOURCE            // for pthread_rwlockattr_setkind_np()
 #include <stddef.h>            // for size_t
 #include <stdlib.h>            // for malloc(), free()
 #include <string.h>            // for memcpy(), memmove(), strcpy(), strlen()
@@ -13,12 +14,59 @@
 #include <unistd.h>            // for pread(), pwrite(), access(), ftruncate(), close()
 #include <stdint.h>            // for int32_t
 #include <errno.h>             // for E2BIG
+#include <sys/mman.h>          // for mmap(), msync(), munmap()
+#include <stdio.h>             // for snprintf()
+#include <limits.h>            // for PATH_MAX
+#include <pthread.h>           // for pthread_mutex_t, pthread_rwlock_t
+#include <sys/file.h>          // for flock()
+#include <sys/uio.h>           // for pwritev(), preadv()
+#include <sys/syscall.h>       // for SYS_io_uring_setup, SYS_io_uring_enter
+#include <linux/io_uring.h>    // for struct io_uring_params, struct io_uring_sqe, IORING_OP_READ
+#include <time.h>              // for clock_gettime()
+#include <sched.h>             // for sched_yield()
+#include "filedb.h"
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>         // for _mm256_mask_i32gather_epi32(), _mm256_cmpgt_epi32(), _mm_crc32_u64()
+#define DB_SIMD 1              // 运行时检测到AVX2时，整数key使用SIMD查找
+#endif
+#ifndef DB_NO_STATS
+#define DB_STATS 1             // 运行时统计，编译时定义DB_NO_STATS则去掉所有计数
+#endif
 
 #define DB_HEAD_SIZE  (4096UL) // head size must be pow of 2! 文件数据库的头大小
-#define DB_BLOCK_SIZE (8192UL) // block size must be pow of 2! 文件数据库的数据块大小
+#define DB_POOL_SIZE  (8UL<<20)// 缓冲池默认的内存预算
+#define DB_POOL_MIN   (16UL)   // 缓冲池最少的帧数
+#define DB_MAP_SIZE   (1UL<<36)// mmap预留的虚拟地址空间
+#define DB_WAL_BATCH  (64UL)   // DB_SYNC_PERIOD时，默认每多少次提交同步一次日志
+#define DB_WAL_SIZE   (64UL<<20)// 日志超过该大小时做检查点
+#define DB_WAL_MAGIC  (0x4c415744U)
+#define DB_WAL_GROUP  (64UL)   // 组提交最多包含的写操作数
+#define DB_BATCH_MAX  (65536UL) // db_write_batch一批最多的操作数，启用预写日志时整批修改的数据块都暂存在缓冲池中
+#define DB_LATCH_BUCKET (1024UL)// 闩锁哈希表的桶数，must be pow of 2!
+#define DB_SCRATCH    (5)      // 每个线程的数据块缓冲数
+#define DB_BULK_LEVEL (16)     // 批量加载支持的最大树高
+#define DB_BULK_RUN   (64UL)   // 批量加载每次预留的连续数据块数
+#define DB_CURSOR_READAHEAD (8)// 游标预读的兄弟子树数
+#define DB_PREFETCH   (16)     // 一次最多预读到缓冲池的数据块数
+#define DB_RING_DEPTH (64U)    // io_uring的队列深度，批量读写时每次最多提交的请求数
+#define DB_SEARCH_WINDOW (8)   // 整数key二分查找缩小到该数量后线性比较
+#define DB_VALUE_CLASS (9)     // 空洞的大小等级数，按2的幂划分，16字节到4K，最后一级包括更大的空洞
+#define DB_HOLE_HINT  (12)     // 每个大小等级最多记录的有空洞的数据块数
+#define DB_HOLE_MAP   (DB_HEAD_SIZE/2) // 正常关闭时，空洞表保存在文件头中的位置，需放得下db_hole
+#define DB_STAT_SLOTS (64U)    // 统计计数的分片数，线程按序号固定使用其中一片，must be pow of 2!
+#define DB_SNAP_BUCKET (256UL) // 快照旧版本哈希表的初始桶数，must be pow of 2!
+#define DB_SNAP_MEMORY (16UL<<20) // 快照旧版本在内存中的默认上限，超过时写入临时文件
+#define DB_SNAP_LATCH (64UL)   // 快照按数据块位置分段加锁的段数，must be pow of 2!
+#define DB_LZ_MIN     (32UL)   // 压缩模式下，不小于该长度的value才尝试压缩
+#define DB_LZ_HASH    (12)     // 压缩时哈希表的位数，表在栈上，4 << DB_LZ_HASH字节
+#define DB_BLOOM_BITS (64UL)   // 布隆过滤器每个key最多的位数
+#define DB_BLOOM_MIN  (1UL<<16)// 布隆过滤器至少按该key数分配空间
+#define DB_BLOOM_K    (16U)    // 每个key最多设置的位数
+#define DB_FILL       (0.9)    // db_options.fill为0时，在树的右（左）边缘分裂时左（右）节点保留的比例
 
 #define BTREE_NON_LEAF 0 /** 非叶子节点 */
 #define BTREE_LEAF     1 /** 叶子节点 */
+#define BTREE_EXTENT   1 /** btree_value数据块属于大value的区段 */
 
 /**
  * @brief 存储数据对齐方式
@@ -34,14 +82,6 @@
 #define TYPE_KEY   0
 #define TYPE_VALUE 1
 
-/**
- * @brief 创建数据库时，指定的key类型
- */
-#define DB_STRINGKEY 0 /** 4 <= max_key_size <= 128, include '\0', 包含'\0'在内 */
-#define DB_BYTESKEY  1 /** 4 <= max_key_size <= 128 */
-#define DB_INT32KEY  2 /** max_key_size = sizeof(int32_t) */
-#define DB_INT64KEY  3 /** max_key_size = sizeof(int64_t) */
-
 typedef struct{
     off_t value;
     off_t child;
@@ -53,6 +93,15 @@ typedef struct{
     unsigned char value[0];
 }btree_value;
 
+#define VALUE_HOLE (~(SIZE_MAX >> 1)) /** btree_value.size的最高位，表示已释放的空洞，其余位是空洞的容量 */
+#define value_slot(size) db_align(sizeof(btree_value) + ((size) & ~VALUE_HOLE), DB_ALIGNMENT) // 在数据块中占用的空间
+
+#define VALUE_INLINE ((off_t)1 << 62) /** btree_key.value的该位表示value存放在关键字的槽中、key之后，低位是长度 */
+#define value_inline(offset) (((offset) & VALUE_INLINE) != 0)
+#define inline_len(offset) ((size_t)((offset) & ~VALUE_INLINE))
+#define inline_data(db,k) ((k)->key + (db)->key_size) // db可以是db_t或db_key_info
+#define inline_fits(db,size) ((db)->inline_size != 0 && (size) <= (db)->inline_size)
+
 /**
  * @brief 文件数据库的数据块的头
  */
@@ -62,29 +111,361 @@ typedef struct{
     off_t free;       /** 空闲链表节点 */
     uint32_t use:1;   /** 当前数据块是否被使用 */
     uint32_t type:1;  /** 当前数据块作为btree_key或btree_value */
-    uint32_t leaf:1;  /** 当前数据块作为btree_key时，表示节点为叶子节点或非叶子节点 */
-    uint32_t last:29; /** 当前数据块作为btree_value时，表示数据块未分配的空间 */
+    uint32_t leaf:1;  /** 当前数据块作为btree_key时，表示节点为叶子节点或非叶子节点；作为btree_value时，表示是否属于区段 */
+    uint32_t last:29; /** 当前数据块作为btree_value时，表示数据块未分配的空间；区段的第一个数据块中表示区段的块数 */
+    uint32_t crc;     /** 写入文件时整个数据块的crc32c（计算时该字段为0），为0表示不校验 */
 }btree_node;
 
 #define btree_key_ptr(db,node,n) ((btree_key*)((char *)(node) + sizeof(*node) + (db->key_align) * (n)))
 #define btree_value_ptr(node,n) ((btree_value*)((char *)(node) + (n)))
+#define block_index(db,offset) (((offset) - DB_HEAD_SIZE) >> __builtin_ctzl((db)->block_size)) // 数据块的序号，db可以是db_t或db_pool
+
+/**
+ * @brief 缓冲池的帧
+ */
+typedef struct{
+    off_t self;        /** 帧缓存的数据块位置，0表示空闲帧 */
+    char *data;        /** 帧数据 */
+    int next;          /** 哈希冲突链 */
+    uint32_t pin;      /** 固定计数，大于0时不会被换出 */
+    uint32_t ref:1;    /** CLOCK访问位 */
+    uint32_t dirty:1;  /** 帧已被修改，尚未写回文件 */
+    uint32_t log:1;    /** 帧已被修改，尚未写入日志，不能被换出 */
+}db_frame;
+
+/**
+ * @brief 缓冲池，以数据块位置为键的页表，CLOCK置换
+ */
+typedef struct{
+    size_t nframe;     /** 帧数 */
+    size_t mask;       /** 哈希桶数-1 */
+    size_t hand;       /** CLOCK指针 */
+    int *bucket;       /** 哈希桶，-1表示空 */
+    db_frame *frame;
+    size_t base;       /** 创建时的帧数，之后扩充的帧数据单独分配 */
+    size_t block_size; /** 帧的大小，即数据块大小 */
+    size_t hit;        /** 命中次数 */
+    size_t miss;       /** 未命中次数 */
+    int *log;          /** 尚未写入日志的帧的序号，提交时只访问这些帧 */
+    size_t nlog;
+    size_t log_cap;
+    pthread_mutex_t lock; /** 保护页表、CLOCK与帧的状态，不保护帧数据（由闩锁保护） */
+}db_pool;
+
+/**
+ * @brief io_uring的提交队列与完成队列，直接使用系统调用，只在持有缓冲池的锁时使用
+ */
+typedef struct{
+    int fd;
+    unsigned depth;    /** 提交队列的长度 */
+    unsigned *sq_head; /** 内核取走请求时前移 */
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    void *sq_ring;     /** 映射的提交队列，内核支持IORING_FEAT_SINGLE_MMAP时也包含完成队列 */
+    void *cq_ring;
+    size_t sq_size;
+    size_t cq_size;
+}db_ring;
+
+/**
+ * @brief 一片统计计数，按缓存行对齐，不同线程的计数不在同一缓存行
+ */
+typedef struct{
+    db_stats_info info;
+}__attribute__((aligned(64))) db_counter;
+
+/**
+ * @brief 快照保存的数据块旧版本，同时打开的多个快照共享，引用数为0时释放
+ */
+typedef struct{
+    size_t ref;
+    size_t slot;       /** 在snap_store中的槽 */
+}snap_image;
+
+/**
+ * @brief 旧版本的存储：前mem_slots个槽在内存中（第一次使用时映射），之后的槽在临时文件中
+ * 分配与释放槽时持有lock，各个槽的读写不加锁；最后一个快照关闭时全部释放
+ */
+typedef struct{
+    char *mem;         /** 内存中的槽，未映射时为NULL */
+    size_t mem_slots;  /** 内存中的槽数，映射失败时为0，释放时恢复为limit */
+    size_t limit;      /** 按db_options.snap_memory计算的内存中的槽数 */
+    size_t next;       /** 从未使用过的下一个槽 */
+    size_t *free;      /** 释放的槽，之后优先使用 */
+    size_t nfree;
+    size_t cap;        /** free的容量 */
+    int fd;            /** 临时文件，未创建时为-1 */
+    pthread_mutex_t lock;
+}snap_store;
+
+typedef struct snap_entry{
+    off_t offset;
+    snap_image *image;
+    struct snap_entry *next;
+}snap_entry;
+
+#define BLOOM_LINE (64UL) /** 布隆过滤器每行的字节数，即一个缓存行 */
+
+/**
+ * @brief 分块的布隆过滤器，每个key只在一行中设置k位，查询只访问一个缓存行
+ * 插入时加入，删除时不清除；加入的key超过容量时重建
+ */
+typedef struct{
+    size_t lines;      /** 行数 */
+    size_t cap;        /** 按多少个key分配的空间 */
+    size_t added;      /** 建立以来设置了新的位的key数，包括之后删除的 */
+    uint32_t k;        /** 每个key设置的位数 */
+    uint64_t *bits;    /** lines * BLOOM_LINE字节，按缓存行对齐 */
+}db_bloom;
+
+/**
+ * @brief 数据块的闩锁，按数据块位置动态分配，引用数为0时放回空闲链表
+ * 加锁顺序：父节点在子节点之前，兄弟节点只在持有父节点时加锁，value数据块在Btree节点之后，所以不会死锁
+ */
+#define LATCH_S   0 /** 共享，读操作 */
+#define LATCH_X   1 /** 排他，写操作 */
+#define LATCH_TRY 2 /** 排他，已被占用时不等待，返回NULL */
+
+typedef struct db_latch{
+    off_t self;              /** 数据块位置 */
+    uint32_t ref;            /** 持有或等待的线程数 */
+    pthread_rwlock_t lock;
+    struct db_latch *next;
+}db_latch;
+
+typedef struct{
+    pthread_mutex_t lock;
+    db_latch *head;          /** 使用中的闩锁 */
+    db_latch *free;          /** 空闲的闩锁 */
+}db_latch_bucket;
+
+/**
+ * @brief 批量写第一次修改已提交、尚未写回文件的帧之前保存的内容，出错时恢复
+ */
+typedef struct{
+    off_t self;
+    char *data;
+}wal_undo;
+
+/**
+ * @brief 预写日志，位于数据库文件旁的"<path>-wal"
+ * 每次写操作结束时提交：将修改过的数据块与文件头的镜像追加到日志，数据块暂存在缓冲池中，检查点时才写回数据库文件
+ */
+typedef struct{
+    int fd;            /** 日志文件句柄 */
+    int sync;          /** DB_SYNC_NONE, DB_SYNC_BATCH, DB_SYNC_OP, DB_SYNC_PERIOD */
+    size_t batch;      /** DB_SYNC_PERIOD时，每多少次提交同步一次 */
+    size_t limit;      /** 日志超过该大小时做检查点 */
+    off_t size;        /** 日志的长度 */
+    uint64_t lsn;      /** 最后一次提交的序号 */
+    size_t pending;    /** 尚未同步的提交数 */
+    int active;        /** 正在执行的写操作数，为0时提交 */
+    int closing;       /** 本组已关闭，新的写操作等待本组提交 */
+    uint64_t epoch;    /** 组的序号，每次提交加1 */
+    size_t ops;        /** 本组已结束的写操作数 */
+    int error;         /** 本组提交的结果 */
+    int head;          /** 文件头已修改，尚未写入日志 */
+    int undo;          /** db_write_batch独占执行期间为1，帧修改前保存已提交的内容 */
+    wal_undo *image;   /** 保存的帧内容 */
+    size_t nimage;
+    size_t image_cap;
+    char *buf;         /** 提交缓冲 */
+    size_t cap;        /** 提交缓冲的大小 */
+    char path[PATH_MAX];
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /** 组提交完成 */
+}db_wal;
+
+/**
+ * @brief 日志记录的类型
+ */
+#define WAL_PAGE   0 /** 数据块镜像 */
+#define WAL_HEAD   1 /** 文件头镜像 */
+#define WAL_COMMIT 2 /** 提交，之前相同序号的记录生效 */
+
+typedef struct{
+    uint32_t magic;    /** DB_WAL_MAGIC */
+    uint32_t type;     /** WAL_PAGE, WAL_HEAD, WAL_COMMIT */
+    uint64_t lsn;      /** 提交序号 */
+    off_t offset;      /** 数据块的位置 */
+    uint32_t size;     /** 之后的数据长度 */
+    uint32_t crc;      /** 记录头（crc为0）与数据的crc32c */
+}wal_record;
+
+/**
+ * @brief 有空洞的btree_value数据块，按最大空洞的大小等级记录，分配时优先使用
+ * 只是提示：运行时维护，正常关闭时保存在文件头的DB_HOLE_MAP处，崩溃之后丢失，数据块再次释放value时重新记录
+ */
+typedef struct{
+    uint32_t n[DB_VALUE_CLASS];
+    struct{
+        off_t self;    /** 数据块位置 */
+        size_t size;   /** 最大空洞的容量 */
+    }block[DB_VALUE_CLASS][DB_HOLE_HINT];
+}db_hole;
+
+/**
+ * @brief 在线整理的阶段，每次调用db_compact推进一部分
+ */
+#define COMPACT_IDLE     0 /** 没有进行整理 */
+#define COMPACT_PLAN     1 /** 逐个访问数据块，统计整理之后需要的数据块数，确定limit */
+#define COMPACT_SWEEP    2 /** 从空闲链表中摘除limit之后的数据块 */
+#define COMPACT_MOVE     3 /** 按key的顺序遍历，把limit之后的Btree节点、区段与value，以及半空的数据块中的value移到前面 */
+#define COMPACT_TRUNCATE 4 /** 截断文件尾的空闲数据块 */
+#define COMPACT_RELINK   5 /** limit与文件尾之间剩下的空闲数据块放回空闲链表 */
+
+/**
+ * @brief 在线整理的状态，运行时维护
+ * 整理期间limit之后释放的数据块不放回空闲链表，分配value时也跳过它们，它们最终被截断或在COMPACT_RELINK时放回
+ */
+typedef struct{
+    int phase;
+    int started;       /** COMPACT_MOVE时key是否有效 */
+    int pass;          /** COMPACT_MOVE的遍历次数 */
+    int stuck;         /** 本次遍历有没能移动的数据块或区段，腾出空间之后再遍历一次 */
+    off_t limit;       /** 整理的目标位置，为0时没有进行整理（包括COMPACT_PLAN）；COMPACT_RELINK时随已放回的位置增长 */
+    off_t pos;         /** COMPACT_PLAN时下一个访问的数据块 */
+    off_t end;         /** COMPACT_PLAN开始时的文件尾 */
+    size_t blocks;     /** COMPACT_PLAN时统计的Btree节点、区段与不移动的btree_value数据块数 */
+    size_t bytes;      /** COMPACT_PLAN时统计的半空的数据块中value的字节数 */
+    uint8_t *sparse;   /** value占用不到一半的btree_value数据块的位图，COMPACT_MOVE时移走其中的value */
+    size_t nsparse;    /** 位图的位数 */
+    off_t prev;        /** COMPACT_SWEEP时已检查过的空闲数据块，0表示从链表头开始 */
+    off_t dst;         /** COMPACT_MOVE时区段从此处开始寻找空间，之前的数据块上次寻找时都在使用中 */
+    unsigned char key[128];/** COMPACT_MOVE时已处理的最后一个关键字，按off_t对齐 */
+}db_compaction;
+
+/**
+ * @brief 按key类型特化的Btree操作，打开数据库时选择
+ */
+struct db_s;
+typedef struct{
+    int (*insert)(struct db_s*,void*,void*,size_t,int);
+    int (*delete)(struct db_s*,void*);
+    int (*search)(struct db_s*,void*,size_t,void*,size_t,size_t*);
+    int (*update)(struct db_s*,void*,void*,size_t);
+    int (*view)(struct db_s*,void*,db_view*);
+}db_ops;
+
+static const db_ops* btree_ops_select(int key_type); // 在Btree操作之后定义
 
 /**
  * @brief 文件数据库的头，即是句柄
  */
-typedef struct db_s{
+struct db_s{
     int fd;                             /** 文件句柄 */
     int key_type;                       /** key类型，必须在创建文件数据库时指定 */
     size_t key_size;                    /** key的最大长度 */
-    size_t key_align;                   /** 对齐，值 = db_align(sizeof(btree_key) + key_size, DB_ALIGNMENT) */
+    size_t key_align;                   /** 对齐，值 = db_align(sizeof(btree_key) + key_size + inline_size, DB_ALIGNMENT) */
     size_t M;                           /** Btree 节点child的最大值 */
     size_t key_total;                   /** 已存储的key总数 */
     size_t key_use_block;               /** 数据块为btree_key类型的总数 */
     size_t value_use_block;             /** 数据块为btree_value类型的总数 */ 
     off_t free;                         /** 空闲链表的头 */
     off_t current;                      /** 当前作为btree_value的数据块，未用完分配空间 */
-    int (*key_cmp)(void*,void*,size_t); /** key比较方式 */
-}db_t;
+    uint64_t lsn;                       /** 最后一次检查点时日志的提交序号 */
+    off_t end;                          /** 已分配的文件尾，之后的数据块属于未提交的写操作，打开时丢弃 */
+    uint32_t clean;                     /** 正常关闭时为1，打开期间为0；为1时打开只校验文件头 */
+    uint32_t compress;                  /** 创建时指定DB_COMPRESS时为1，value按压缩格式存储 */
+    uint32_t bloom_bits;                /** 布隆过滤器每个key的位数，0表示不使用 */
+    uint32_t bloom_crc;                 /** 正常关闭时保存的布隆过滤器的crc32c */
+    size_t bloom_lines;                 /** 正常关闭时保存在文件尾之后的布隆过滤器的行数，0表示没有保存 */
+    size_t bloom_cap;                   /** 保存的布隆过滤器的容量与已加入的key数 */
+    size_t bloom_added;
+    uint32_t inline_size;               /** 创建时指定，不超过该长度的value存放在关键字的槽中，0表示不使用 */
+    size_t block_size;                  /** 数据块大小，创建时指定，DB_BLOCK_MIN到DB_BLOCK_MAX之间的2的幂；旧版本的文件头为0，即DB_BLOCK_SIZE */
+    int (*key_cmp)(void*,void*,size_t); /** key比较方式，以下均为运行时字段，不持久化 */
+    const db_ops *ops;                  /** 按key类型特化的Btree操作 */
+    db_pool *pool;                      /** 缓冲池，运行时创建，mmap存储引擎时为NULL */
+    char *map;                          /** mmap存储引擎的映射基址，预留map_reserve字节 */
+    size_t map_size;                    /** 已映射文件的长度 */
+    size_t map_reserve;                 /** 预留的虚拟地址空间 */
+    db_wal *wal;                        /** 预写日志，未启用时为NULL */
+    db_ring *ring;                      /** io_uring，未启用或内核不支持时为NULL */
+    uint64_t gen;                       /** 修改计数，游标据此判断副本是否失效 */
+    uint32_t writers;                   /** 正在执行的写操作数 */
+    pthread_mutex_t lock;               /** 保护文件头的计数、空闲链表、current、hole、extending与compaction.limit */
+    db_hole hole;                       /** 有空洞的btree_value数据块 */
+    uint32_t extending;                 /** 已预留但还没有写完的区段数，整理时不截断文件尾 */
+    db_compaction compaction;           /** 在线整理的状态 */
+    db_latch_bucket *latch;             /** 闩锁哈希表 */
+    db_latch *root;                     /** 根节点的闩锁 */
+    db_counter *stat;                   /** 统计计数，DB_STAT_SLOTS片，打开完成之前与DB_NO_STATS时为NULL */
+    db_snapshot *snap;                  /** 打开的快照链表，不为NULL时修改数据块前先保存旧版本 */
+    pthread_rwlock_t snap_lock;         /** 保护快照链表，写入数据块时共享，打开与关闭快照时排他 */
+    pthread_rwlock_t *snap_latch;       /** DB_SNAP_LATCH段，按数据块位置分段：保存旧版本并写入时排他，快照读出该数据块时共享 */
+    snap_store images;                  /** 快照旧版本的存储 */
+    pthread_rwlock_t quiesce;           /** 写操作期间共享，打开快照与重建布隆过滤器时排他 */
+    db_bloom *bloom;                    /** 布隆过滤器，未启用时为NULL；查询持有根节点的闩锁时访问，写操作持有quiesce时加入 */
+    size_t fill;                        /** 在树的边缘分裂时满的一侧保留的关键字数，打开时按db_options.fill计算 */
+    int share;                          /** 指定了db_options.fill：随机插入时已满的节点先移给未达到fill的兄弟 */
+};
+
+/**
+ * @brief 只读快照，打开之后第一次修改数据块前保存该数据块的旧版本，没有保存的数据块即是打开时的内容
+ * 打开时的文件尾之后的数据块是之后分配的，快照不会访问
+ */
+struct db_snapshot_s{
+    db_t *db;
+    off_t end;                          /** 打开时的文件尾 */
+    int stale;                          /** 保存旧版本失败，快照不再可读 */
+    size_t mask;                        /** 哈希表桶数-1 */
+    size_t count;                       /** 已保存的旧版本数 */
+    snap_entry **bucket;                /** 已保存的旧版本，按数据块位置哈希 */
+    pthread_rwlock_t lock;              /** 保护哈希表，查找时共享，加入时排他 */
+    struct db_snapshot_s *next;
+};
+
+#define DB_HEAD_PERSIST offsetof(db_t, key_cmp) // 文件头需要持久化的长度
+
+#ifdef DB_STATS
+static uint32_t stat_threads;                   /** 已分配序号的线程数 */
+static __thread uint32_t stat_slot = UINT32_MAX; /** 本线程使用的计数分片 */
+
+/**
+ * @brief 本线程的计数分片，线程数不超过DB_STAT_SLOTS时独占，超过时与其他线程共享，因此计数用原子操作
+ */
+inline static db_stats_info* stat_local(db_t *db){
+    if(db->stat == NULL){
+        return NULL;
+    }
+    if(stat_slot == UINT32_MAX){
+        stat_slot = __atomic_fetch_add(&stat_threads, 1, __ATOMIC_RELAXED) & (DB_STAT_SLOTS-1);
+    }
+    return &db->stat[stat_slot].info;
+}
+
+#define stat_add(db,field,n) do{db_stats_info *s_ = stat_local(db); if(s_ != NULL) __atomic_add_fetch(&s_->field, (n), __ATOMIC_RELAXED);}while(0)
+
+inline static uint64_t stat_clock(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * @brief 记录一次操作的延迟
+ * @param[in] begin stat_clock()的返回值
+ */
+inline static void stat_latency(db_t *db, int op, uint64_t begin){
+    uint64_t ns = stat_clock() - begin;
+    int i = 63 - __builtin_clzl(ns | 1);
+    stat_add(db, latency[op][i < DB_STAT_BUCKETS ? i : DB_STAT_BUCKETS - 1], 1);
+}
+#else
+#define stat_add(db,field,n) ((void)0)
+#define stat_clock() 0
+#define stat_latency(db,op,begin) ((void)(begin))
+#endif
+
+#define stat_read(db,n,bytes) do{stat_add(db, reads, n); stat_add(db, read_bytes, bytes);}while(0)
+#define stat_write(db,n,bytes) do{stat_add(db, writes, n); stat_add(db, write_bytes, bytes);}while(0)
 
 static int cmp_string(void *a, void *b, size_t n){
     return strncmp((char*)a, (char*)b, n);
@@ -94,12 +475,174 @@ static int cmp_bytes(void *a, void *b, size_t n){
     return memcmp(a, b, n);
 }
 
+// 不能用相减，int32会溢出，int64截断为int后符号会错
 static int cmp_int32(void *a, void *b, size_t n){
-    return *(int32_t*)a - *(int32_t*)b;
+    int32_t x = *(int32_t*)a, y = *(int32_t*)b;
+    return (x > y) - (x < y);
 }
 
 static int cmp_int64(void *a, void *b, size_t n){
-    return *(int64_t*)a - *(int64_t*)b;
+    int64_t x = *(int64_t*)a, y = *(int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief key的参数，特化的Btree操作中，整数key的key_size与key_align是编译期常量（value存放在关键字的槽中时key_align从文件头读取），M随数据块大小从文件头读取
+ * 字段名与db_t相同，btree_key_ptr、keycpy可以直接使用
+ */
+typedef struct{
+    size_t key_size;
+    size_t key_align;
+    size_t M;
+}db_key_info;
+
+#define DB_INLINE inline static __attribute__((always_inline))
+#define key_info_int(type) {sizeof(type), db->inline_size ? db->key_align : db_align(sizeof(btree_key) + sizeof(type), DB_ALIGNMENT), db->M}
+
+/**
+ * @brief 取得key的参数，key_type为常量时，整数key只从文件头读取M（db_checker已确认文件头与之一致）
+ */
+DB_INLINE db_key_info key_info(db_t *db, int key_type){
+    db_key_info int32 = key_info_int(int32_t), int64 = key_info_int(int64_t), info;
+    switch (key_type)
+    {
+    case DB_INT32KEY:
+        return int32;
+    case DB_INT64KEY:
+        return int64;
+    default:
+        info.key_size = db->key_size;
+        info.key_align = db->key_align;
+        info.M = db->M;
+        return info;
+    }
+}
+
+/**
+ * @brief 比较key，key_type为常量时内联为一次比较
+ */
+DB_INLINE int key_compare(int key_type, void *a, void *b, size_t n){
+    switch (key_type)
+    {
+    case DB_STRINGKEY:
+        return cmp_string(a, b, n);
+    case DB_BYTESKEY:
+        return cmp_bytes(a, b, n);
+    case DB_INT32KEY:
+        return cmp_int32(a, b, n);
+    default:
+        return cmp_int64(a, b, n);
+    }
+}
+
+/**
+ * @brief 节点内二分查找key
+ * @return >=0 key的下标，<0 不存在，-(插入位置)-1
+ */
+DB_INLINE int key_search_cmp(db_key_info *ki, int key_type, btree_node *node, void* target)
+{
+    int low = 0, high = node->num - 1, mid, rc;
+    while (low <= high) {
+        mid = low + (high - low) / 2;
+        rc = key_compare(key_type, target, btree_key_ptr(ki,node,mid)->key, ki->key_size);
+        if(rc == 0){
+            return mid;
+        }else if(rc > 0){
+            low = mid + 1;
+        }else{
+            high = mid - 1;
+        }
+    }
+    return -low-1;
+}
+
+/**
+ * @brief 整数key的节点内查找
+ * 无分支的二分查找把范围缩小到DB_SEARCH_WINDOW个key，再统计其中小于target的个数，即是插入位置
+ * 没有分支预测的推测执行，所以预取下一轮两个可能的位置
+ * key之间相隔key_align字节，SIMD版本用gather一次取出整个窗口
+ */
+#define key_search_int(name,type,qual,window)                                                \
+qual int key_search_##name(db_key_info *ki, btree_node *node, void *target){    \
+    type t = *(type*)target;                                                              \
+    char *base = (char*)btree_key_ptr(ki,node,0)->key;                                    \
+    size_t align = ki->key_align, low = 0, n = node->num, half;                          \
+    while(n > DB_SEARCH_WINDOW){                                                          \
+        half = n / 2;                                                                     \
+        __builtin_prefetch(base + align * (low + half / 2));                              \
+        __builtin_prefetch(base + align * (low + half + half / 2));                       \
+        low = *(type*)(base + align * (low + half)) < t ? low + half : low;               \
+        n -= half;                                                                        \
+    }                                                                                     \
+    window;                                                                               \
+    if(low < node->num && *(type*)(base + align * low) == t){                             \
+        return low;                                                                       \
+    }                                                                                     \
+    return -(int)low-1;                                                                   \
+}
+
+#define window_scan(type) for(half = low + n; low < half && *(type*)(base + align * low) < t; low++)
+
+key_search_int(int32,int32_t,DB_INLINE,window_scan(int32_t))
+key_search_int(int64,int64_t,DB_INLINE,window_scan(int64_t))
+
+#ifdef DB_SIMD
+// AVX2的实现不能强制内联到普通函数中，只在同样以DB_AVX2编译的特化操作中内联
+#define DB_AVX2 __attribute__((target("avx2")))
+
+/**
+ * @brief 取出窗口内的n个key（n <= 8），统计小于t的个数
+ */
+DB_AVX2 inline static int window_less_int32(char *base, size_t align, size_t n, int32_t t){
+    __m256i lane = _mm256_setr_epi32(0,1,2,3,4,5,6,7);
+    __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)n), lane);
+    __m256i index = _mm256_mullo_epi32(lane, _mm256_set1_epi32((int)align));
+    __m256i key = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (int*)base, index, mask, 1);
+    __m256i less = _mm256_and_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(t), key), mask);
+    return __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(less)));
+}
+
+/**
+ * @brief 取出窗口内的n个key（n <= 8），分两次各4个，统计小于t的个数
+ */
+DB_AVX2 inline static int window_less_int64(char *base, size_t align, size_t n, int64_t t){
+    __m128i lane = _mm_setr_epi32(0,1,2,3);
+    __m128i index = _mm_mullo_epi32(lane, _mm_set1_epi32((int)align));
+    __m256i target = _mm256_set1_epi64x(t);
+    int i, count = 0;
+    for(i=0;i<(int)n;i+=4){
+        __m256i mask = _mm256_cvtepi32_epi64(_mm_cmpgt_epi32(_mm_set1_epi32((int)n - i), lane));
+        __m256i key = _mm256_mask_i32gather_epi64(_mm256_setzero_si256(), (long long*)(base + align * i), index, mask, 1);
+        __m256i less = _mm256_and_si256(_mm256_cmpgt_epi64(target, key), mask);
+        count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(less)));
+    }
+    return count;
+}
+
+key_search_int(simd_int32,int32_t,DB_AVX2 inline static,low += window_less_int32(base + align * low, align, n, t))
+key_search_int(simd_int64,int64_t,DB_AVX2 inline static,low += window_less_int64(base + align * low, align, n, t))
+#endif
+
+/**
+ * @brief 节点内查找key，key_type与simd为常量时只保留对应的实现
+ * simd只在DB_AVX2的函数中为1
+ */
+#ifdef DB_SIMD
+#define key_search_simd(name,ki,node,target) key_search_simd_##name(ki, node, target)
+#else
+#define key_search_simd(name,ki,node,target) key_search_##name(ki, node, target)
+#endif
+
+DB_INLINE int key_find(db_key_info *ki, int key_type, int simd, btree_node *node, void *target){
+    switch (key_type)
+    {
+    case DB_INT32KEY:
+        return simd ? key_search_simd(int32, ki, node, target) : key_search_int32(ki, node, target);
+    case DB_INT64KEY:
+        return simd ? key_search_simd(int64, ki, node, target) : key_search_int64(ki, node, target);
+    default:
+        return key_search_cmp(ki, key_type, node, target);
+    }
 }
 
 /** 
@@ -107,813 +650,6854 @@ static int cmp_int64(void *a, void *b, size_t n){
 */
 inline static ssize_t head_seek(db_t *db){
     int fd = db->fd;
-    int (*key_cmp)(void*,void*,size_t) = db->key_cmp;
+    char runtime[sizeof(db_t) - DB_HEAD_PERSIST];
+    memcpy(runtime, (char*)db + DB_HEAD_PERSIST, sizeof(runtime));
     ssize_t rc = pread(fd,db,DB_HEAD_SIZE,0);
     db->fd = fd;
-    db->key_cmp = key_cmp;
+    memcpy((char*)db + DB_HEAD_PERSIST, runtime, sizeof(runtime));
     return rc;
 }
 
 /** 
- * @brief 写入文件数据库的头，即是数据库句柄
+ * @brief 写入文件数据库的头，即是数据库句柄，调用者需持有db->lock
+ * 启用预写日志时，文件头在提交时写入日志，检查点时才写回
 */
 inline static ssize_t head_flush(db_t *db){
-    return pwrite(db->fd,db,DB_HEAD_SIZE,0);
+    if(db->wal != NULL){
+        db->wal->head = 1;
+        return DB_HEAD_PERSIST;
+    }
+    // 只写入需要持久化的部分，运行时字段可能正被其他线程修改
+    stat_write(db, 1, DB_HEAD_PERSIST);
+    return pwrite(db->fd,db,DB_HEAD_PERSIST,0);
 }
 
-/** 
- * @brief 读出文件数据库的数据块
-*/
-inline static ssize_t node_seek(db_t *db, btree_node* node, off_t offset){
-    return pread(db->fd,node,DB_BLOCK_SIZE,offset);
-}
+static uint32_t crc32c_table[256];
+static int crc32c_hw;  /** 1使用crc32指令，0查表 */
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
 
-/** 
- * @brief 写入文件数据库的数据块
-*/
-inline static ssize_t node_flush(db_t *db, btree_node *node){
-    return pwrite(db->fd,node,DB_BLOCK_SIZE,node->self);
+#ifdef DB_SIMD
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t size){
+    uint64_t c = crc, v;
+    for(;size>=8;size-=8,p+=8){
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    while(size--){
+        c = _mm_crc32_u8(c, *p++);
+    }
+    return c;
 }
+#endif
 
-/** 
- * @brief 分配文件数据库的数据块
-*/
-inline static int node_create(db_t *db, btree_node* node, int leaf, int type){
-    if(db->free != 0L){
-        // 空闲链表不为空
-        node_seek(db,node,db->free);
-        db->free = node->free;
-    }else{
-        // 空闲链表为空，在文件尾追加
-        struct stat stat;
-        fstat(db->fd,&stat);
-        memset(node,0,DB_BLOCK_SIZE);
-        node->self = stat.st_size;
-        if(node_flush(db,node) != DB_BLOCK_SIZE){
-            // 存储空间不够时，只会写入部分数据
-            ftruncate(db->fd, stat.st_size);
-            errno = ENOMEM;
-            return -1;
+/**
+ * @brief 生成查表用的表并检测crc32指令，只执行一次，多个线程（句柄）同时第一次计算时等待
+ */
+static void crc32c_init(void){
+    uint32_t c;
+    int i, k;
+    for(i=0;i<256;i++){
+        c = i;
+        for(k=0;k<8;k++){
+            c = c & 1 ? 0x82f63b78U ^ (c >> 1) : c >> 1;
         }
+        crc32c_table[i] = c;
     }
-    if(type == TYPE_KEY){
-        db->key_use_block++;
-    }else{
-        db->value_use_block++;
-        db->current = node->self;
+#ifdef DB_SIMD
+    crc32c_hw = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+
+/**
+ * @brief crc32c (Castagnoli)，数据块与日志记录的校验和，CPU支持SSE4.2时使用crc32指令
+ */
+static uint32_t db_crc32c(uint32_t crc, const void *buf, size_t size){
+    const unsigned char *p = buf;
+    pthread_once(&crc32c_once, crc32c_init);
+    crc = ~crc;
+#ifdef DB_SIMD
+    if(crc32c_hw == 1){
+        return ~crc32c_sse42(crc, p, size);
     }
-    head_flush(db);
+#endif
+    while(size--){
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
 
-    node->num = 0;
-    node->free = 0;
-    node->leaf = leaf;
-    node->use = 1;
-    node->type = type;
-    node->last = sizeof(btree_node);
-    memset((char*)node + sizeof(btree_node), 0, DB_BLOCK_SIZE-sizeof(btree_node));
-    return node_flush(db,node);
+/**
+ * @brief 数据块的校验和，不修改数据块（可能是其他线程正在读取的帧）
+ * @param[in] size 数据块大小
+ */
+static uint32_t node_crc(btree_node *node, size_t size){
+    btree_node head = *node;
+    head.crc = 0;
+    return db_crc32c(db_crc32c(0, &head, sizeof(head)), (char*)node + sizeof(head), size - sizeof(head));
 }
 
-/** 
- * @brief 释放文件数据库的数据块
-*/
-inline static void node_destroy(db_t *db, btree_node *node){
-    node->free = db->free;
-    db->free = node->self;// 加入空闲链表中
-    node->num = 0;
-    node->use = 0;
-    if(node->type == TYPE_KEY){
-        db->key_use_block--;
-    }else{
-        db->value_use_block--;
-    }
-    head_flush(db);
-    node_flush(db,node);
-    return;
+/**
+ * @brief 写入文件之前计算数据块的校验和
+ */
+inline static void node_seal(btree_node *node, size_t size){
+    node->crc = node_crc(node, size);
 }
 
 /**
- * @brief create dateabase file, mode default 0664 创建数据库
- * @param[in] path 数据库文件路径
- * @param[in] key_type DB_STRINGKEY, DB_BYTESKEY, DB_INT32KEY, DB_INT64KEY
- * @param[in] max_key_size key长度最大值
+ * @brief 校验从文件读出的数据块
  * @return ==0 if successful, ==-1 error
-*/
-int db_create(char *path, int key_type, size_t max_key_size){
-    switch (key_type)
-    {
-    case DB_STRINGKEY:
-    case DB_BYTESKEY:
-        if(max_key_size < 4UL || max_key_size > 128UL){
-            errno = EINVAL;
-            return -1;
-        }
-        break;
-    case DB_INT32KEY:
-        if(max_key_size != sizeof(int32_t)){
-            errno = EINVAL;
-            return -1;
-        }
-        break;
-    case DB_INT64KEY:
-        if(max_key_size != sizeof(int64_t)){
-            errno = EINVAL;
-            return -1;
-        }
-        break;
-    default:
-        errno = EINVAL;
+ */
+inline static int node_verify(btree_node *node, off_t offset, size_t size){
+    if(node->self != offset || (node->crc != 0 && node->crc != node_crc(node, size))){
+        errno = EIO;
         return -1;
-        break;
     }
+    return 0;
+}
 
-    size_t key_align = db_align(sizeof(btree_key) + max_key_size,DB_ALIGNMENT);
-
-    if(DB_BLOCK_SIZE < sizeof(btree_node) + key_align){
-        errno = EINVAL;
+/**
+ * @brief 同步日志
+ */
+static int wal_sync(db_t *db){
+    if(fdatasync(db->wal->fd) == -1){
         return -1;
     }
+    __atomic_store_n(&db->wal->pending, 0, __ATOMIC_SEQ_CST);
+    return 0;
+}
 
-    // 需要预留一个位置，比如M=5（关键字个数是4），分裂后变成左2右1，右插入变成左2右2，合并后变成M=6（关键字个数变成了5）
-    size_t M = (DB_BLOCK_SIZE - sizeof(btree_node))/key_align - 1;
-    if(M < 3){
-        errno = EINVAL;
-        return -1;
+static void ring_destroy(db_ring *ring){
+    if(ring == NULL){
+        return;
     }
-
-    if(access(path,F_OK) == 0){
-        errno = EEXIST;
-        return -1;
+    if(ring->sqe != NULL){
+        munmap(ring->sqe, ring->depth * sizeof(struct io_uring_sqe));
     }
-
-    int fd = open(path,O_CREAT|O_RDWR|O_TRUNC,0664);
-    if(fd == -1){
-        return -1;
+    if(ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring){
+        munmap(ring->cq_ring, ring->cq_size);
     }
-
-    char *buf = calloc(DB_HEAD_SIZE + DB_BLOCK_SIZE, sizeof(char));
-    if(buf == NULL){
-        close(fd);
-        return -1;
+    if(ring->sq_ring != NULL){
+        munmap(ring->sq_ring, ring->sq_size);
     }
+    close(ring->fd);
+    free(ring);
+}
 
-    db_t *db = (db_t *)buf;
-    db->fd = fd;
-    db->key_type = key_type;
-    db->key_size = max_key_size;
-    db->key_align = key_align;
-    db->M = M;
-    db->key_total = 0;
-    db->key_use_block = 1;// Btree根的数据块，绝对不会被释放
-    db->value_use_block = 0;
-    db->free = 0;
-    db->current = 0;
-
-    if(head_flush(db) != DB_HEAD_SIZE){
-        close(fd);
-        free(buf);
-        return -1;
+/**
+ * @brief 创建io_uring，IORING_OP_READ/WRITE需要5.6以上的内核（同时提供IORING_FEAT_RW_CUR_POS）
+ * @return NULL 内核不支持或出错，调用者退回pread/pwrite
+ */
+static db_ring* ring_create(unsigned depth){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    db_ring *ring = calloc(1, sizeof(db_ring));
+    if(ring == NULL){
+        return NULL;
     }
-
-    btree_node *root = (btree_node *)(buf + DB_HEAD_SIZE);
-    root->self = DB_HEAD_SIZE;
-    root->leaf = BTREE_LEAF;
-    root->use = 1;// Btree根的数据块，绝对不会被释放
-    if(node_flush(db, root) != DB_BLOCK_SIZE){
-        close(fd);
-        free(buf);
-        return -1;
+    if((ring->fd = syscall(SYS_io_uring_setup, depth, &p)) < 0){
+        free(ring);
+        return NULL;
     }
-
-    close(fd);
-    free(buf);
-    return 0;
+    ring->depth = p.sq_entries;
+    if(!(p.features & IORING_FEAT_RW_CUR_POS)){
+        ring_destroy(ring);
+        return NULL;
+    }
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        // 提交队列与完成队列在同一个映射中
+        ring->sq_size = ring->cq_size = ring->sq_size > ring->cq_size ? ring->sq_size : ring->cq_size;
+    }
+    void *sq = mmap(NULL, ring->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sq_ring = sq == MAP_FAILED ? NULL : sq;
+    if(ring->sq_ring != NULL && (p.features & IORING_FEAT_SINGLE_MMAP)){
+        ring->cq_ring = ring->sq_ring;
+    }else if(ring->sq_ring != NULL){
+        void *cq = mmap(NULL, ring->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        ring->cq_ring = cq == MAP_FAILED ? NULL : cq;
+    }
+    if(ring->cq_ring != NULL){
+        void *sqe = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        ring->sqe = sqe == MAP_FAILED ? NULL : sqe;
+    }
+    if(ring->sqe == NULL){
+        ring_destroy(ring);
+        return NULL;
+    }
+    char *sq_ring = ring->sq_ring, *cq_ring = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq_ring + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq_ring + p.cq_off.ring_mask);
+    ring->cqe = (struct io_uring_cqe *)(cq_ring + p.cq_off.cqes);
+    return ring;
 }
 
 /**
- * @brief 校验数据库的一致性
- * @param[in] db 数据库句柄
- * @return ==0 if successful, ==-1 error
-*/
-int db_checker(db_t *db){
-    struct stat stat;
-    if(fstat(db->fd, &stat) == -1){
-        return -1;
+ * @brief 取出完成队列中的结果
+ * @return 取出的个数
+ */
+static size_t ring_reap(db_ring *ring, ssize_t *res){
+    size_t n = 0;
+    unsigned head = *ring->cq_head;
+    while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+        struct io_uring_cqe *cqe = &ring->cqe[head & *ring->cq_mask];
+        res[cqe->user_data] = cqe->res;
+        head++;
+        n++;
     }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
 
-    if(stat.st_size < DB_HEAD_SIZE + DB_BLOCK_SIZE || (stat.st_size-DB_HEAD_SIZE)%DB_BLOCK_SIZE != 0){
-        return -1;
-    }
-    
-    switch (db->key_type)
-    {
-    case DB_STRINGKEY:
-    case DB_BYTESKEY:
-        if(db->key_size < 4UL || db->key_size > 128UL){
-            return -1;
+/**
+ * @brief 批量读写n个等长的数据块，每批最多depth个请求一次提交，等待全部完成，调用者需持有缓冲池的锁
+ * 出错时撤回未提交的请求，并等待已提交的请求完成后才返回，之后调用者可以重用或释放缓冲
+ * @param[in] write ==1 写入，==0 读出
+ * @param[out] res 每个请求的结果，读写的字节数或-errno
+ * @return ==0 已全部完成（结果见res） if successful, ==-1 error
+ */
+static int ring_batch(db_ring *ring, int fd, int write, char **buf, off_t *offset, size_t len, ssize_t *res, size_t n){
+    size_t done, i, m, sent;
+    unsigned tail, idx;
+    for(done=0;done<n;done+=m){
+        m = n - done < ring->depth ? n - done : ring->depth;
+        tail = *ring->sq_tail;
+        for(i=0;i<m;i++){
+            idx = (tail + i) & *ring->sq_mask;
+            struct io_uring_sqe *sqe = &ring->sqe[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uintptr_t)buf[done+i];
+            sqe->len = len;
+            sqe->off = offset[done+i];
+            sqe->user_data = done + i;
+            ring->sq_array[idx] = idx;
         }
-        break;
-    case DB_INT32KEY:
-        if(db->key_size != sizeof(int32_t)){
-            return -1;
+        __atomic_store_n(ring->sq_tail, tail + m, __ATOMIC_RELEASE);
+        // 提交并等待本批全部完成
+        size_t submit = m, reaped = 0;
+        int err = 0;
+        while(reaped < m){
+            int rc = syscall(SYS_io_uring_enter, ring->fd, submit, m - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+            if(rc < 0 && errno != EINTR){
+                err = errno;
+                break;
+            }
+            if(rc > 0){
+                submit -= rc;
+            }
+            reaped += ring_reap(ring, res);
         }
-        break;
-    case DB_INT64KEY:
-        if(db->key_size != sizeof(int64_t)){
+        if(err != 0){
+            // 内核还没取走的请求撤回，已取走的请求仍在读写缓冲，等它们全部完成（重试期间的错误忽略）
+            idx = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+            sent = idx - tail;
+            __atomic_store_n(ring->sq_tail, idx, __ATOMIC_RELEASE);
+            while(reaped < sent){
+                syscall(SYS_io_uring_enter, ring->fd, 0, sent - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+                reaped += ring_reap(ring, res);
+            }
+            errno = err;
             return -1;
         }
-        break;
-    default:
-        return -1;
-        break;
     }
+    return 0;
+}
 
-    if(db->key_align != db_align(sizeof(btree_key) + db->key_size,DB_ALIGNMENT)){
-        return -1;
-    }
+#define pool_data(pool,n) ((pool)->frame[n].data)
+#define pool_hash(pool,offset) (block_index(pool,offset) & (pool)->mask)
 
-    if(db->M != (DB_BLOCK_SIZE - sizeof(btree_node))/db->key_align - 1){
-        return -1;
+/**
+ * @brief 创建缓冲池
+ * @param[in] cache_size 内存预算（字节）
+ * @param[in] block_size 数据块大小，即帧的大小
+ */
+static db_pool* pool_create(size_t cache_size, size_t block_size){
+    size_t i, nframe = cache_size / block_size, nbucket = 1;
+    if(nframe < DB_POOL_MIN){
+        nframe = DB_POOL_MIN;
+    }
+    while(nbucket < nframe){
+        nbucket <<= 1;
     }
 
-    // 校验每个数据块的数目是否一致
-    btree_node *node = (btree_node *)((char*)db + DB_HEAD_SIZE + DB_BLOCK_SIZE * 0);
-    off_t i;
-    size_t key_total=0,value_total=0,key_use_block=0,value_use_block=0;
-    for(i=DB_HEAD_SIZE;i<stat.st_size;i+=DB_BLOCK_SIZE){
-        node_seek(db,node,i);
-        if(node->self != i){
-            return -1;
-        }
-        if(node->use){
-            if(node->type == TYPE_KEY){
-                key_total += node->num;
-                key_use_block++;
-            }else{
-                value_total += node->num;
-                value_use_block++;
-            }
-        }
+    db_pool *pool = calloc(1, sizeof(db_pool));
+    if(pool == NULL){
+        return NULL;
     }
-    if(key_total != value_total 
-        || key_total != db->key_total
-        || key_use_block != db->key_use_block
-        || value_use_block != db->value_use_block
-    ){
-        return -1;
+    pool->nframe = nframe;
+    pool->base = nframe;
+    pool->mask = nbucket - 1;
+    pool->block_size = block_size;
+    pool->bucket = malloc(sizeof(int) * nbucket);
+    pool->frame = calloc(nframe, sizeof(db_frame));
+    char *data = malloc(block_size * nframe);
+    if(pool->bucket == NULL || pool->frame == NULL || data == NULL){
+        free(pool->bucket);
+        free(pool->frame);
+        free(data);
+        free(pool);
+        return NULL;
     }
-    return 0;
+    for(i=0;i<nbucket;i++){
+        pool->bucket[i] = -1;
+    }
+    for(i=0;i<nframe;i++){
+        pool->frame[i].data = data + block_size * i;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
 }
 
 /**
- * @brief open dateabase file 打开数据库
- * @param[out] db 数据库句柄
- * @param[in] path 数据库文件路径
- * @return ==0 if success, ==-1 error
-*/
-int db_open(db_t **db, char *path){
-    int fd = open(path, O_RDWR);
-    if(fd == -1){
+ * @brief 扩充缓冲池，所有帧都不能换出时使用（比如都未写入日志），新的帧数据单独分配，已有帧的地址不变
+ * 超出内存预算的帧在提交后由pool_shrink归还
+ * @return 第一个新帧的序号 >=0 if successful, ==-1 error
+ */
+static int pool_grow(db_pool *pool){
+    size_t i, n = pool->nframe;
+    db_frame *frame = realloc(pool->frame, sizeof(db_frame) * (n + DB_POOL_MIN));
+    if(frame == NULL){
         return -1;
     }
-
-    *db = malloc(DB_HEAD_SIZE + DB_BLOCK_SIZE * 5);
-    if(*db == NULL){
-        close(fd);
+    pool->frame = frame;
+    char *data = malloc(pool->block_size * DB_POOL_MIN);
+    if(data == NULL){
         return -1;
     }
-    
-    (*db)->fd = fd;
-
-    head_seek(*db);
-    // 校验数据库
-    if(db_checker(*db) == -1){
-        close(fd);
-        free(*db);
-        return -1;
+    memset(&frame[n], 0, sizeof(db_frame) * DB_POOL_MIN);
+    for(i=0;i<DB_POOL_MIN;i++){
+        frame[n+i].data = data + pool->block_size * i;
     }
+    pool->nframe += DB_POOL_MIN;
+    return n;
+}
 
-    switch ((*db)->key_type)
-    {
-    case DB_STRINGKEY:
-        (*db)->key_cmp = cmp_string;
-        break;
-    case DB_BYTESKEY:
-        (*db)->key_cmp = cmp_bytes;
-        break;
-    case DB_INT32KEY:
-        (*db)->key_cmp = cmp_int32;
-        break;
-    case DB_INT64KEY:
-        (*db)->key_cmp = cmp_int64;
-        break;
-    default:
-        (*db)->key_cmp = NULL;
-        break;
+static void pool_destroy(db_pool *pool){
+    size_t i;
+    if(pool != NULL){
+        for(i=pool->base;i<pool->nframe;i+=DB_POOL_MIN){
+            free(pool->frame[i].data);
+        }
+        free(pool->frame[0].data);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->bucket);
+        free(pool->frame);
+        free(pool->log);
+        free(pool);
     }
-
-    return 0;
 }
 
 /**
- * @brief close dateabase file 关闭数据库
- * @param[in] db 数据库句柄
-*/
-void db_close(db_t *db){
-    close(db->fd);
-    free(db);
+ * @brief 缓冲池的锁，NULL时忽略
+ */
+inline static void pool_lock(db_pool *pool){
+    if(pool != NULL){
+        pthread_mutex_lock(&pool->lock);
+    }
 }
 
-inline static int key_binary_search(db_t *db, btree_node *node, void* target)
-{
-    int low = 0, high = node->num - 1, mid, rc;
-    while (low <= high) {
-        mid = low + (high - low) / 2;
-        rc = db->key_cmp(target, btree_key_ptr(db,node,mid)->key, db->key_size);
-        if(rc == 0){
-            return mid;
-        }else if(rc > 0){
-            low = mid + 1;
-        }else{
-            high = mid - 1;
-        }
+inline static void pool_unlock(db_pool *pool){
+    if(pool != NULL){
+        pthread_mutex_unlock(&pool->lock);
     }
-    return -low-1;
 }
 
-#define keycpy(db,dest,src,n) memmove(dest,src,(db)->key_align * ((n)+1));// 需要包括 src[n]->child
+inline static int pool_lookup(db_pool *pool, off_t offset){
+    int n = pool->bucket[pool_hash(pool, offset)];
+    while(n != -1 && pool->frame[n].self != offset){
+        n = pool->frame[n].next;
+    }
+    return n;
+}
+
+static void pool_unlink(db_pool *pool, int n){
+    int *p = &pool->bucket[pool_hash(pool, pool->frame[n].self)];
+    while(*p != n){
+        p = &pool->frame[*p].next;
+    }
+    *p = pool->frame[n].next;
+    pool->frame[n].self = 0;
+}
 
 /**
- * @brief 分裂Btree节点
- * 将sub_x分裂，一半给sub_y，中间上升到node[position]
- * @param db 
- * @param node 
- * @param position 
- * @param sub_x node->child[position] = sub_x
- * @param sub_y node->child[position+1] = sub_y
+ * @brief 将帧写回文件或映射
  */
-inline static void btree_split_child(db_t* db, btree_node *node, int position, btree_node *sub_x, btree_node *sub_y){
-    size_t n = ceil(db->M);
-
-    keycpy(db, btree_key_ptr(db, sub_y, 0), btree_key_ptr(db, sub_x, n+1), sub_x->num-n-1);
-    sub_y->num = sub_x->num - n - 1;
-    sub_x->num = n;
-
-    keycpy(db, btree_key_ptr(db, node, position+1), btree_key_ptr(db, node, position), node->num - position);
-    memcpy(btree_key_ptr(db, node, position), btree_key_ptr(db, sub_x, n), db->key_align);
-    btree_key_ptr(db, node, position)->child = sub_x->self;
-    btree_key_ptr(db, node, position+1)->child = sub_y->self;
-    node->num++;
-
-    node_flush(db, node);
-    node_flush(db, sub_x);
-    node_flush(db, sub_y);
+inline static int pool_write(db_t *db, int n){
+    db_pool *pool = db->pool;
+    // 预写日志，数据块写回之前，对应的日志必须先落盘
+    if(db->wal != NULL && __atomic_load_n(&db->wal->pending, __ATOMIC_SEQ_CST) && db->wal->sync != DB_SYNC_NONE && wal_sync(db) == -1){
+        return -1;
+    }
+    node_seal((btree_node*)pool_data(pool,n), db->block_size);
+    if(db->map != NULL){
+        memcpy(db->map + pool->frame[n].self, pool_data(pool,n), db->block_size);
+    }else{
+        stat_write(db, 1, db->block_size);
+        if(pwrite(db->fd, pool_data(pool,n), db->block_size, pool->frame[n].self) != db->block_size){
+            return -1;
+        }
+    }
+    pool->frame[n].dirty = 0;
+    return 0;
 }
 
 /**
- * @brief 合并Btree节点
- * 将sub_x和sub_y和node[position]合并
- * @param db 
- * @param node 
- * @param position 
- * @param sub_x node->child[position] = sub_x
- * @param sub_y node->child[position+1] = sub_y
+ * @brief CLOCK置换，选出一个可用的帧，脏帧先写回
+ * @return >=0 if successful, ==-1 error
  */
-inline static int btree_merge(db_t* db, btree_node *node, int position, btree_node *sub_x, btree_node *sub_y){
-    memcpy(btree_key_ptr(db, sub_x, sub_x->num)->key, btree_key_ptr(db, node, position)->key, db->key_align - sizeof(btree_key));
-    btree_key_ptr(db, sub_x, sub_x->num)->value = btree_key_ptr(db, node, position)->value;
-
-    keycpy(db, btree_key_ptr(db, sub_x, sub_x->num+1), btree_key_ptr(db, sub_y, 0), sub_y->num);    
-    sub_x->num += ( 1 + sub_y->num );
-
-    keycpy(db, btree_key_ptr(db, node, position), btree_key_ptr(db, node, position+1), node->num - position - 1);
-    btree_key_ptr(db, node, position)->child = sub_x->self;
-    node->num--;
-
-    node_destroy(db, sub_y);
+static int pool_victim(db_t *db){
+    db_pool *pool = db->pool;
+    db_frame *f;
+    size_t scan;
+    int n;
+    for(scan=0;scan<pool->nframe*2;scan++){
+        n = pool->hand;
+        pool->hand = (pool->hand + 1) % pool->nframe;
+        f = &pool->frame[n];
+        if(f->self == 0){
+            return n;
+        }
+        if(f->pin || f->log){
+            continue;
+        }
+        if(f->ref){
+            // 第二次机会
+            f->ref = 0;
+            continue;
+        }
+        if(f->dirty && pool_write(db, n) == -1){
+            return -1;
+        }
+        pool_unlink(pool, n);
+        return n;
+    }
+    return pool_grow(pool);
+}
 
-    if(node->num != 0){
-        node_flush(db, sub_x);
-        node_flush(db, node);
-        return 0;
+/**
+ * @brief 从文件或映射读出数据块到帧，并校验
+ * @return ==0 if successful, ==-1 error
+ */
+static int pool_load(db_t *db, int n, off_t offset){
+    db_pool *pool = db->pool;
+    if(db->map != NULL){
+        memcpy(pool_data(pool,n), db->map + offset, db->block_size);
     }else{
-        // must be root
-        node->num = sub_x->num;
-        node->leaf = sub_x->leaf;
-        memcpy((char*)node + sizeof(btree_node),(char*)sub_x + sizeof(btree_node),DB_BLOCK_SIZE - sizeof(btree_node));
-        node_destroy(db, sub_x);
-        node_flush(db, node);
-        return 1;
+        stat_read(db, 1, db->block_size);
+        ssize_t rc = pread(db->fd, pool_data(pool,n), db->block_size, offset);
+        if(rc != db->block_size){
+            if(rc >= 0){
+                errno = EIO;
+            }
+            return -1;
+        }
     }
+    return node_verify((btree_node*)pool_data(pool,n), offset, db->block_size);
 }
 
 /**
- * @brief insert key 插入值
- * @param[in] db 数据库句柄
- * @param[in] key key_size can't exceed max_key_size 需要保证key类型和创建数据库时一致
- * @param[in] value
- * @param[in] value_size value_size can't too large 不能太大
- * @return ==1 if success, ==0 if key repeat, ==-1 error
-*/
-int db_insert(db_t* db, void* key, void *value, size_t value_size){
-    if(db->key_type == DB_STRINGKEY && strlen((char*)key) >= db->key_size){
-        errno = EINVAL;
-        return -1;
+ * @brief 取得数据块所在的帧，未命中时换入
+ * @param[in] load ==1 读出数据块的内容，==0 调用者会覆盖整个数据块
+ * @return 帧序号 >=0 if successful, ==-1 error
+ */
+static int pool_fetch(db_t *db, off_t offset, int load){
+    db_pool *pool = db->pool;
+    int n = pool_lookup(pool, offset);
+    if(n != -1){
+        pool->hit++;
+        pool->frame[n].ref = 1;
+        return n;
     }
+    pool->miss++;
 
-    if(sizeof(btree_node) + db_align(sizeof(btree_value) + value_size, DB_ALIGNMENT) > DB_BLOCK_SIZE){
-        errno = E2BIG;
+    n = pool_victim(db);
+    if(n == -1){
+        return -1;
+    }
+    if(load && pool_load(db, n, offset) == -1){
         return -1;
     }
+    db_frame *f = &pool->frame[n];
+    f->self = offset;
+    f->ref = 1;
+    f->dirty = 0;
+    f->log = 0;
+    f->pin = 0;
+    f->next = pool->bucket[pool_hash(pool, offset)];
+    pool->bucket[pool_hash(pool, offset)] = n;
+    return n;
+}
 
-    int i,rc;
-    btree_node *node = (btree_node *)((char*)db + DB_HEAD_SIZE + DB_BLOCK_SIZE * 0);
-    btree_node *sub_x = (btree_node *)((char*)db + DB_HEAD_SIZE + DB_BLOCK_SIZE * 1);
-    btree_node *sub_y = (btree_node *)((char*)db + DB_HEAD_SIZE + DB_BLOCK_SIZE * 2);
-    btree_node *valnode = (btree_node *)((char*)db + DB_HEAD_SIZE + DB_BLOCK_SIZE * 3);
-    // 关键字只会插入到叶子节点，在由上往下的遍历中，需要将已满的节点分裂
-    /*     node       */
+static int cmp_frame(const void *a, const void *b){
+    off_t x = (*(db_frame**)a)->self, y = (*(db_frame**)b)->self;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief 用io_uring一次提交多个脏帧的写回，调用者需持有缓冲池的锁
+ * @return ==0 if successful, ==-1 error
+ */
+static int pool_write_batch(db_t *db, db_frame **dirty, size_t n){
+    char **buf = malloc(sizeof(char*) * n);
+    off_t *offset = malloc(sizeof(off_t) * n);
+    ssize_t *res = malloc(sizeof(ssize_t) * n);
+    size_t i;
+    int rc = -1;
+    if(buf == NULL || offset == NULL || res == NULL){
+        goto out;
+    }
+    // 同pool_write，数据块写回之前，对应的日志必须先落盘
+    if(db->wal != NULL && __atomic_load_n(&db->wal->pending, __ATOMIC_SEQ_CST) && db->wal->sync != DB_SYNC_NONE && wal_sync(db) == -1){
+        goto out;
+    }
+    for(i=0;i<n;i++){
+        node_seal((btree_node*)dirty[i]->data, db->block_size);
+        buf[i] = dirty[i]->data;
+        offset[i] = dirty[i]->self;
+    }
+    stat_write(db, n, db->block_size * n);
+    if(ring_batch(db->ring, db->fd, 1, buf, offset, db->block_size, res, n) == -1){
+        goto out;
+    }
+    rc = 0;
+    for(i=0;i<n;i++){
+        if(res[i] != (ssize_t)db->block_size){
+            errno = res[i] < 0 ? -res[i] : EIO;
+            rc = -1;
+        }else{
+            dirty[i]->dirty = 0;
+        }
+    }
+out:
+    free(buf);
+    free(offset);
+    free(res);
+    return rc;
+}
+
+/**
+ * @brief 按文件位置顺序写回所有脏帧，启用io_uring时一次提交
+ * @return ==0 if successful, ==-1 error
+ */
+static int pool_flush(db_t *db){
+    db_pool *pool = db->pool;
+    size_t i, n = 0;
+    pool_lock(pool);
+    db_frame **dirty = malloc(sizeof(db_frame*) * pool->nframe);
+    if(dirty == NULL){
+        pool_unlock(pool);
+        return -1;
+    }
+    for(i=0;i<pool->nframe;i++){
+        if(pool->frame[i].self != 0 && pool->frame[i].dirty){
+            dirty[n++] = &pool->frame[i];
+        }
+    }
+    qsort(dirty, n, sizeof(db_frame*), cmp_frame);
+    if(db->ring != NULL && db->map == NULL){
+        int rc = n != 0 ? pool_write_batch(db, dirty, n) : 0;
+        free(dirty);
+        pool_unlock(pool);
+        return rc;
+    }
+    for(i=0;i<n;i++){
+        if(pool_write(db, dirty[i] - pool->frame) == -1){
+            free(dirty);
+            pool_unlock(pool);
+            return -1;
+        }
+    }
+    free(dirty);
+    pool_unlock(pool);
+    return 0;
+}
+
+/**
+ * @brief 标记帧已修改、尚未写入日志，提交之前不能被换出，调用者需持有缓冲池的锁
+ * @return ==0 if successful, ==-1 error
+ */
+static int pool_log(db_pool *pool, int n){
+    if(pool->frame[n].log){
+        return 0;
+    }
+    if(pool->nlog == pool->log_cap){
+        size_t cap = pool->log_cap != 0 ? pool->log_cap * 2 : DB_POOL_MIN;
+        int *log = realloc(pool->log, sizeof(int) * cap);
+        if(log == NULL){
+            return -1;
+        }
+        pool->log = log;
+        pool->log_cap = cap;
+    }
+    pool->log[pool->nlog++] = n;
+    pool->frame[n].log = 1;
+    return 0;
+}
+
+/**
+ * @brief 数据块在缓冲池中有尚未提交的修改，未启用预写日志时为0
+ */
+inline static int pool_logged(db_t *db, off_t offset){
+    int n, logged;
+    if(db->wal == NULL){
+        return 0;
+    }
+    pool_lock(db->pool);
+    n = pool_lookup(db->pool, offset);
+    logged = n != -1 && db->pool->frame[n].log;
+    pool_unlock(db->pool);
+    return logged;
+}
+
+/**
+ * @brief 归还pool_grow扩充的帧，回到内存预算，调用者需持有缓冲池的锁
+ * 从最后扩充的一组开始，组内的帧都没有固定、都已写入日志时，写回脏帧后释放整组；否则留到下次
+ */
+static void pool_shrink(db_t *db){
+    db_pool *pool = db->pool;
+    size_t i, n;
+    while(pool->nframe > pool->base){
+        n = pool->nframe - DB_POOL_MIN;
+        for(i=n;i<pool->nframe;i++){
+            if(pool->frame[i].pin || pool->frame[i].log){
+                return;
+            }
+        }
+        for(i=n;i<pool->nframe;i++){
+            if(pool->frame[i].self == 0){
+                continue;
+            }
+            if(pool->frame[i].dirty && pool_write(db, i) == -1){
+                return;
+            }
+            pool_unlink(pool, i);
+        }
+        free(pool->frame[n].data);
+        pool->nframe = n;
+        if(pool->hand >= n){
+            pool->hand = 0;
+        }
+    }
+}
+
+/**
+ * @brief 丢弃文件尾end之后的帧，这些数据块已释放并将被截断，不再写回，NULL时忽略
+ */
+static void pool_drop(db_pool *pool, off_t end){
+    size_t i, n = 0;
+    if(pool == NULL){
+        return;
+    }
+    pool_lock(pool);
+    for(i=0;i<pool->nframe;i++){
+        if(pool->frame[i].self >= end){
+            pool_unlink(pool, i);
+            pool->frame[i].dirty = 0;
+            pool->frame[i].log = 0;
+        }
+    }
+    for(i=0;i<pool->nlog;i++){
+        if(pool->frame[pool->log[i]].log){
+            pool->log[n++] = pool->log[i];
+        }
+    }
+    pool->nlog = n;
+    pool_unlock(pool);
+}
+
+/**
+ * @brief 映射文件，预留的地址空间保证基址不变，文件增长时在其后追加映射
+ * @param[in] size 文件的新长度
+ * @return ==0 if successful, ==-1 error
+ */
+static int map_grow(db_t *db, size_t size){
+    if(size <= db->map_size){
+        return 0;
+    }
+    if(size > db->map_reserve){
+        errno = ENOMEM;
+        return -1;
+    }
+    // 按倍数增长，减少mmap的调用
+    size_t len = db->map_size * 2;
+    if(len < size){
+        len = size;
+    }
+    if(len > db->map_reserve){
+        len = db->map_reserve;
+    }
+    if(mmap(db->map + db->map_size, len - db->map_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, db->fd, db->map_size) == MAP_FAILED){
+        return -1;
+    }
+    // 读取区段时不持有db->lock，据此检查位置是否已映射
+    __atomic_store_n(&db->map_size, len, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * @brief 线程私有的数据块缓冲，写操作与校验时使用，多个线程可以同时使用同一个句柄
+ */
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_init(void){
+    pthread_key_create(&scratch_key, free);
+}
+
+/**
+ * 按最大的数据块分配，同一个线程可以使用数据块大小不同的句柄；只有用到的部分才占用物理内存
+ * @return DB_SCRATCH个连续的数据块缓冲，按句柄的数据块大小划分 if successful, NULL error
+ */
+static char* node_scratch(void){
+    pthread_once(&scratch_once, scratch_init);
+    char *buf = pthread_getspecific(scratch_key);
+    if(buf == NULL){
+        if((buf = malloc(DB_BLOCK_MAX * DB_SCRATCH)) == NULL){
+            return NULL;
+        }
+        pthread_setspecific(scratch_key, buf);
+    }
+    return buf;
+}
+
+/**
+ * @brief 初始化写优先的读写锁，同一线程不能重复加读锁
+ */
+static void rwlock_init(pthread_rwlock_t *lock){
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+static void latch_init(db_latch *latch){
+    // 写优先，避免根节点上的写操作一直等待读操作
+    rwlock_init(&latch->lock);
+}
+
+/**
+ * @brief 创建闩锁表，根节点的闩锁常驻，不经过哈希表
+ * @return ==0 if successful, ==-1 error
+ */
+static int latch_create(db_t *db){
+    size_t i;
+    db->latch = calloc(DB_LATCH_BUCKET, sizeof(db_latch_bucket));
+    db->root = calloc(1, sizeof(db_latch));
+    if(db->latch == NULL || db->root == NULL){
+        free(db->latch);
+        free(db->root);
+        db->latch = NULL;
+        db->root = NULL;
+        return -1;
+    }
+    for(i=0;i<DB_LATCH_BUCKET;i++){
+        pthread_mutex_init(&db->latch[i].lock, NULL);
+    }
+    db->root->self = DB_HEAD_SIZE;
+    latch_init(db->root);
+    return 0;
+}
+
+static void latch_destroy(db_t *db){
+    db_latch *latch, *next;
+    size_t i;
+    if(db->latch == NULL){
+        return;
+    }
+    for(i=0;i<DB_LATCH_BUCKET;i++){
+        for(latch=db->latch[i].free;latch!=NULL;latch=next){
+            next = latch->next;
+            pthread_rwlock_destroy(&latch->lock);
+            free(latch);
+        }
+        pthread_mutex_destroy(&db->latch[i].lock);
+    }
+    pthread_rwlock_destroy(&db->root->lock);
+    free(db->root);
+    free(db->latch);
+}
+
+/**
+ * @brief 等待根节点之外的闩锁全部释放，调用者持有根节点的排他闩锁
+ * 读操作先取得子节点的闩锁再释放父节点的，进入Btree之后总持有闩锁，一遍检查都为空时已全部离开
+ */
+static void latch_drain(db_t *db){
+    size_t i;
+    int busy;
+    do{
+        busy = 0;
+        for(i=0;i<DB_LATCH_BUCKET && !busy;i++){
+            pthread_mutex_lock(&db->latch[i].lock);
+            busy = db->latch[i].head != NULL;
+            pthread_mutex_unlock(&db->latch[i].lock);
+        }
+        if(busy){
+            sched_yield();
+        }
+    }while(busy);
+}
+
+#define latch_bucket(db,offset) (&(db)->latch[block_index(db,offset) & (DB_LATCH_BUCKET-1)])
+#define latch_swap(a,b) do{db_latch *t = (a); (a) = (b); (b) = t;}while(0)
+
+/**
+ * @brief 减少闩锁的引用数，为0时放回空闲链表
+ */
+static void latch_unref(db_t *db, db_latch *latch){
+    if(latch == db->root){
+        return;
+    }
+    db_latch_bucket *bucket = latch_bucket(db, latch->self);
+    pthread_mutex_lock(&bucket->lock);
+    if(--latch->ref == 0){
+        // 没有线程等待，放回空闲链表
+        db_latch **p = &bucket->head;
+        while(*p != latch){
+            p = &(*p)->next;
+        }
+        *p = latch->next;
+        latch->next = bucket->free;
+        bucket->free = latch;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+/**
+ * @brief 对数据块加闩锁
+ * @param[in] mode LATCH_S 共享，LATCH_X 排他，LATCH_TRY 排他但不等待
+ * @return 闩锁 if successful, NULL error or busy
+ */
+static db_latch* latch_acquire(db_t *db, off_t offset, int mode){
+    db_latch *latch = db->root;
+    if(offset != DB_HEAD_SIZE){
+        db_latch_bucket *bucket = latch_bucket(db, offset);
+        pthread_mutex_lock(&bucket->lock);
+        for(latch=bucket->head;latch!=NULL && latch->self!=offset;latch=latch->next);
+        if(latch == NULL){
+            if(bucket->free != NULL){
+                latch = bucket->free;
+                bucket->free = latch->next;
+            }else if((latch = malloc(sizeof(db_latch))) != NULL){
+                latch_init(latch);
+            }else{
+                pthread_mutex_unlock(&bucket->lock);
+                return NULL;
+            }
+            latch->self = offset;
+            latch->ref = 0;
+            latch->next = bucket->head;
+            bucket->head = latch;
+        }
+        latch->ref++;
+        pthread_mutex_unlock(&bucket->lock);
+    }
+    if(mode == LATCH_TRY){
+        if(pthread_rwlock_trywrlock(&latch->lock) != 0){
+            latch_unref(db, latch);
+            errno = EBUSY;
+            return NULL;
+        }
+    }else if(mode == LATCH_X){
+        pthread_rwlock_wrlock(&latch->lock);
+    }else{
+        pthread_rwlock_rdlock(&latch->lock);
+    }
+    return latch;
+}
+
+/**
+ * @brief 释放闩锁，NULL时忽略
+ */
+static void latch_release(db_t *db, db_latch *latch){
+    if(latch == NULL){
+        return;
+    }
+    pthread_rwlock_unlock(&latch->lock);
+    latch_unref(db, latch);
+}
+
+/** 
+ * @brief 读出文件数据库的数据块，经过缓冲池或映射，调用者需持有该数据块的闩锁
+*/
+inline static ssize_t node_seek(db_t *db, btree_node* node, off_t offset){
+    int n;
+    pool_lock(db->pool);
+    if(db->map != NULL){
+        // 启用预写日志时，已修改的数据块暂存在缓冲池中
+        if(db->pool != NULL && (n = pool_lookup(db->pool, offset)) != -1){
+            memcpy(node, pool_data(db->pool,n), db->block_size);
+        }else{
+            memcpy(node, db->map + offset, db->block_size);
+        }
+        pool_unlock(db->pool);
+        return db->block_size;
+    }
+    n = pool_fetch(db, offset, 1);
+    if(n == -1){
+        pool_unlock(db->pool);
+        return -1;
+    }
+    memcpy(node, pool_data(db->pool,n), db->block_size);
+    pool_unlock(db->pool);
+    return db->block_size;
+}
+
+/**
+ * @brief 只读访问数据块，不复制，调用者需持有该数据块的闩锁，用完后调用node_unref
+ * mmap存储引擎时返回映射中的地址，否则固定缓冲池中的帧，返回帧的地址
+ * @return NULL if error
+ */
+inline static btree_node* node_ref(db_t *db, off_t offset){
+    btree_node *node;
+    int n;
+    pool_lock(db->pool);
+    if(db->map != NULL){
+        if(db->pool != NULL && (n = pool_lookup(db->pool, offset)) != -1){
+            db->pool->frame[n].pin++;
+            node = (btree_node *)pool_data(db->pool,n);
+            pool_unlock(db->pool);
+            return node;
+        }
+        pool_unlock(db->pool);
+        return (btree_node *)(db->map + offset);
+    }
+    n = pool_fetch(db, offset, 1);
+    if(n == -1){
+        pool_unlock(db->pool);
+        return NULL;
+    }
+    db->pool->frame[n].pin++;
+    // pool_grow可能移动帧数组，帧数据的地址要在解锁之前取得
+    node = (btree_node *)pool_data(db->pool,n);
+    pool_unlock(db->pool);
+    return node;
+}
+
+/**
+ * @brief 解除node_ref的固定
+ */
+inline static void node_unref(db_t *db, btree_node *node){
+    if(db->pool == NULL || (db->map != NULL && (char*)node >= db->map && (char*)node < db->map + db->map_reserve)){
+        return;
+    }
+    pool_lock(db->pool);
+    db->pool->frame[pool_lookup(db->pool, node->self)].pin--;
+    pool_unlock(db->pool);
+}
+
+/**
+ * @brief 加共享闩锁后只读访问数据块，用node_put释放
+ * @return NULL if error
+ */
+static btree_node* node_get(db_t *db, off_t offset, db_latch **latch){
+    if((*latch = latch_acquire(db, offset, LATCH_S)) == NULL){
+        return NULL;
+    }
+    btree_node *node = node_ref(db, offset);
+    if(node == NULL){
+        latch_release(db, *latch);
+    }
+    return node;
+}
+
+static void node_put(db_t *db, btree_node *node, db_latch *latch){
+    node_unref(db, node);
+    latch_release(db, latch);
+}
+
+/**
+ * @brief 预读数据块，已缓存时忽略
+ */
+inline static void node_prefetch(db_t *db, off_t offset){
+    if(db->map != NULL){
+        madvise(db->map + (offset & ~(sysconf(_SC_PAGESIZE) - 1)), db->block_size, MADV_WILLNEED);
+        return;
+    }
+    pool_lock(db->pool);
+    int n = pool_lookup(db->pool, offset);
+    pool_unlock(db->pool);
+    if(n == -1){
+        posix_fadvise(db->fd, offset, db->block_size, POSIX_FADV_WILLNEED);
+    }
+}
+
+/**
+ * @brief 一次预读多个数据块，已缓存时忽略
+ * 启用io_uring时一次提交，读入缓冲池，之后node_seek直接命中；否则逐个node_prefetch
+ * 调用者需持有引用它们的节点的闩锁：它们仍是Btree节点，不在缓冲池中时文件里的内容就是最新的
+ */
+static void node_prefetch_many(db_t *db, off_t *offset, int n){
+    db_pool *pool = db->pool;
+    char *buf[DB_PREFETCH];
+    off_t pos[DB_PREFETCH];
+    ssize_t res[DB_PREFETCH];
+    int frame[DB_PREFETCH], i, j, m = 0, f;
+    if(db->ring == NULL || db->map != NULL){
+        for(i=0;i<n;i++){
+            node_prefetch(db, offset[i]);
+        }
+        return;
+    }
+    pool_lock(pool);
+    for(i=0;i<n && m<DB_PREFETCH;i++){
+        for(j=0;j<m && pos[j]!=offset[i];j++);
+        if(j < m || pool_lookup(pool, offset[i]) != -1){
+            continue;
+        }
+        if((f = pool_victim(db)) == -1){
+            break;
+        }
+        // 读完之前不加入页表，设置位置并固定，pool_victim不会再选中该帧
+        pool->frame[f].self = offset[i];
+        pool->frame[f].pin = 1;
+        pool->frame[f].dirty = 0;
+        pool->frame[f].log = 0;
+        frame[m] = f;
+        buf[m] = pool_data(pool,f);
+        pos[m++] = offset[i];
+    }
+    stat_read(db, m, db->block_size * m);
+    if(m > 0 && ring_batch(db->ring, db->fd, 0, buf, pos, db->block_size, res, m) == -1){
+        for(i=0;i<m;i++){
+            res[i] = -1;
+        }
+    }
+    for(i=0;i<m;i++){
+        db_frame *fr = &pool->frame[frame[i]];
+        fr->pin = 0;
+        // 只是预读，失败时放弃该帧，之后访问时再读出并报告错误
+        if(res[i] != (ssize_t)db->block_size || node_verify((btree_node*)fr->data, pos[i], db->block_size) == -1){
+            fr->self = 0;
+            continue;
+        }
+        fr->ref = 1;
+        fr->next = pool->bucket[pool_hash(pool, pos[i])];
+        pool->bucket[pool_hash(pool, pos[i])] = frame[i];
+    }
+    pool_unlock(pool);
+}
+
+/**
+ * @brief 批量写修改帧之前，帧中是已提交但尚未写回文件的内容时保存一份，调用者需持有缓冲池的锁
+ * 未修改过或已写回的帧出错时直接丢弃，之后从文件重新读出
+ * @return ==0 if successful, ==-1 error
+ */
+static int wal_save(db_t *db, int n){
+    db_wal *wal = db->wal;
+    db_frame *f = &db->pool->frame[n];
+    if(!f->dirty || f->log){
+        return 0;
+    }
+    if(wal->nimage == wal->image_cap){
+        size_t cap = wal->image_cap != 0 ? wal->image_cap * 2 : 64;
+        wal_undo *image = realloc(wal->image, sizeof(wal_undo) * cap);
+        if(image == NULL){
+            return -1;
+        }
+        wal->image = image;
+        wal->image_cap = cap;
+    }
+    char *data = malloc(db->block_size);
+    if(data == NULL){
+        return -1;
+    }
+    memcpy(data, pool_data(db->pool,n), db->block_size);
+    wal->image[wal->nimage].self = f->self;
+    wal->image[wal->nimage++].data = data;
+    return 0;
+}
+
+#define node_swap(a,b) do{btree_node *t = (a); (a) = (b); (b) = t;}while(0)
+
+/** 
+ * @brief 写入文件数据库的数据块，只写入缓冲池并标记为脏，换出或同步时才写回文件，调用者需持有该数据块的排他闩锁
+ * mmap存储引擎未启用预写日志时，直接写入映射
+*/
+inline static ssize_t node_write(db_t *db, btree_node *node){
+    if(db->map != NULL && db->pool == NULL){
+        node_seal(node, db->block_size);
+        memcpy(db->map + node->self, node, db->block_size);
+        return db->block_size;
+    }
+    pool_lock(db->pool);
+    int n = pool_fetch(db, node->self, 0);
+    if(n == -1){
+        pool_unlock(db->pool);
+        return -1;
+    }
+    if(db->wal != NULL && ((db->wal->undo && wal_save(db, n) == -1) || pool_log(db->pool, n) == -1)){
+        pool_unlock(db->pool);
+        return -1;
+    }
+    memcpy(pool_data(db->pool,n), node, db->block_size);
+    db->pool->frame[n].dirty = 1;
+    pool_unlock(db->pool);
+    return db->block_size;
+}
+
+#define snap_hash(offset,mask) ((((uint64_t)(offset) - DB_HEAD_SIZE) * 0x9E3779B97F4A7C15ULL >> 32) & (mask)) // 旧版本哈希表的桶
+
+/**
+ * @brief 查找快照保存的旧版本，调用者持有snap->lock
+ */
+static snap_entry* snap_lookup(db_snapshot *snap, off_t offset){
+    snap_entry *e;
+    for(e=snap->bucket[snap_hash(offset, snap->mask)];e!=NULL;e=e->next){
+        if(e->offset == offset){
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief 记录旧版本，旧版本数超过桶数的两倍时桶数加倍，调用者持有snap->lock的排他锁与该数据块的snap_latch
+ * @return ==0 if successful, ==-1 error
+ */
+static int snap_insert(db_snapshot *snap, off_t offset, snap_image *image){
+    snap_entry *e, *next, **bucket;
+    size_t i, h;
+    if(snap->count >= (snap->mask + 1) * 2 && (bucket = calloc((snap->mask + 1) * 2, sizeof(snap_entry*))) != NULL){
+        for(i=0;i<=snap->mask;i++){
+            for(e=snap->bucket[i];e!=NULL;e=next){
+                next = e->next;
+                h = snap_hash(e->offset, snap->mask * 2 + 1);
+                e->next = bucket[h];
+                bucket[h] = e;
+            }
+        }
+        free(snap->bucket);
+        snap->bucket = bucket;
+        snap->mask = snap->mask * 2 + 1;
+    }
+    if((e = malloc(sizeof(snap_entry))) == NULL){
+        return -1;
+    }
+    h = snap_hash(offset, snap->mask);
+    e->offset = offset;
+    e->image = image;
+    e->next = snap->bucket[h];
+    snap->bucket[h] = e;
+    snap->count++;
+    image->ref++;
+    return 0;
+}
+
+/**
+ * @brief 临时文件放在TMPDIR（默认/tmp）中，创建后即删除，关闭后空间自动回收
+ * @return ==0 if successful, ==-1 error
+ */
+static int snap_tmpfile(snap_store *st){
+    char path[PATH_MAX];
+    const char *dir = getenv("TMPDIR");
+    snprintf(path, PATH_MAX, "%s/filedb-snap-XXXXXX", dir != NULL && *dir != '\0' ? dir : "/tmp");
+    if((st->fd = mkstemp(path)) == -1){
+        return -1;
+    }
+    unlink(path);
+    return 0;
+}
+
+/**
+ * @brief 旧版本的槽在内存中的地址，在临时文件中时返回NULL
+ */
+inline static char* snap_slot(db_t *db, size_t slot){
+    snap_store *st = &db->images;
+    return slot < st->mem_slots ? st->mem + slot * db->block_size : NULL;
+}
+
+/**
+ * @brief 释放旧版本，槽放入空闲表；空闲表扩充失败时该槽到全部释放时才回收
+ */
+static void snap_release(db_t *db, snap_image *image){
+    snap_store *st = &db->images;
+    pthread_mutex_lock(&st->lock);
+    if(st->nfree == st->cap){
+        size_t cap = st->cap != 0 ? st->cap * 2 : 64;
+        size_t *free_slot = realloc(st->free, sizeof(size_t) * cap);
+        if(free_slot != NULL){
+            st->free = free_slot;
+            st->cap = cap;
+        }
+    }
+    if(st->nfree < st->cap){
+        st->free[st->nfree++] = image->slot;
+    }
+    pthread_mutex_unlock(&st->lock);
+    free(image);
+}
+
+/**
+ * @brief 保存数据块offset的当前内容，超过内存上限时写入临时文件，调用者持有该数据块的snap_latch的排他锁
+ * 只在分配槽时持有存储的锁，读出与写入临时文件时不持有，保存不同数据块的写操作互不等待
+ * @return 引用数为0的旧版本，NULL if error
+ */
+static snap_image* snap_save(db_t *db, off_t offset){
+    snap_store *st = &db->images;
+    snap_image *image = malloc(sizeof(snap_image));
+    char *data, *buf;
+    int fd;
+    if(image == NULL){
+        return NULL;
+    }
+    pthread_mutex_lock(&st->lock);
+    if(st->mem == NULL && st->mem_slots != 0){
+        // 没有使用中的槽，按上限预留地址空间，只有写入的页占用内存
+        st->mem = mmap(NULL, st->mem_slots * db->block_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if(st->mem == MAP_FAILED){
+            st->mem = NULL;
+            st->mem_slots = 0;
+        }
+    }
+    image->ref = 0;
+    image->slot = st->nfree != 0 ? st->free[--st->nfree] : st->next++;
+    data = snap_slot(db, image->slot);
+    if(data == NULL && st->fd == -1 && snap_tmpfile(st) == -1){
+        pthread_mutex_unlock(&st->lock);
+        goto failed;
+    }
+    fd = st->fd;
+    pthread_mutex_unlock(&st->lock);
+    if(data != NULL){
+        if(node_seek(db, (btree_node*)data, offset) == -1){
+            goto failed;
+        }
+        return image;
+    }
+    if((buf = malloc(db->block_size)) == NULL){
+        goto failed;
+    }
+    if(node_seek(db, (btree_node*)buf, offset) == -1
+        || pwrite(fd, buf, db->block_size, (off_t)(image->slot - st->mem_slots) * db->block_size) != db->block_size
+    ){
+        free(buf);
+        goto failed;
+    }
+    free(buf);
+    return image;
+
+failed:
+    snap_release(db, image);
+    return NULL;
+}
+
+/**
+ * @brief 读出旧版本，调用者持有该数据块的snap_latch；引用旧版本的快照打开期间，槽不会被释放或重用
+ * @return ==0 if successful, ==-1 error
+ */
+static int snap_load(db_t *db, snap_image *image, btree_node *node){
+    snap_store *st = &db->images;
+    char *data = snap_slot(db, image->slot);
+    if(data != NULL){
+        memcpy(node, data, db->block_size);
+        return 0;
+    }
+    if(pread(st->fd, node, db->block_size, (off_t)(image->slot - st->mem_slots) * db->block_size) != db->block_size){
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 最后一个快照关闭后释放所有旧版本的存储，调用者持有snap_lock的排他锁
+ */
+static void snap_store_reset(db_t *db){
+    snap_store *st = &db->images;
+    if(st->mem != NULL){
+        munmap(st->mem, st->mem_slots * db->block_size);
+    }
+    if(st->fd != -1){
+        close(st->fd);
+    }
+    free(st->free);
+    st->mem = NULL;
+    st->mem_slots = st->limit;
+    st->next = 0;
+    st->free = NULL;
+    st->nfree = 0;
+    st->cap = 0;
+    st->fd = -1;
+}
+
+/**
+ * @brief 创建快照的锁，打开数据库时调用
+ * @return ==0 if successful, ==-1 error
+ */
+static int snap_lock_create(db_t *db){
+    size_t i;
+    db->snap_latch = malloc(sizeof(pthread_rwlock_t) * DB_SNAP_LATCH);
+    if(db->snap_latch == NULL){
+        return -1;
+    }
+    for(i=0;i<DB_SNAP_LATCH;i++){
+        pthread_rwlock_init(&db->snap_latch[i], NULL);
+    }
+    return 0;
+}
+
+/**
+ * @brief 销毁快照的锁，NULL时忽略
+ */
+static void snap_lock_destroy(db_t *db){
+    size_t i;
+    if(db->snap_latch != NULL){
+        for(i=0;i<DB_SNAP_LATCH;i++){
+            pthread_rwlock_destroy(&db->snap_latch[i]);
+        }
+        free(db->snap_latch);
+    }
+}
+
+/**
+ * @brief 有打开的快照时写入数据块：先为还没有保存该数据块的快照保存当前内容，多个快照共享同一份旧版本
+ * 保存并写入期间持有该数据块的snap_latch的排他锁，快照读出该数据块时等待；写入其他数据块与读出其他数据块的快照不等待
+ * 保存失败时不阻止写入，相应的快照标记为不可读
+ */
+static ssize_t snap_flush(db_t *db, btree_node *node){
+    db_snapshot *snap;
+    snap_image *image = NULL;
+    pthread_rwlock_t *latch = &db->snap_latch[snap_hash(node->self, DB_SNAP_LATCH - 1)];
+    ssize_t rc;
+    int saved;
+
+    pthread_rwlock_rdlock(&db->snap_lock);
+    pthread_rwlock_wrlock(latch);
+    for(snap=db->snap;snap!=NULL;snap=snap->next){
+        if(__atomic_load_n(&snap->stale, __ATOMIC_ACQUIRE) || node->self >= snap->end){
+            continue;
+        }
+        // 持有该数据块的snap_latch，其他写操作不会同时为该数据块加入旧版本
+        pthread_rwlock_rdlock(&snap->lock);
+        saved = snap_lookup(snap, node->self) != NULL;
+        pthread_rwlock_unlock(&snap->lock);
+        if(saved){
+            continue;
+        }
+        if(image == NULL && (image = snap_save(db, node->self)) == NULL){
+            __atomic_store_n(&snap->stale, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        pthread_rwlock_wrlock(&snap->lock);
+        saved = snap_insert(snap, node->self, image);
+        pthread_rwlock_unlock(&snap->lock);
+        if(saved == -1){
+            __atomic_store_n(&snap->stale, 1, __ATOMIC_RELEASE);
+        }
+    }
+    if(image != NULL && image->ref == 0){
+        snap_release(db, image);
+    }
+    rc = node_write(db, node);
+    pthread_rwlock_unlock(latch);
+    pthread_rwlock_unlock(&db->snap_lock);
+    return rc;
+}
+
+/**
+ * @brief 写入数据块，参数同node_write；没有快照时只多一次原子读
+ */
+inline static ssize_t node_flush(db_t *db, btree_node *node){
+    if(__atomic_load_n(&db->snap, __ATOMIC_ACQUIRE) != NULL){
+        return snap_flush(db, node);
+    }
+    return node_write(db, node);
+}
+
+/** 
+ * @brief 分配文件数据库的数据块，调用者需持有db->lock
+ * 新的数据块在被父节点引用之前，其他线程访问不到，不需要加闩锁
+*/
+static int node_alloc(db_t *db, btree_node* node, int leaf, int type){
+    if(db->free != 0L){
+        // 空闲链表不为空，读出失败（校验不通过等）时不能改动链表头
+        if(node_seek(db,node,db->free) == -1){
+            return -1;
+        }
+        db->free = node->free;
+        stat_add(db, free_pops, 1);
+    }else{
+        // 空闲链表为空，在文件尾追加
+        memset(node,0,db->block_size);
+        node->self = db->end;
+        node_seal(node, db->block_size);
+        // 直接写入文件以扩展文件大小，之后的修改经过缓冲池
+        stat_write(db, 1, db->block_size);
+        if(pwrite(db->fd,node,db->block_size,node->self) != db->block_size){
+            // 存储空间不够时，只会写入部分数据
+            ftruncate(db->fd, db->end);
+            errno = ENOMEM;
+            return -1;
+        }
+        if(db->map != NULL && map_grow(db, db->end + db->block_size) == -1){
+            ftruncate(db->fd, db->end);
+            return -1;
+        }
+        db->end += db->block_size;
+    }
+    if(type == TYPE_KEY){
+        db->key_use_block++;
+    }else{
+        db->value_use_block++;
+        db->current = node->self;
+        stat_add(db, value_blocks, 1);
+    }
+    head_flush(db);
+
+    node->num = 0;
+    node->free = 0;
+    node->leaf = leaf;
+    node->use = 1;
+    node->type = type;
+    node->last = sizeof(btree_node);
+    memset((char*)node + sizeof(btree_node), 0, db->block_size-sizeof(btree_node));
+    return node_flush(db,node);
+}
+
+inline static int node_create(db_t *db, btree_node* node, int leaf, int type){
+    pthread_mutex_lock(&db->lock);
+    int rc = node_alloc(db, node, leaf, type);
+    pthread_mutex_unlock(&db->lock);
+    return rc;
+}
+
+/**
+ * @brief 整理期间不再往该数据块中分配：位于limit之后，或者是半空的btree_value数据块，其中的value将被移走
+ */
+inline static int compact_skip(db_t *db, off_t self){
+    db_compaction *cp = &db->compaction;
+    size_t n = (self - DB_HEAD_SIZE) / db->block_size;
+    return cp->limit != 0 && (self >= cp->limit || (n < cp->nsparse && (cp->sparse[n / 8] >> (n % 8) & 1)));
+}
+
+/** 
+ * @brief 释放文件数据库的数据块，调用者需持有db->lock与该数据块的排他闩锁
+ * 释放之后不再访问该数据块，并尽快释放闩锁，重新分配到该数据块的线程可能在等待
+ * 整理期间limit之后的数据块不加入空闲链表，等待截断
+*/
+static void node_free(db_t *db, btree_node *node){
+    db_compaction *cp = &db->compaction;
+    size_t n = (node->self - DB_HEAD_SIZE) / db->block_size;
+    if(n < cp->nsparse){
+        cp->sparse[n / 8] &= ~(1 << (n % 8));// 重新分配之后不再移走其中的value
+    }
+    if(cp->limit != 0 && node->self >= cp->limit){
+        node->free = 0;
+    }else{
+        node->free = db->free;
+        db->free = node->self;// 加入空闲链表中
+    }
+    node->num = 0;
+    node->use = 0;
+    if(node->type == TYPE_KEY){
+        db->key_use_block--;
+    }else{
+        db->value_use_block--;
+    }
+    head_flush(db);
+    node_flush(db,node);
+    return;
+}
+
+inline static void node_destroy(db_t *db, btree_node *node){
+    pthread_mutex_lock(&db->lock);
+    node_free(db, node);
+    pthread_mutex_unlock(&db->lock);
+}
+
+/**
+ * @brief 同步映射
+ */
+static int map_sync(db_t *db){
+    struct stat stat;
+    if(fstat(db->fd, &stat) == -1){
+        return -1;
+    }
+    return msync(db->map, stat.st_size, MS_SYNC);
+}
+
+/**
+ * @brief 追加一条日志记录到提交缓冲
+ */
+static void wal_append(db_wal *wal, size_t *len, uint32_t type, uint64_t lsn, off_t offset, void *data, uint32_t size){
+    wal_record *rec = (wal_record *)(wal->buf + *len);
+    rec->magic = DB_WAL_MAGIC;
+    rec->type = type;
+    rec->lsn = lsn;
+    rec->offset = offset;
+    rec->size = size;
+    rec->crc = 0;
+    if(size != 0){
+        memcpy(rec + 1, data, size);
+    }
+    rec->crc = db_crc32c(0, rec, sizeof(wal_record) + size);
+    *len += sizeof(wal_record) + size;
+}
+
+/**
+ * @brief 检查点，将缓冲池的数据块写回数据库文件并同步，再写入记录检查点的文件头并同步，然后清空日志
+ * @return ==0 if successful, ==-1 error
+ */
+static int wal_checkpoint(db_t *db){
+    db_wal *wal = db->wal;
+    if(pool_flush(db) == -1){
+        return -1;
+    }
+    if(db->map != NULL && map_sync(db) == -1){
+        return -1;
+    }
+    // 数据块落盘之后文件头才能记录检查点，否则掉电时文件头可能先于数据块落盘，恢复时跳过这些提交
+    if(fsync(db->fd) == -1){
+        return -1;
+    }
+    db->lsn = wal->lsn;
+    stat_write(db, 1, DB_HEAD_PERSIST);
+    if(pwrite(db->fd, db, DB_HEAD_PERSIST, 0) != DB_HEAD_PERSIST || fsync(db->fd) == -1){
+        return -1;
+    }
+    // 整理缩短的文件尾在此截断：之前日志中可能还有文件尾之后的数据块镜像，恢复时会写到文件尾之后，打开时再截断
+    struct stat stat;
+    if(fstat(db->fd, &stat) == 0 && stat.st_size > db->end && ftruncate(db->fd, db->end) == -1){
+        return -1;
+    }
+    // 数据库文件已经落盘，日志可以清空；即使清空未落盘，旧的记录序号不大于db->lsn，恢复时会被忽略
+    if(ftruncate(wal->fd, 0) == -1){
+        return -1;
+    }
+    wal->size = 0;
+    __atomic_store_n(&wal->pending, 0, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/**
+ * @brief 提交，将尚未写入日志的数据块与文件头追加到日志，按持久化级别同步
+ * @return ==0 if successful, ==-1 error
+ */
+static int wal_commit(db_t *db){
+    db_wal *wal = db->wal;
+    db_pool *pool = db->pool;
+    size_t i, len = 0, need;
+    // 没有正在执行的写操作，帧数据与未写入日志的帧不会改变，但读操作仍在访问缓冲池
+    pool_lock(pool);
+    if(pool->nlog == 0 && !wal->head){
+        // 没有修改，比如关键字已存在
+        pool_unlock(pool);
+        return 0;
+    }
+    need = (sizeof(wal_record) + db->block_size) * pool->nlog + sizeof(wal_record) * 2 + DB_HEAD_PERSIST;
+    if(need > wal->cap){
+        char *buf = realloc(wal->buf, need);
+        if(buf == NULL){
+            pool_unlock(pool);
+            return -1;
+        }
+        wal->buf = buf;
+        wal->cap = need;
+    }
+
+    uint64_t lsn = wal->lsn + 1;
+    for(i=0;i<pool->nlog;i++){
+        wal_append(wal, &len, WAL_PAGE, lsn, pool->frame[pool->log[i]].self, pool_data(pool,pool->log[i]), db->block_size);
+    }
+    pool_unlock(pool);
+    if(wal->head){
+        wal_append(wal, &len, WAL_HEAD, lsn, 0, db, DB_HEAD_PERSIST);
+    }
+    wal_append(wal, &len, WAL_COMMIT, lsn, 0, NULL, 0);
+
+    // 一次写入整个提交，不持有缓冲池的锁；写入之前帧仍未标记为已写入日志，不会被换出
+    stat_write(db, 1, len);
+    if(pwrite(wal->fd, wal->buf, len, wal->size) != len){
+        return -1;
+    }
+    wal->size += len;
+    wal->lsn = lsn;
+    wal->head = 0;
+    pool_lock(pool);
+    for(i=0;i<pool->nlog;i++){
+        pool->frame[pool->log[i]].log = 0;
+    }
+    pool->nlog = 0;
+    pool_unlock(pool);
+
+    size_t pending = __atomic_add_fetch(&wal->pending, 1, __ATOMIC_SEQ_CST);
+    if(wal->sync == DB_SYNC_OP || wal->sync == DB_SYNC_BATCH || (wal->sync == DB_SYNC_PERIOD && pending >= wal->batch)){
+        if(wal_sync(db) == -1){
+            return -1;
+        }
+    }
+    int rc = 0;
+    if(wal->size >= wal->limit){
+        rc = wal_checkpoint(db);
+    }
+    // 提交之前不能换出的帧都已写入日志，扩充的帧可以归还
+    pool_lock(pool);
+    pool_shrink(db);
+    pool_unlock(pool);
+    return rc;
+}
+
+/**
+ * @brief 写操作开始，加入当前的组，组已关闭时等待其提交
+ * @return 组的序号
+ */
+static uint64_t wal_begin(db_t *db){
+    db_wal *wal = db->wal;
+    if(wal == NULL){
+        return 0;
+    }
+    pthread_mutex_lock(&wal->lock);
+    while(wal->closing){
+        pthread_cond_wait(&wal->cond, &wal->lock);
+    }
+    wal->active++;
+    uint64_t epoch = wal->epoch;
+    pthread_mutex_unlock(&wal->lock);
+    return epoch;
+}
+
+/**
+ * @brief 写操作结束，组提交：组内最后一个结束的写操作负责提交
+ * 调用前需释放所有闩锁；DB_SYNC_BATCH与DB_SYNC_OP时等待本组提交并同步后才返回
+ * @param[in] epoch wal_begin返回的组序号
+ * @return ==0 if successful, ==-1 error
+ */
+static int wal_end(db_t *db, uint64_t epoch){
+    db_wal *wal = db->wal;
+    int rc = 0;
+    if(wal == NULL){
+        return 0;
+    }
+    pthread_mutex_lock(&wal->lock);
+    wal->ops++;
+    if(--wal->active == 0){
+        rc = wal->error = wal_commit(db);
+        wal->epoch++;
+        wal->ops = 0;
+        wal->closing = 0;
+        pthread_cond_broadcast(&wal->cond);
+    }else if(wal->sync == DB_SYNC_OP || wal->sync == DB_SYNC_BATCH){
+        // DB_SYNC_OP关闭本组，等待组内其他写操作结束；DB_SYNC_BATCH让之后的写操作继续加入，一次同步分摊到更多的写操作
+        if(wal->sync == DB_SYNC_OP || wal->ops >= DB_WAL_GROUP){
+            wal->closing = 1;
+        }
+        while(wal->epoch == epoch){
+            pthread_cond_wait(&wal->cond, &wal->lock);
+        }
+        rc = wal->error;
+    }else if(wal->ops >= DB_WAL_GROUP){
+        // 持续有写操作时，本组一直不能提交，修改过的帧也不能换出
+        wal->closing = 1;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return rc;
+}
+
+/**
+ * @brief 批量写出错，撤销本组（只有该批量写）尚未写入日志的修改并结束本组，不提交
+ * 保存过内容的帧恢复为已提交的内容，固定的帧（常驻的根节点）在原位从文件重新读出，其余尚未写入日志的帧丢弃；调用前需释放所有闩锁
+ * @param[in] head 执行之前（即最后一次提交）的文件头
+ * @param[in] head_log 执行之前的wal->head
+ */
+static void wal_abort(db_t *db, char *head, int head_log){
+    db_wal *wal = db->wal;
+    db_pool *pool = db->pool;
+    size_t i, j, k;
+    // 读操作可能正沿着本批修改的数据块访问本批分配的数据块：先阻止新的读操作进入Btree，等待进行中的读操作结束
+    db_latch *root = latch_acquire(db, DB_HEAD_SIZE, LATCH_X);
+    latch_drain(db);
+    pool_lock(pool);
+    for(k=0;k<pool->nlog;k++){
+        i = pool->log[k];
+        for(j=0;j<wal->nimage && wal->image[j].self!=pool->frame[i].self;j++);
+        if(j < wal->nimage){
+            memcpy(pool_data(pool,i), wal->image[j].data, db->block_size);
+        }else if(pool->frame[i].pin != 0 && pool_load(db, i, pool->frame[i].self) == 0){
+            // 常驻的根节点保持固定，在原位重新读出
+            pool->frame[i].dirty = 0;
+        }else{
+            // 读出失败时根节点不再常驻，之后访问时重新换入
+            pool_unlink(pool, i);
+            pool->frame[i].pin = 0;
+            pool->frame[i].dirty = 0;
+        }
+        pool->frame[i].log = 0;
+    }
+    pool->nlog = 0;
+    pool_shrink(db);
+    pool_unlock(pool);
+    // 之前的字段打开后不再改变
+    pthread_mutex_lock(&db->lock);
+    memcpy((char*)db + offsetof(db_t, key_total), head + offsetof(db_t, key_total), offsetof(db_t, key_cmp) - offsetof(db_t, key_total));
+    wal->head = head_log;
+    // 本批追加的数据块不属于任何提交，不再记录其中的空洞；截断失败时下次打开再截断
+    for(i=0;i<DB_VALUE_CLASS;i++){
+        for(j=0;j<db->hole.n[i];j++){
+            if(db->hole.block[i][j].self >= db->end){
+                db->hole.block[i][j--] = db->hole.block[i][--db->hole.n[i]];
+            }
+        }
+    }
+    ftruncate(db->fd, db->end);
+    pthread_mutex_unlock(&db->lock);
+    latch_release(db, root);
+    pthread_mutex_lock(&wal->lock);
+    wal->active--;
+    wal->epoch++;
+    wal->ops = 0;
+    wal->closing = 0;
+    pthread_cond_broadcast(&wal->cond);
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/**
+ * @brief 批量写结束，释放保存的帧内容
+ */
+static void wal_undo_end(db_wal *wal){
+    size_t i;
+    for(i=0;i<wal->nimage;i++){
+        free(wal->image[i].data);
+    }
+    wal->nimage = 0;
+    wal->undo = 0;
+}
+
+inline static void wal_path(char *buf, char *path){
+    snprintf(buf, PATH_MAX, "%s-wal", path);
+}
+
+/**
+ * @brief 崩溃恢复，重放日志中已提交的记录，在校验数据库之前执行
+ * 只重放序号大于文件头lsn、且连续的提交，遇到不完整或校验失败的记录即停止
+ * @param[in] fd 数据库文件句柄
+ * @param[in] path 数据库文件路径
+ * @return ==0 if successful, ==-1 error
+ */
+static int wal_recover(int fd, char *path){
+    char name[PATH_MAX];
+    wal_path(name, path);
+    int wfd = open(name, O_RDWR);
+    if(wfd == -1){
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    db_t head;
+    struct stat stat;
+    if(pread(fd, &head, sizeof(db_t), 0) != sizeof(db_t) || fstat(wfd, &stat) == -1){
+        close(wfd);
+        return -1;
+    }
+
+    // 同一个提交的记录，提交记录出现之前不能应用
+    size_t n = 0, cap = 0, i;
+    off_t *pos = NULL, offset = 0;
+    uint64_t lsn = head.lsn;
+    wal_record rec;
+    char *buf = malloc(DB_BLOCK_MAX);
+    int rc = 0, applied = 0;
+    if(buf == NULL){
+        close(wfd);
+        return -1;
+    }
+    while(offset + (off_t)sizeof(wal_record) <= stat.st_size){
+        if(pread(wfd, &rec, sizeof(wal_record), offset) != sizeof(wal_record)
+            || rec.magic != DB_WAL_MAGIC
+            || rec.size > DB_BLOCK_MAX
+            || offset + (off_t)sizeof(wal_record) + rec.size > stat.st_size
+            || pread(wfd, buf, rec.size, offset + sizeof(wal_record)) != rec.size
+        ){
+            break;
+        }
+        uint32_t crc = rec.crc;
+        rec.crc = 0;
+        if(db_crc32c(db_crc32c(0, &rec, sizeof(wal_record)), buf, rec.size) != crc){
+            break;
+        }
+        if(rec.lsn <= head.lsn){
+            // 检查点之前的提交
+            offset += sizeof(wal_record) + rec.size;
+            continue;
+        }
+        if(rec.lsn != lsn + 1){
+            break;
+        }
+        if(rec.type == WAL_COMMIT){
+            // 应用该提交的所有记录
+            for(i=0;i<n;i++){
+                wal_record page;
+                if(pread(wfd, &page, sizeof(wal_record), pos[i]) != sizeof(wal_record)
+                    || pread(wfd, buf, page.size, pos[i] + sizeof(wal_record)) != page.size
+                ){
+                    rc = -1;
+                    break;
+                }
+                // 日志中的数据块镜像取自缓冲池，写回时才计算校验和
+                if(page.type == WAL_PAGE){
+                    node_seal((btree_node*)buf, page.size);
+                }
+                if(pwrite(fd, buf, page.size, page.offset) != page.size){
+                    rc = -1;
+                    break;
+                }
+            }
+            if(rc == -1){
+                break;
+            }
+            n = 0;
+            lsn++;
+            applied = 1;
+        }else{
+            if(n == cap){
+                off_t *p = realloc(pos, sizeof(off_t) * (cap = cap ? cap * 2 : 64));
+                if(p == NULL){
+                    rc = -1;
+                    break;
+                }
+                pos = p;
+            }
+            pos[n++] = offset;
+        }
+        offset += sizeof(wal_record) + rec.size;
+    }
+    free(pos);
+    free(buf);
+
+    if(rc == 0 && applied){
+        // 重放的数据块落盘之后再记录已重放的序号，否则掉电时文件头可能先于数据块落盘，下次恢复跳过这些提交
+        if(fsync(fd) == -1 || pread(fd, &head, sizeof(db_t), 0) != sizeof(db_t)){
+            rc = -1;
+        }else{
+            head.lsn = lsn;
+            if(pwrite(fd, &head, DB_HEAD_PERSIST, 0) != DB_HEAD_PERSIST || fsync(fd) == -1){
+                rc = -1;
+            }
+        }
+    }
+    if(rc == 0 && (ftruncate(wfd, 0) == -1 || fsync(wfd) == -1)){
+        rc = -1;
+    }
+    close(wfd);
+    return rc;
+}
+
+/**
+ * @brief 创建预写日志
+ */
+static db_wal* wal_open(db_t *db, char *path, db_options *options){
+    db_wal *wal = calloc(1, sizeof(db_wal));
+    if(wal == NULL){
+        return NULL;
+    }
+    wal_path(wal->path, path);
+    wal->fd = open(wal->path, O_CREAT|O_RDWR|O_TRUNC, 0664);
+    if(wal->fd == -1){
+        free(wal);
+        return NULL;
+    }
+    wal->sync = options->sync;
+    wal->batch = options->wal_batch != 0 ? options->wal_batch : DB_WAL_BATCH;
+    wal->limit = options->wal_size != 0 ? options->wal_size : DB_WAL_SIZE;
+    wal->lsn = db->lsn;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->cond, NULL);
+    return wal;
+}
+
+/**
+ * @brief 关闭预写日志，NULL时忽略
+ */
+static void wal_close(db_wal *wal){
+    if(wal == NULL){
+        return;
+    }
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->cond);
+    close(wal->fd);
+    free(wal->image);
+    free(wal->buf);
+    free(wal);
+}
+
+/**
+ * @brief key的64位哈希，字符串key只取'\0'之前的部分，与比较方式一致
+ */
+static uint64_t key_hash(db_t *db, void *key){
+    const unsigned char *p = key;
+    size_t n = db->key_type == DB_STRINGKEY ? strnlen(key, db->key_size) : db->key_size;
+    uint64_t h = n * 0x9E3779B97F4A7C15ULL, w;
+    for(;n>=8;n-=8,p+=8){
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, p, n);
+    h ^= w;
+    // murmur3的fmix64
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * @brief 字符串key过长时不访问过滤器，由Btree操作返回EINVAL
+ */
+inline static int bloom_key_valid(db_t *db, void *key){
+    return db->key_type != DB_STRINGKEY || strnlen(key, db->key_size) < db->key_size;
+}
+
+/**
+ * @brief key所在的行与行内各字的掩码：高位选择行，低18位用双重哈希生成k个位置
+ * @return 行的起始地址
+ */
+inline static uint64_t* bloom_mask(db_bloom *bloom, uint64_t h, uint64_t mask[BLOOM_LINE/8]){
+    uint64_t *line = bloom->bits + (size_t)((unsigned __int128)h * bloom->lines >> 64) * (BLOOM_LINE/8);
+    uint32_t a = h & 511, b = (h >> 9) | 1, i, pos;
+    memset(mask, 0, BLOOM_LINE);
+    for(i=0;i<bloom->k;i++){
+        pos = (a + i * b) & 511;
+        mask[pos >> 6] |= 1ULL << (pos & 63);
+    }
+    return line;
+}
+
+/**
+ * @brief 加入key的哈希，可以与查询及其他加入并发
+ * @return ==1 设置了新的位, ==0 所有位都已设置
+ */
+static int bloom_set(db_bloom *bloom, uint64_t h){
+    uint64_t mask[BLOOM_LINE/8], *line = bloom_mask(bloom, h, mask);
+    int i, set = 0;
+    for(i=0;i<BLOOM_LINE/8;i++){
+        // 已设置时不写，不让其他核心的缓存行失效
+        if((__atomic_load_n(&line[i], __ATOMIC_RELAXED) & mask[i]) != mask[i]){
+            __atomic_fetch_or(&line[i], mask[i], __ATOMIC_RELAXED);
+            set = 1;
+        }
+    }
+    return set;
+}
+
+/**
+ * @brief 查询key的哈希
+ * @return ==1 可能存在, ==0 一定不存在
+ */
+inline static int bloom_test(db_bloom *bloom, uint64_t h){
+    uint64_t mask[BLOOM_LINE/8], *line = bloom_mask(bloom, h, mask);
+    int i;
+    for(i=0;i<BLOOM_LINE/8;i++){
+        if((__atomic_load_n(&line[i], __ATOMIC_RELAXED) & mask[i]) != mask[i]){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief 分配清零的过滤器，每个key设置bits*ln2位，误判率约为0.6185^bits（每行的负载不均匀，实际略高）
+ * @return NULL if error
+ */
+static db_bloom* bloom_create(size_t bits, size_t lines){
+    db_bloom *bloom = malloc(sizeof(db_bloom));
+    if(bloom == NULL){
+        return NULL;
+    }
+    bloom->lines = lines;
+    bloom->cap = lines * BLOOM_LINE * 8 / bits;
+    bloom->added = 0;
+    bloom->k = bits * 69 / 100 < 1 ? 1 : bits * 69 / 100 > DB_BLOOM_K ? DB_BLOOM_K : bits * 69 / 100;
+    bloom->bits = aligned_alloc(BLOOM_LINE, lines * BLOOM_LINE);
+    if(bloom->bits == NULL){
+        free(bloom);
+        return NULL;
+    }
+    memset(bloom->bits, 0, lines * BLOOM_LINE);
+    return bloom;
+}
+
+static void bloom_destroy(db_bloom *bloom){
+    if(bloom != NULL){
+        free(bloom->bits);
+        free(bloom);
+    }
+}
+
+/**
+ * @brief 由上往下遍历子树，加入所有key，子节点每DB_PREFETCH个一次预读
+ * @return ==0 if successful, ==-1 error
+ */
+static int bloom_scan(db_t *db, db_bloom *bloom, off_t offset){
+    db_latch *latch;
+    btree_node *node = node_get(db, offset, &latch);
+    off_t child[DB_PREFETCH];
+    size_t i, j, n;
+    int rc = 0;
+    if(node == NULL){
+        return -1;
+    }
+    for(i=0;i<node->num;i++){
+        bloom->added += bloom_set(bloom, key_hash(db, btree_key_ptr(db, node, i)->key));
+    }
+    for(i=0;node->leaf==BTREE_NON_LEAF && i<=node->num && rc==0;i+=n){
+        n = node->num + 1 - i < DB_PREFETCH ? node->num + 1 - i : DB_PREFETCH;
+        for(j=0;j<n;j++){
+            child[j] = btree_key_ptr(db, node, i + j)->child;
+        }
+        node_prefetch_many(db, child, n);
+        for(j=0;j<n && rc==0;j++){
+            rc = bloom_scan(db, bloom, child[j]);
+        }
+    }
+    node_put(db, node, latch);
+    return rc;
+}
+
+/**
+ * @brief 按db->bloom_bits遍历Btree重建过滤器，容量是当前key数的两倍，bloom_bits为0时去掉过滤器
+ * 调用者需排除写操作（持有quiesce的排他锁，或打开期间）；查询继续使用旧的过滤器
+ * @return ==0 if successful, ==-1 error，失败时保留旧的过滤器
+ */
+static int bloom_build(db_t *db){
+    db_bloom *bloom = NULL, *old = db->bloom;
+    db_latch *latch;
+    if(db->bloom_bits != 0){
+        pthread_mutex_lock(&db->lock);
+        size_t cap = db->key_total * 2 > DB_BLOOM_MIN ? db->key_total * 2 : DB_BLOOM_MIN;
+        pthread_mutex_unlock(&db->lock);
+        if((bloom = bloom_create(db->bloom_bits, (cap * db->bloom_bits + BLOOM_LINE * 8 - 1) / (BLOOM_LINE * 8))) == NULL){
+            return -1;
+        }
+        if(bloom_scan(db, bloom, DB_HEAD_SIZE) == -1){
+            bloom_destroy(bloom);
+            return -1;
+        }
+    }
+    // 查询只在持有根节点的闩锁时访问过滤器，替换之后取得一次排他闩锁，旧的过滤器不再被访问
+    if((latch = latch_acquire(db, DB_HEAD_SIZE, LATCH_X)) == NULL){
+        bloom_destroy(bloom);
+        return -1;
+    }
+    __atomic_store_n(&db->bloom, bloom, __ATOMIC_RELEASE);
+    latch_release(db, latch);
+    bloom_destroy(old);
+    return 0;
+}
+
+/**
+ * @brief 读入正常关闭时保存在文件尾之后的过滤器，需在截掉文件尾之前调用
+ * 没有保存、文件头的参数不一致或校验失败时不读入，打开完成前重建
+ * @param[in] size 文件长度
+ */
+static void bloom_load(db_t *db, off_t size){
+    size_t bytes = db->bloom_lines * BLOOM_LINE;
+    db_bloom *bloom;
+    if(!db->clean || db->bloom_bits == 0 || db->bloom_bits > DB_BLOOM_BITS || db->bloom_lines == 0
+        || db->end == 0 || db->bloom_lines > (size_t)size / BLOOM_LINE || db->end + bytes > (size_t)size){
+        return;
+    }
+    if((bloom = bloom_create(db->bloom_bits, db->bloom_lines)) == NULL){
+        return;
+    }
+    if(pread(db->fd, bloom->bits, bytes, db->end) != bytes || db_crc32c(0, bloom->bits, bytes) != db->bloom_crc){
+        bloom_destroy(bloom);
+        return;
+    }
+    bloom->cap = db->bloom_cap;
+    bloom->added = db->bloom_added;
+    db->bloom = bloom;
+}
+
+/**
+ * @brief 正常关闭时把过滤器写在文件尾之后，参数记录在文件头中，随文件头一起同步
+ * 不计入已分配的文件尾，下次打开时读入后截掉；写入失败时不保存，下次打开时重建
+ */
+static void bloom_save(db_t *db){
+    db_bloom *bloom = db->bloom;
+    db->bloom_lines = 0;
+    if(bloom == NULL){
+        return;
+    }
+    size_t bytes = bloom->lines * BLOOM_LINE;
+    if(pwrite(db->fd, bloom->bits, bytes, db->end) == bytes){
+        db->bloom_lines = bloom->lines;
+        db->bloom_cap = bloom->cap;
+        db->bloom_added = bloom->added;
+        db->bloom_crc = db_crc32c(0, bloom->bits, bytes);
+    }
+}
+
+/**
+ * @brief 写操作加入key，调用者在写操作期间（持有quiesce的共享锁），过滤器不会被替换
+ * 在修改Btree之前加入，查询不会在key插入之后仍判断为不存在
+ */
+inline static void bloom_add(db_t *db, void *key){
+    db_bloom *bloom = db->bloom;
+    if(bloom != NULL && bloom_key_valid(db, key) && bloom_set(bloom, key_hash(db, key))){
+        __atomic_add_fetch(&bloom->added, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief 查询key是否可能存在，调用者需持有根节点的闩锁
+ * @return ==1 可能存在或未启用过滤器, ==0 一定不存在
+ */
+inline static int bloom_maybe(db_t *db, void *key){
+    db_bloom *bloom = __atomic_load_n(&db->bloom, __ATOMIC_ACQUIRE);
+    if(bloom == NULL || !bloom_key_valid(db, key) || bloom_test(bloom, key_hash(db, key))){
+        return 1;
+    }
+    stat_add(db, bloom_negatives, 1);
+    return 0;
+}
+
+/**
+ * @brief 过滤器判断可能存在、Btree中却没有时记录一次误判
+ */
+#define bloom_miss(db) do{if(__atomic_load_n(&(db)->bloom, __ATOMIC_RELAXED) != NULL) stat_add(db, bloom_false_positives, 1);}while(0)
+
+/**
+ * @brief 写操作结束后检查加入的key是否超过容量，超过时重建（期间写操作等待），失败时继续使用旧的过滤器
+ */
+static void bloom_grow(db_t *db){
+    db_bloom *bloom = __atomic_load_n(&db->bloom, __ATOMIC_ACQUIRE);
+    if(bloom == NULL || __atomic_load_n(&bloom->added, __ATOMIC_RELAXED) <= bloom->cap){
+        return;
+    }
+    pthread_rwlock_wrlock(&db->quiesce);
+    // 其他线程可能已经重建
+    if(db->bloom != NULL && db->bloom->added > db->bloom->cap){
+        bloom_build(db);
+    }
+    pthread_rwlock_unlock(&db->quiesce);
+}
+
+/**
+ * @brief rebuild bloom filter 按每个key的位数重建布隆过滤器，记录在文件头中，之后每次打开都启用
+ * 过滤器在查询、修改、删除访问Btree之前排除一定不存在的key；删除的key不从过滤器中清除，加入的key超过容量时自动重建，
+ * 删除较多时可以显式调用以去掉已删除的key。重建时遍历所有Btree节点，期间写操作等待，查询可以继续
+ * @param[in] db 数据库句柄
+ * @param[in] bits_per_key 每个key的位数，越大误判率越低（8约2%，10约1%，16约0.1%），0表示不使用，最大DB_BLOOM_BITS
+ * @return ==0 if successful, ==-1 error
+*/
+int db_bloom_rebuild(db_t *db, size_t bits_per_key){
+    int rc = 0;
+    if(bits_per_key > DB_BLOOM_BITS){
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_rwlock_wrlock(&db->quiesce);
+    if(bits_per_key != db->bloom_bits){
+        uint64_t epoch = wal_begin(db);
+        pthread_mutex_lock(&db->lock);
+        db->bloom_bits = bits_per_key;
+        head_flush(db);
+        pthread_mutex_unlock(&db->lock);
+        rc = wal_end(db, epoch);
+    }
+    if(rc == 0){
+        rc = bloom_build(db);
+    }
+    pthread_rwlock_unlock(&db->quiesce);
+    return rc;
+}
+
+/**
+ * @brief 数据块大小是否有效：DB_BLOCK_MIN到DB_BLOCK_MAX之间的2的幂
+ */
+inline static int block_size_valid(size_t block_size){
+    return block_size >= DB_BLOCK_MIN && block_size <= DB_BLOCK_MAX && (block_size & (block_size - 1)) == 0;
+}
+
+/**
+ * @brief create dateabase file with block size 按指定的数据块大小创建数据库
+ * 数据块越大，节点的关键字越多、树越矮；越小，每次修改写回的数据越少
+ * @param[in] path 数据库文件路径
+ * @param[in] key_type DB_STRINGKEY, DB_BYTESKEY, DB_INT32KEY, DB_INT64KEY
+ * @param[in] max_key_size key长度最大值
+ * @param[in] block_size 数据块大小，DB_BLOCK_MIN到DB_BLOCK_MAX之间的2的幂，0表示DB_BLOCK_SIZE
+ * @param[in] flags DB_COMPRESS与DB_INLINE_VALUE(size)的组合，可以为0；压缩时按编码后的长度判断能否放进关键字的槽
+ * @return ==0 if successful, ==-1 error
+*/
+int db_create_ex(char *path, int key_type, size_t max_key_size, size_t block_size, int flags){
+    if(block_size == 0){
+        block_size = DB_BLOCK_SIZE;
+    }
+    size_t inline_size = (flags >> 8) & 0xff;
+    if(!block_size_valid(block_size) || (flags & ~(DB_COMPRESS | DB_INLINE_VALUE(0xff))) || inline_size > DB_INLINE_MAX){
+        errno = EINVAL;
+        return -1;
+    }
+
+    switch (key_type)
+    {
+    case DB_STRINGKEY:
+    case DB_BYTESKEY:
+        if(max_key_size < 4UL || max_key_size > 128UL){
+            errno = EINVAL;
+            return -1;
+        }
+        break;
+    case DB_INT32KEY:
+        if(max_key_size != sizeof(int32_t)){
+            errno = EINVAL;
+            return -1;
+        }
+        break;
+    case DB_INT64KEY:
+        if(max_key_size != sizeof(int64_t)){
+            errno = EINVAL;
+            return -1;
+        }
+        break;
+    default:
+        errno = EINVAL;
+        return -1;
+        break;
+    }
+
+    // 存放value的空间在key之后，关键字的槽相应加宽
+    size_t key_align = db_align(sizeof(btree_key) + max_key_size + inline_size,DB_ALIGNMENT);
+
+    if(block_size < sizeof(btree_node) + key_align){
+        errno = EINVAL;
+        return -1;
+    }
+
+    // 需要预留一个位置，比如M=5（关键字个数是4），分裂后变成左2右1，右插入变成左2右2，合并后变成M=6（关键字个数变成了5）
+    size_t M = (block_size - sizeof(btree_node))/key_align - 1;
+    if(M < 3){
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(access(path,F_OK) == 0){
+        errno = EEXIST;
+        return -1;
+    }
+
+    // 删除残留的日志，避免重放到新的数据库
+    char name[PATH_MAX];
+    wal_path(name, path);
+    unlink(name);
+
+    int fd = open(path,O_CREAT|O_RDWR|O_TRUNC,0664);
+    if(fd == -1){
+        return -1;
+    }
+
+    char *buf = calloc(DB_HEAD_SIZE + block_size, sizeof(char));
+    if(buf == NULL){
+        close(fd);
+        return -1;
+    }
+
+    db_t *db = (db_t *)buf;
+    db->fd = fd;
+    db->key_type = key_type;
+    db->key_size = max_key_size;
+    db->key_align = key_align;
+    db->M = M;
+    db->block_size = block_size;
+    db->key_total = 0;
+    db->key_use_block = 1;// Btree根的数据块，绝对不会被释放
+    db->value_use_block = 0;
+    db->free = 0;
+    db->current = 0;
+    db->end = DB_HEAD_SIZE + block_size;
+    db->clean = 1;
+    db->compress = (flags & DB_COMPRESS) != 0;
+    db->inline_size = inline_size;
+
+    if(pwrite(fd, db, DB_HEAD_SIZE, 0) != DB_HEAD_SIZE){
+        close(fd);
+        free(buf);
+        return -1;
+    }
+
+    btree_node *root = (btree_node *)(buf + DB_HEAD_SIZE);
+    root->self = DB_HEAD_SIZE;
+    root->leaf = BTREE_LEAF;
+    root->use = 1;// Btree根的数据块，绝对不会被释放
+    node_seal(root, block_size);
+    if(pwrite(fd, root, block_size, DB_HEAD_SIZE) != block_size){
+        close(fd);
+        free(buf);
+        return -1;
+    }
+
+    close(fd);
+    free(buf);
+    return 0;
+}
+
+/**
+ * @brief create dateabase file, mode default 0664 创建数据库，数据块大小为DB_BLOCK_SIZE
+ * @param[in] path 数据库文件路径
+ * @param[in] key_type DB_STRINGKEY, DB_BYTESKEY, DB_INT32KEY, DB_INT64KEY
+ * @param[in] max_key_size key长度最大值
+ * @return ==0 if successful, ==-1 error
+*/
+int db_create(char *path, int key_type, size_t max_key_size){
+    return db_create_ex(path, key_type, max_key_size, DB_BLOCK_SIZE, 0);
+}
+
+/**
+ * @brief 校验文件头，正常关闭的数据库打开时只做这部分校验
+ * @param[in] size 文件长度
+ * @return ==0 if successful, ==-1 error（EINVAL）
+*/
+static int head_check(db_t *db, off_t size){
+    if(!block_size_valid(db->block_size) || db->compress > 1 || db->bloom_bits > DB_BLOOM_BITS || db->inline_size > DB_INLINE_MAX){
+        goto invalid;
+    }
+    if(size < DB_HEAD_SIZE + db->block_size || (size-DB_HEAD_SIZE)%db->block_size != 0){
+        goto invalid;
+    }
+    
+    switch (db->key_type)
+    {
+    case DB_STRINGKEY:
+    case DB_BYTESKEY:
+        if(db->key_size < 4UL || db->key_size > 128UL){
+            goto invalid;
+        }
+        break;
+    case DB_INT32KEY:
+        if(db->key_size != sizeof(int32_t)){
+            goto invalid;
+        }
+        break;
+    case DB_INT64KEY:
+        if(db->key_size != sizeof(int64_t)){
+            goto invalid;
+        }
+        break;
+    default:
+        goto invalid;
+    }
+
+    if(db->key_align != db_align(sizeof(btree_key) + db->key_size + db->inline_size,DB_ALIGNMENT)){
+        goto invalid;
+    }
+
+    if(db->M != (db->block_size - sizeof(btree_node))/db->key_align - 1){
+        goto invalid;
+    }
+    return 0;
+
+invalid:
+    errno = EINVAL;
+    return -1;
+}
+
+/**
+ * @brief 校验数据库的一致性，逐个读出数据块，校验位置、校验和与数目
+ * 直接读取文件，缓冲池中的脏数据块需已写回
+ * @param[in] db 数据库句柄
+ * @return ==0 if successful, ==-1 error（EIO 读取失败或校验和不一致，EINVAL 文件头或数目不一致）
+*/
+int db_checker(db_t *db){
+    struct stat stat;
+    if(fstat(db->fd, &stat) == -1 || head_check(db, stat.st_size) == -1){
+        return -1;
+    }
+
+    // 校验每个数据块的数目是否一致
+    btree_node *node = (btree_node *)node_scratch();
+    if(node == NULL){
+        return -1;
+    }
+    off_t i;
+    size_t key_total=0,value_total=0,key_use_block=0,value_use_block=0,j;
+    for(i=DB_HEAD_SIZE;i<stat.st_size;i+=db->block_size){
+        // 直接读取文件，不经过缓冲池
+        ssize_t rc = pread(db->fd,node,db->block_size,i);
+        if(rc != db->block_size){
+            if(rc >= 0){
+                errno = EIO;
+            }
+            return -1;
+        }
+        if(node_verify(node, i, db->block_size) == -1){
+            return -1;
+        }
+        if(node->use){
+            if(node->type == TYPE_KEY){
+                key_total += node->num;
+                key_use_block++;
+                // 存放在关键字槽中的value不在btree_value数据块中计数
+                for(j=0;db->inline_size!=0 && j<node->num && j<db->M;j++){
+                    off_t v = btree_key_ptr(db, node, j)->value;
+                    if(value_inline(v) && inline_len(v) > db->inline_size){
+                        return -1;
+                    }
+                    value_total += value_inline(v);
+                }
+            }else{
+                value_total += node->num;
+                value_use_block++;
+            }
+        }
+    }
+    if(key_total != value_total 
+        || key_total != db->key_total
+        || key_use_block != db->key_use_block
+        || value_use_block != db->value_use_block
+    ){
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief open dateabase file with options 按选项打开数据库
+ * @param[out] db 数据库句柄
+ * @param[in] path 数据库文件路径
+ * @param[in] options 选项，NULL表示默认值
+ * @return ==0 if success, ==-1 error
+*/
+int db_open_ex(db_t **db, char *path, db_options *options){
+    double fill = options != NULL ? options->fill : 0;
+    if(fill != 0 && !(fill > 0.5 && fill <= 1)){
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR);
+    if(fd == -1){
+        return -1;
+    }
+
+    // 同一个数据库文件只能有一个句柄，多个线程共享该句柄
+    if(flock(fd, LOCK_EX|LOCK_NB) == -1){
+        close(fd);
+        return -1;
+    }
+
+    // 崩溃恢复
+    if(wal_recover(fd, path) == -1){
+        close(fd);
+        return -1;
+    }
+
+    *db = malloc(DB_HEAD_SIZE);
+    if(*db == NULL){
+        close(fd);
+        return -1;
+    }
+    
+    memset(*db, 0, sizeof(db_t));
+    (*db)->fd = fd;
+    (*db)->gen = 1;
+
+    head_seek(*db);
+    if((*db)->block_size == 0){
+        // 旧版本的文件头没有记录数据块大小
+        (*db)->block_size = DB_BLOCK_SIZE;
+    }
+    // 文件尾之后是崩溃前未提交的写操作追加的数据块，丢弃；旧版本的文件头没有记录文件尾
+    struct stat stat;
+    if(fstat(fd, &stat) == -1){
+        close(fd);
+        free(*db);
+        return -1;
+    }
+    // 正常关闭时保存的布隆过滤器也在文件尾之后，截掉之前读入
+    bloom_load(*db, stat.st_size);
+    if((*db)->end == 0 || (*db)->end > stat.st_size){
+        (*db)->end = stat.st_size;
+    }else if((*db)->end < stat.st_size){
+        if(ftruncate(fd, (*db)->end) == -1){
+            bloom_destroy((*db)->bloom);
+            close(fd);
+            free(*db);
+            return -1;
+        }
+        stat.st_size = (*db)->end;
+    }
+
+    // 正常关闭的数据库只校验文件头，否则（崩溃或旧版本的文件）逐个校验数据块
+    if(((*db)->clean ? head_check(*db, stat.st_size) : db_checker(*db)) == -1){
+        bloom_destroy((*db)->bloom);
+        close(fd);
+        free(*db);
+        return -1;
+    }
+    // 打开期间标记为未正常关闭，崩溃后再打开时完整校验
+    if((*db)->clean){
+        // 读入关闭时保存的空洞表
+        db_hole *hole = &(*db)->hole;
+        int c;
+        if(pread(fd, hole, sizeof(db_hole), DB_HOLE_MAP) != sizeof(db_hole)){
+            memset(hole, 0, sizeof(db_hole));
+        }
+        for(c=0;c<DB_VALUE_CLASS;c++){
+            if(hole->n[c] > DB_HOLE_HINT){
+                hole->n[c] = 0;
+            }
+        }
+        (*db)->clean = 0;
+        (*db)->bloom_lines = 0;
+        if(pwrite(fd, *db, DB_HEAD_PERSIST, 0) != DB_HEAD_PERSIST || fdatasync(fd) == -1){
+            bloom_destroy((*db)->bloom);
+            close(fd);
+            free(*db);
+            return -1;
+        }
+    }
+
+    switch ((*db)->key_type)
+    {
+    case DB_STRINGKEY:
+        (*db)->key_cmp = cmp_string;
+        break;
+    case DB_BYTESKEY:
+        (*db)->key_cmp = cmp_bytes;
+        break;
+    case DB_INT32KEY:
+        (*db)->key_cmp = cmp_int32;
+        break;
+    case DB_INT64KEY:
+        (*db)->key_cmp = cmp_int64;
+        break;
+    default:
+        (*db)->key_cmp = NULL;
+        break;
+    }
+    (*db)->ops = btree_ops_select((*db)->key_type);
+
+    // 满的一侧保留的关键字数，另一侧至少留一个关键字给之后的插入
+    (*db)->share = fill != 0;
+    (*db)->fill = (size_t)(((*db)->M - 1) * (fill != 0 ? fill : DB_FILL));
+    if((*db)->fill + 3 > (*db)->M){
+        (*db)->fill = (*db)->M - 3;
+    }
+    if((*db)->fill < ceil((*db)->M)){
+        (*db)->fill = ceil((*db)->M);
+    }
+
+    pthread_mutex_init(&(*db)->lock, NULL);
+    rwlock_init(&(*db)->snap_lock);
+    pthread_mutex_init(&(*db)->images.lock, NULL);
+    (*db)->images.fd = -1;
+    (*db)->images.mem_slots = (*db)->images.limit = (options != NULL && options->snap_memory != 0 ? options->snap_memory : DB_SNAP_MEMORY) / (*db)->block_size;
+    rwlock_init(&(*db)->quiesce);
+    if(latch_create(*db) == -1 || snap_lock_create(*db) == -1){
+        goto failed;
+    }
+
+    int flags = options != NULL ? options->flags : 0;
+    if(flags & DB_MMAP){
+        // mmap存储引擎，预留地址空间后映射整个文件
+        size_t reserve = options->map_size != 0 ? options->map_size : DB_MAP_SIZE;
+        reserve = db_align(reserve, (size_t)sysconf(_SC_PAGESIZE));
+        char *map = mmap(NULL, reserve, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if(map == MAP_FAILED){
+            goto failed;
+        }
+        (*db)->map = map;
+        (*db)->map_reserve = reserve;
+        if(map_grow(*db, (*db)->end) == -1){
+            goto failed;
+        }
+    }
+
+    // mmap存储引擎只在启用预写日志时使用缓冲池，暂存已修改的数据块
+    if(!(flags & DB_MMAP) || (flags & DB_WAL)){
+        (*db)->pool = pool_create(options != NULL && options->cache_size != 0 ? options->cache_size : DB_POOL_SIZE, (*db)->block_size);
+        if((*db)->pool == NULL){
+            goto failed;
+        }
+    }
+
+    if(!(flags & DB_MMAP)){
+        // 根节点常驻缓冲池
+        int n = pool_fetch(*db, DB_HEAD_SIZE, 1);
+        if(n == -1){
+            goto failed;
+        }
+        (*db)->pool->frame[n].pin++;
+    }
+
+    if((flags & DB_URING) && !(flags & DB_MMAP)){
+        // 内核不支持时为NULL，退回pread/pwrite
+        (*db)->ring = ring_create(DB_RING_DEPTH);
+    }
+
+    if(flags & DB_WAL){
+        (*db)->wal = wal_open(*db, path, options);
+        if((*db)->wal == NULL){
+            goto failed;
+        }
+    }
+
+    // 没有读入保存的布隆过滤器（崩溃之后打开等），或加入的key已超过容量时重建
+    if((*db)->bloom_bits != 0 && ((*db)->bloom == NULL || (*db)->bloom->added > (*db)->bloom->cap) && bloom_build(*db) == -1){
+        goto failed;
+    }
+
+#ifdef DB_STATS
+    // 之前打开、校验与恢复的读写不统计
+    (*db)->stat = aligned_alloc(__alignof__(db_counter), sizeof(db_counter) * DB_STAT_SLOTS);
+    if((*db)->stat == NULL){
+        goto failed;
+    }
+    memset((*db)->stat, 0, sizeof(db_counter) * DB_STAT_SLOTS);
+#endif
+
+    return 0;
+
+failed:
+    wal_close((*db)->wal);
+    ring_destroy((*db)->ring);
+    pool_destroy((*db)->pool);
+    if((*db)->map != NULL){
+        munmap((*db)->map, (*db)->map_reserve);
+    }
+    latch_destroy(*db);
+    snap_lock_destroy(*db);
+    pthread_mutex_destroy(&(*db)->lock);
+    pthread_rwlock_destroy(&(*db)->snap_lock);
+    pthread_mutex_destroy(&(*db)->images.lock);
+    pthread_rwlock_destroy(&(*db)->quiesce);
+    bloom_destroy((*db)->bloom);
+    close(fd);
+    free(*db);
+    return -1;
+}
+
+/**
+ * @brief open dateabase file 打开数据库
+ * @param[out] db 数据库句柄
+ * @param[in] path 数据库文件路径
+ * @return ==0 if success, ==-1 error
+*/
+int db_open(db_t **db, char *path){
+    return db_open_ex(db, path, NULL);
+}
+
+/**
+ * @brief 提交，将缓冲池的脏数据块写回并同步到磁盘，mmap存储引擎时同步映射，启用预写日志时同步日志
+ * @param[in] db 数据库句柄
+ * @return ==0 if successful, ==-1 error
+*/
+int db_sync(db_t *db){
+    if(db->wal != NULL){
+        // 提交已经写入日志，只需同步日志
+        return wal_sync(db);
+    }
+    if(db->map != NULL){
+        return map_sync(db);
+    }
+    if(pool_flush(db) == -1){
+        return -1;
+    }
+    return fsync(db->fd);
+}
+
+/**
+ * @brief 缓冲池的统计，用于调整缓冲池大小
+ * @param[in] db 数据库句柄
+ * @param[out] info
+*/
+void db_cache_stat(db_t *db, db_cache_info *info){
+    db_pool *pool = db->pool;
+    size_t i;
+    if(pool == NULL){
+        memset(info, 0, sizeof(db_cache_info));
+        return;
+    }
+    pool_lock(pool);
+    info->frames = pool->nframe;
+    info->hit = pool->hit;
+    info->miss = pool->miss;
+    info->dirty = 0;
+    for(i=0;i<pool->nframe;i++){
+        if(pool->frame[i].self != 0 && pool->frame[i].dirty){
+            info->dirty++;
+        }
+    }
+    pool_unlock(pool);
+}
+
+/**
+ * @brief runtime statistics 运行时统计，汇总各线程的计数分片，可以与其他操作并发，结果是近似值
+ * 树高由根节点沿最左侧的子树往下数出，布隆过滤器的大小取自当前的过滤器
+ * @param[in] db 数据库句柄
+ * @param[out] stats
+ * @return ==0 if successful, ==-1 error，编译时定义了DB_NO_STATS时errno为ENOTSUP
+*/
+int db_stats(db_t *db, db_stats_info *stats){
+    memset(stats, 0, sizeof(db_stats_info));
+#ifdef DB_STATS
+    size_t *sum = (size_t*)stats, *part, i, j;
+    for(i=0;i<DB_STAT_SLOTS;i++){
+        part = (size_t*)&db->stat[i].info;
+        for(j=0;j<sizeof(db_stats_info)/sizeof(size_t);j++){
+            sum[j] += __atomic_load_n(&part[j], __ATOMIC_RELAXED);
+        }
+    }
+
+    btree_node *node, *child;
+    db_latch *latch, *l_child;
+    if((node = node_get(db, DB_HEAD_SIZE, &latch)) == NULL){
+        return -1;
+    }
+    // 持有根节点的闩锁，过滤器不会被释放
+    db_bloom *bloom = __atomic_load_n(&db->bloom, __ATOMIC_ACQUIRE);
+    stats->bloom_bytes = bloom != NULL ? bloom->lines * BLOOM_LINE : 0;
+    for(stats->height=1;node->leaf==BTREE_NON_LEAF;stats->height++){
+        if((child = node_get(db, btree_key_ptr(db,node,0)->child, &l_child)) == NULL){
+            node_put(db, node, latch);
+            return -1;
+        }
+        node_put(db, node, latch);
+        node = child;
+        latch = l_child;
+    }
+    node_put(db, node, latch);
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/**
+ * @brief value space statistics 统计btree_value数据块的使用与空洞，用于观察碎片
+ * 逐个访问数据块（区段只读第一个数据块），开销与文件大小成正比，可以与其他操作并发，结果是近似值
+ * @param[in] db 数据库句柄
+ * @param[out] info
+ * @return ==0 if successful, ==-1 error
+*/
+int db_value_stat(db_t *db, db_value_info *info){
+    btree_node *node;
+    db_latch *latch;
+    btree_value *pval;
+    size_t p, slot;
+    off_t i, end;
+    struct stat stat;
+    memset(info, 0, sizeof(db_value_info));
+    // 正在写入的区段已预留到db->end，但可能还没有写入文件
+    if(fstat(db->fd, &stat) == -1){
+        return -1;
+    }
+    pthread_mutex_lock(&db->lock);
+    end = db->end < stat.st_size ? db->end : stat.st_size;
+    pthread_mutex_unlock(&db->lock);
+    for(i=DB_HEAD_SIZE+db->block_size;i<end;i+=db->block_size){
+        if((latch = latch_acquire(db, i, LATCH_S)) == NULL){
+            return -1;
+        }
+        // 整理可能已截断文件尾，截断时持有数据块的闩锁
+        if(i >= __atomic_load_n(&db->end, __ATOMIC_SEQ_CST)){
+            latch_release(db, latch);
+            break;
+        }
+        if((node = node_ref(db, i)) == NULL){
+            latch_release(db, latch);
+            return -1;
+        }
+        if(node->use && node->type == TYPE_VALUE && node->leaf == BTREE_EXTENT){
+            info->extent_blocks += node->last;
+            i += db->block_size * (node->last - 1);
+        }else if(node->use && node->type == TYPE_VALUE){
+            info->blocks++;
+            info->tail_bytes += db->block_size - node->last;
+            for(p=sizeof(btree_node);p<node->last;p+=slot){
+                pval = btree_value_ptr(node, p);
+                slot = value_slot(pval->size);
+                if(pval->size & VALUE_HOLE){
+                    info->holes++;
+                    info->hole_bytes += slot;
+                }else{
+                    info->values++;
+                    info->used += slot;
+                }
+            }
+        }
+        node_put(db, node, latch);
+    }
+    return 0;
+}
+
+/**
+ * @brief verify database 完整校验数据库：写回修改之后逐个读出数据块，校验位置、校验和与数目
+ * 正常关闭的数据库打开时只读取文件头，需要完整校验时显式调用；其他线程的写操作需已结束，查询可以继续，可以在后台线程中执行
+ * @param[in] db 数据库句柄
+ * @return ==0 if successful, ==-1 error
+*/
+int db_verify(db_t *db){
+    int rc;
+    if(db->wal != NULL){
+        // 检查点把已提交的修改写回数据库文件
+        pthread_mutex_lock(&db->wal->lock);
+        rc = wal_checkpoint(db);
+        pthread_mutex_unlock(&db->wal->lock);
+    }else if(db->pool != NULL){
+        rc = pool_flush(db);
+    }else{
+        rc = 0;// 映射与文件共享页缓存
+    }
+    if(rc == -1){
+        return -1;
+    }
+    if(db_checker(db) == -1){
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static void compact_abort(db_t *db); // 在线整理之后定义
+
+/**
+ * @brief close dateabase file 关闭数据库，写回缓冲池的脏数据块，调用前其他线程的操作需已结束
+ * 所有修改落盘之后在文件头标记正常关闭，下次打开时不需要逐个校验数据块
+ * @param[in] db 数据库句柄
+*/
+void db_close(db_t *db){
+    int flushed;
+    while(db->snap != NULL){
+        // 未关闭的快照随数据库释放
+        db_snapshot_close(db->snap);
+    }
+    if(db->compaction.phase != COMPACT_IDLE){
+        // 整理未完成时，等待截断的空闲数据块放回空闲链表
+        compact_abort(db);
+    }
+    if(db->wal != NULL){
+        // 正常关闭时做检查点，之后不再需要日志
+        flushed = wal_checkpoint(db) == 0;
+    }else if(db->pool != NULL){
+        flushed = pool_flush(db) == 0 && fsync(db->fd) == 0;
+    }else{
+        flushed = map_sync(db) == 0;
+    }
+    if(flushed && pwrite(db->fd, &db->hole, sizeof(db_hole), DB_HOLE_MAP) == sizeof(db_hole)){
+        bloom_save(db);
+        db->clean = 1;
+        if(pwrite(db->fd, db, DB_HEAD_PERSIST, 0) == DB_HEAD_PERSIST){
+            fdatasync(db->fd);
+        }
+    }
+    if(db->wal != NULL){
+        if(flushed){
+            unlink(db->wal->path);
+        }
+        wal_close(db->wal);
+    }
+    ring_destroy(db->ring);
+    pool_destroy(db->pool);
+    if(db->map != NULL){
+        munmap(db->map, db->map_reserve);
+    }
+    latch_destroy(db);
+    snap_store_reset(db);
+    snap_lock_destroy(db);
+    pthread_mutex_destroy(&db->lock);
+    pthread_rwlock_destroy(&db->snap_lock);
+    pthread_mutex_destroy(&db->images.lock);
+    pthread_rwlock_destroy(&db->quiesce);
+    bloom_destroy(db->bloom);
+    close(db->fd);
+    free(db->stat);
+    free(db);
+}
+
+/**
+ * @brief 节点内查找key，游标等不在特化操作中的调用者使用
+ */
+inline static int key_binary_search(db_t *db, btree_node *node, void* target){
+    db_key_info info = key_info(db, -1);
+    return key_find(&info, db->key_type, 0, node, target);
+}
+
+#define keycpy(db,dest,src,n) memmove(dest,src,(db)->key_align * ((n)+1));// 需要包括 src[n]->child
+
+#define EDGE_LEFT  1 /** 节点在树的左边缘：从根节点起每层都是最左的子树 */
+#define EDGE_RIGHT 2 /** 节点在树的右边缘 */
+
+/**
+ * @brief 已满的节点的分裂位置，即分裂后左节点的关键字数
+ * key在树的右边缘追加（单调递增的key）时左节点保留db->fill个关键字，右节点留给之后的key；
+ * 在左边缘插入（单调递减）时右节点保留db->fill个；否则从中间分裂
+ * @param[in] edge sub_x所在的边缘，EDGE_LEFT与EDGE_RIGHT的组合
+ */
+DB_INLINE size_t btree_split_point(db_t* db, db_key_info *ki, int key_type, btree_node *sub_x, void *key, int edge){
+    if(db->fill + 2 > sub_x->num){
+        // 节点太小，另一侧至少留一个关键字
+        return ceil(ki->M);
+    }
+    if((edge & EDGE_RIGHT) && key_compare(key_type, key, btree_key_ptr(ki, sub_x, sub_x->num-1)->key, ki->key_size) > 0){
+        return db->fill;
+    }
+    if((edge & EDGE_LEFT) && key_compare(key_type, key, btree_key_ptr(ki, sub_x, 0)->key, ki->key_size) < 0){
+        return sub_x->num - 1 - db->fill;
+    }
+    return ceil(ki->M);
+}
+
+/**
+ * @brief 分裂Btree节点
+ * 将sub_x分裂，前n个留在sub_x，第n个上升到node[position]，其余给sub_y
+ * @param db 
+ * @param node 
+ * @param position 
+ * @param sub_x node->child[position] = sub_x
+ * @param sub_y node->child[position+1] = sub_y
+ * @param n 分裂位置，见btree_split_point
+ */
+DB_INLINE void btree_split_child(db_t* db, db_key_info *ki, btree_node *node, int position, btree_node *sub_x, btree_node *sub_y, size_t n){
+
+    keycpy(ki, btree_key_ptr(ki, sub_y, 0), btree_key_ptr(ki, sub_x, n+1), sub_x->num-n-1);
+    sub_y->num = sub_x->num - n - 1;
+    sub_x->num = n;
+
+    keycpy(ki, btree_key_ptr(ki, node, position+1), btree_key_ptr(ki, node, position), node->num - position);
+    memcpy(btree_key_ptr(ki, node, position), btree_key_ptr(ki, sub_x, n), ki->key_align);
+    btree_key_ptr(ki, node, position)->child = sub_x->self;
+    btree_key_ptr(ki, node, position+1)->child = sub_y->self;
+    node->num++;
+    stat_add(db, splits, 1);
+
+    node_flush(db, node);
+    node_flush(db, sub_x);
+    node_flush(db, sub_y);
+}
+
+/**
+ * @brief 随机插入时已满的子节点先移给兄弟：右（左）兄弟的关键字数少于db->fill时，经过父节点移过去两者之差的一半，不分裂
+ * 调用者持有node与sub_x的排他闩锁，兄弟在其后加排他闩锁，返回前释放
+ * @param[in] sib 数据块缓冲
+ * @return ==1 已移给兄弟, ==0 兄弟都已达到fill，需要分裂, ==-1 error
+ */
+DB_INLINE int btree_share(db_t* db, db_key_info *ki, btree_node *node, int position, btree_node *sub_x, btree_node *sib){
+    db_latch *latch;
+    size_t m;
+    if(position < node->num){
+        if((latch = latch_acquire(db, btree_key_ptr(ki,node,position+1)->child, LATCH_X)) == NULL){
+            return -1;
+        }
+        node_seek(db, sib, btree_key_ptr(ki,node,position+1)->child);
+        if(sib->num < db->fill){
+            // sib右移m个位置，父节点的关键字与sub_x最后的m-1个关键字移入，sub_x倒数第m个上升
+            m = (sub_x->num - sib->num + 1) / 2;
+            keycpy(ki, btree_key_ptr(ki,sib,m), btree_key_ptr(ki,sib,0), sib->num);
+            memcpy(btree_key_ptr(ki,sib,m-1)->key, btree_key_ptr(ki,node,position)->key, ki->key_align - sizeof(btree_key));
+            btree_key_ptr(ki,sib,m-1)->value = btree_key_ptr(ki,node,position)->value;
+            btree_key_ptr(ki,sib,m-1)->child = btree_key_ptr(ki,sub_x,sub_x->num)->child;
+            memcpy(btree_key_ptr(ki,sib,0), btree_key_ptr(ki,sub_x,sub_x->num-m+1), ki->key_align * (m-1));
+            memcpy(btree_key_ptr(ki,node,position)->key, btree_key_ptr(ki,sub_x,sub_x->num-m)->key, ki->key_align - sizeof(btree_key));
+            btree_key_ptr(ki,node,position)->value = btree_key_ptr(ki,sub_x,sub_x->num-m)->value;
+            sub_x->num -= m;
+            sib->num += m;
+            goto shared;
+        }
+        latch_release(db, latch);
+    }
+    if(position > 0){
+        if((latch = latch_acquire(db, btree_key_ptr(ki,node,position-1)->child, LATCH_X)) == NULL){
+            return -1;
+        }
+        node_seek(db, sib, btree_key_ptr(ki,node,position-1)->child);
+        if(sib->num < db->fill){
+            // 父节点的关键字与sub_x最前的m-1个关键字追加到sib，sub_x第m个上升，sub_x左移m个位置
+            m = (sub_x->num - sib->num + 1) / 2;
+            memcpy(btree_key_ptr(ki,sib,sib->num)->key, btree_key_ptr(ki,node,position-1)->key, ki->key_align - sizeof(btree_key));
+            btree_key_ptr(ki,sib,sib->num)->value = btree_key_ptr(ki,node,position-1)->value;
+            memcpy(btree_key_ptr(ki,sib,sib->num+1), btree_key_ptr(ki,sub_x,0), ki->key_align * (m-1));
+            btree_key_ptr(ki,sib,sib->num+m)->child = btree_key_ptr(ki,sub_x,m-1)->child;
+            memcpy(btree_key_ptr(ki,node,position-1)->key, btree_key_ptr(ki,sub_x,m-1)->key, ki->key_align - sizeof(btree_key));
+            btree_key_ptr(ki,node,position-1)->value = btree_key_ptr(ki,sub_x,m-1)->value;
+            keycpy(ki, btree_key_ptr(ki,sub_x,0), btree_key_ptr(ki,sub_x,m), sub_x->num-m);
+            sub_x->num -= m;
+            sib->num += m;
+            goto shared;
+        }
+        latch_release(db, latch);
+    }
+    return 0;
+
+shared:
+    stat_add(db, shares, 1);
+    node_flush(db, node);
+    node_flush(db, sub_x);
+    node_flush(db, sib);
+    latch_release(db, latch);
+    return 1;
+}
+
+/**
+ * @brief 合并Btree节点
+ * 将sub_x和sub_y和node[position]合并
+ * @param db 
+ * @param node 
+ * @param position 
+ * @param sub_x node->child[position] = sub_x
+ * @param sub_y node->child[position+1] = sub_y
+ */
+DB_INLINE int btree_merge(db_t* db, db_key_info *ki, btree_node *node, int position, btree_node *sub_x, btree_node *sub_y){
+    memcpy(btree_key_ptr(ki, sub_x, sub_x->num)->key, btree_key_ptr(ki, node, position)->key, ki->key_align - sizeof(btree_key));
+    btree_key_ptr(ki, sub_x, sub_x->num)->value = btree_key_ptr(ki, node, position)->value;
+
+    keycpy(ki, btree_key_ptr(ki, sub_x, sub_x->num+1), btree_key_ptr(ki, sub_y, 0), sub_y->num);    
+    sub_x->num += ( 1 + sub_y->num );
+
+    keycpy(ki, btree_key_ptr(ki, node, position), btree_key_ptr(ki, node, position+1), node->num - position - 1);
+    btree_key_ptr(ki, node, position)->child = sub_x->self;
+    node->num--;
+    stat_add(db, merges, 1);
+
+    node_destroy(db, sub_y);
+
+    if(node->num != 0){
+        node_flush(db, sub_x);
+        node_flush(db, node);
+        return 0;
+    }else{
+        // must be root
+        node->num = sub_x->num;
+        node->leaf = sub_x->leaf;
+        memcpy((char*)node + sizeof(btree_node),(char*)sub_x + sizeof(btree_node),db->block_size - sizeof(btree_node));
+        node_destroy(db, sub_x);
+        node_flush(db, node);
+        return 1;
+    }
+}
+
+/**
+ * @brief 空洞的大小等级，按容量的最高位划分
+ */
+inline static int hole_class(size_t size){
+    int c = 63 - __builtin_clzl(size) - 4;// 16字节为0
+    return c < DB_VALUE_CLASS ? c : DB_VALUE_CLASS - 1;
+}
+
+/**
+ * @brief 不再记录数据块，调用者需持有db->lock
+ */
+static void hole_drop(db_t *db, off_t self){
+    db_hole *hole = &db->hole;
+    uint32_t c, i;
+    for(c=0;c<DB_VALUE_CLASS;c++){
+        for(i=0;i<hole->n[c];i++){
+            if(hole->block[c][i].self == self){
+                hole->block[c][i] = hole->block[c][--hole->n[c]];
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * @brief 记录数据块的最大空洞，每个数据块只记录一次，调用者需持有db->lock
+ * @param[in] size 最大空洞的容量，为0时不再记录
+ */
+static void hole_push(db_t *db, off_t self, size_t size){
+    db_hole *hole = &db->hole;
+    hole_drop(db, self);
+    if(size == 0){
+        return;
+    }
+    int c = hole_class(size);
+    if(hole->n[c] < DB_HOLE_HINT){
+        hole->block[c][hole->n[c]].self = self;
+        hole->block[c][hole->n[c]++].size = size;
+    }
+}
+
+/**
+ * @brief 数据块中可以分配的最大空间：最大的空洞或尾部未分配的空间
+ */
+static size_t value_room(db_t *db, btree_node *node){
+    size_t p, slot, max = db->block_size - node->last;
+    for(p=sizeof(btree_node);p<node->last;p+=slot){
+        btree_value *pval = btree_value_ptr(node, p);
+        slot = value_slot(pval->size);
+        if((pval->size & VALUE_HOLE) && slot > max){
+            max = slot;
+        }
+    }
+    return max >= value_slot(0) ? max : 0;
+}
+
+/**
+ * @brief 将数据块中pos处的value标记为空洞，与相邻的空洞合并，尾部的空洞归还给未分配空间，并记录该数据块
+ * 调用者需持有db->lock与该数据块的排他闩锁，之后需写回数据块
+ */
+static void value_hole(db_t *db, btree_node *node, size_t pos){
+    size_t p, run = 0, slot;
+    btree_value_ptr(node, pos)->size |= VALUE_HOLE;
+    for(p=sizeof(btree_node);p<node->last;p+=slot){
+        btree_value *pval = btree_value_ptr(node, p);
+        slot = value_slot(pval->size);
+        if(!(pval->size & VALUE_HOLE)){
+            run = 0;
+        }else if(run == 0){
+            run = p;
+        }else{
+            // 并入前一个空洞
+            btree_value_ptr(node, run)->size = (p + slot - run - sizeof(btree_value)) | VALUE_HOLE;
+        }
+    }
+    if(run != 0){
+        node->last = run;
+    }
+    hole_push(db, node->self, value_room(db, node));
+}
+
+/**
+ * @brief 在数据块的空洞或尾部分配need字节，选择能放下的最小空间，切分后多余的部分仍是空洞
+ * @param[out] room 分配之后数据块中可以分配的最大空间
+ * @return 块内偏移 if successful, ==0 空间不够
+ */
+static size_t hole_take(db_t *db, btree_node *node, size_t need, size_t *room){
+    size_t p, slot, best = 0, best_slot = 0;
+    for(p=sizeof(btree_node);p<node->last;p+=slot){
+        btree_value *pval = btree_value_ptr(node, p);
+        slot = value_slot(pval->size);
+        if((pval->size & VALUE_HOLE) && slot >= need && (best == 0 || slot < best_slot)){
+            best = p;
+            best_slot = slot;
+        }
+    }
+    if(best == 0 && node->last + need <= db->block_size){
+        best = node->last;
+        node->last += need;
+    }else if(best == 0){
+        return 0;
+    }else{
+        if(best_slot > need){
+            // 对齐之后剩下的至少能放下btree_value
+            btree_value_ptr(node, best + need)->size = (best_slot - need - sizeof(btree_value)) | VALUE_HOLE;
+        }
+        btree_value_ptr(node, best)->size = 0;
+    }
+    *room = value_room(db, node);
+    return best;
+}
+
+/**
+ * @brief 取得有足够空间的btree_value数据块，返回时已加排他闩锁并读入valnode
+ * 先在记录的有剩余空间的数据块中按大小等级分配，其闩锁被占用时跳过（调用者可能持有另一个value数据块的闩锁），否则在current的尾部分配
+ * @param[out] pos 分配到的块内偏移
+ * @return 闩锁 if successful, NULL error
+ */
+static db_latch* value_alloc(db_t *db, btree_node *valnode, size_t value_size, size_t *pos){
+    size_t need = value_slot(value_size), max = 0, size = 0, nbusy = 0;
+    db_hole *hole = &db->hole;
+    db_latch *latch = NULL;
+    off_t current, busy[DB_HOLE_HINT];
+    size_t busy_size[DB_HOLE_HINT];
+    uint32_t c, i;
+    while(nbusy < DB_HOLE_HINT){
+        pthread_mutex_lock(&db->lock);
+        current = 0;
+        for(c=hole_class(need);c<DB_VALUE_CLASS && current==0;c++){
+            for(i=0;i<hole->n[c];i++){
+                if(compact_skip(db, hole->block[c][i].self)){
+                    // 整理期间不再往其中分配
+                    hole->block[c][i--] = hole->block[c][--hole->n[c]];
+                }else if(hole->block[c][i].size >= need){
+                    current = hole->block[c][i].self;
+                    size = hole->block[c][i].size;
+                    hole->block[c][i] = hole->block[c][--hole->n[c]];
+                    break;
+                }
+            }
+        }
+        pthread_mutex_unlock(&db->lock);
+        if(current == 0){
+            break;
+        }
+        if((latch = latch_acquire(db, current, LATCH_TRY)) == NULL){
+            // 稍后放回
+            busy[nbusy] = current;
+            busy_size[nbusy++] = size;
+            continue;
+        }
+        node_seek(db, valnode, current);
+        // 记录可能已过期：数据块已被释放或重新分配
+        if(valnode->use && valnode->type == TYPE_VALUE && valnode->leaf != BTREE_EXTENT
+            && (*pos = hole_take(db, valnode, need, &max)) != 0){
+            break;
+        }
+        latch_release(db, latch);
+        latch = NULL;
+    }
+    if(latch != NULL || nbusy != 0){
+        pthread_mutex_lock(&db->lock);
+        for(i=0;i<nbusy;i++){
+            hole_push(db, busy[i], busy_size[i]);
+        }
+        if(latch != NULL){
+            hole_push(db, current, max);
+        }
+        pthread_mutex_unlock(&db->lock);
+        if(latch != NULL){
+            return latch;
+        }
+    }
+
+    for(;;){
+        pthread_mutex_lock(&db->lock);
+        if(db->current == 0L && node_alloc(db, valnode, 0, TYPE_VALUE) == -1){
+            pthread_mutex_unlock(&db->lock);
+            return NULL;
+        }
+        current = db->current;
+        pthread_mutex_unlock(&db->lock);
+
+        // 不能在持有db->lock时等待闩锁，加锁之后再确认是否仍是当前的数据块
+        if((latch = latch_acquire(db, current, LATCH_X)) == NULL){
+            return NULL;
+        }
+        node_seek(db, valnode, current);
+        pthread_mutex_lock(&db->lock);
+        if(db->current == current){
+            if(valnode->last + need <= db->block_size){
+                pthread_mutex_unlock(&db->lock);
+                *pos = valnode->last;
+                valnode->last += need;
+                return latch;
+            }
+            // 当前的btree_value数据块不够空间分配，记录剩下的空间，之后给更小的value
+            db->current = 0L;
+            head_flush(db);
+            hole_push(db, current, value_room(db, valnode));
+        }
+        pthread_mutex_unlock(&db->lock);
+        latch_release(db, latch);
+    }
+}
+
+/**
+ * @brief value压缩，LZ4块格式：每个序列是一个token（高4位字面量长度，低4位匹配长度-4，15表示后面还有255累加的长度字节），
+ * 字面量，2字节小端的匹配距离；最后一个序列只有字面量。最后LZ_LAST_LITERALS字节总是字面量，匹配不从最后LZ_MFLIMIT字节内开始
+ */
+#define LZ_MINMATCH      4
+#define LZ_LAST_LITERALS 5
+#define LZ_MFLIMIT       12
+#define LZ_MAX_OFFSET    65535
+#define LZ_SKIP          6      // 连续未匹配时按已扫描长度>>LZ_SKIP加大步长，不可压缩的数据很快扫过
+#define lz_hash(v)       (((v) * 2654435761U) >> (32 - DB_LZ_HASH))
+
+/**
+ * @brief 读出任意位置的4字节
+ */
+inline static uint32_t lz_read32(const unsigned char *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * @brief 写入超过15的长度，255累加
+ */
+inline static unsigned char* lz_length(unsigned char *op, size_t len){
+    for(;len>=255;len-=255){
+        *op++ = 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/**
+ * @brief 压缩，贪心匹配，哈希表只记录每个4字节序列最近的位置
+ * @param[in] cap dst的空间，结果超过时放弃
+ * @return 压缩后的长度 if successful, ==0 放不下
+ */
+static size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap){
+    uint32_t table[1 << DB_LZ_HASH];
+    const unsigned char *ip = src, *anchor = src, *end = src + n, *ref, *m, *r;
+    unsigned char *op = dst, *oend = dst + cap, *token;
+    size_t lit, len;
+
+    if(n > LZ_MFLIMIT){
+        const unsigned char *mflimit = end - LZ_MFLIMIT, *mlimit = end - LZ_LAST_LITERALS;
+        memset(table, 0, sizeof(table));
+        ip++;
+        while(ip < mflimit){
+            uint32_t seq = lz_read32(ip), h = lz_hash(seq);
+            ref = src + table[h];
+            table[h] = ip - src;
+            if(ref >= ip || ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq){
+                ip += 1 + ((ip - anchor) >> LZ_SKIP);
+                continue;
+            }
+            // 向前延伸到上一个序列的结尾，向后延伸到mlimit
+            while(ip > anchor && ref > src && ip[-1] == ref[-1]){
+                ip--;
+                ref--;
+            }
+            for(m=ip+LZ_MINMATCH,r=ref+LZ_MINMATCH;m<mlimit && *m==*r;m++,r++);
+            lit = ip - anchor;
+            len = m - ip - LZ_MINMATCH;
+            if((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + len / 255 + 1){
+                return 0;
+            }
+            token = op++;
+            *token = (lit < 15 ? lit : 15) << 4 | (len < 15 ? len : 15);
+            if(lit >= 15){
+                op = lz_length(op, lit - 15);
+            }
+            memcpy(op, anchor, lit);
+            op += lit;
+            *op++ = (ip - ref) & 0xff;
+            *op++ = (ip - ref) >> 8;
+            if(len >= 15){
+                op = lz_length(op, len - 15);
+            }
+            ip = anchor = m;
+            if(ip < mflimit){
+                // 记录匹配结尾的位置，重复的片段可以接着匹配
+                table[lz_hash(lz_read32(ip - 2))] = ip - 2 - src;
+            }
+        }
+    }
+    lit = end - anchor;
+    if((size_t)(oend - op) < 1 + lit / 255 + 1 + lit){
+        return 0;
+    }
+    token = op++;
+    *token = (lit < 15 ? lit : 15) << 4;
+    if(lit >= 15){
+        op = lz_length(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    return op + lit - dst;
+}
+
+/**
+ * @brief 解压，检查所有长度与距离，数据损坏时不会越界
+ * @return 解压后的长度 if successful, ==-1 数据损坏或dst放不下
+ */
+static ssize_t lz_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap){
+    const unsigned char *ip = src, *iend = src + n, *ref;
+    unsigned char *op = dst, *oend = dst + cap;
+    size_t lit, len, off, c;
+    unsigned b;
+
+    while(ip < iend){
+        unsigned token = *ip++;
+        if((lit = token >> 4) == 15){
+            do{
+                if(ip == iend){
+                    return -1;
+                }
+                lit += b = *ip++;
+            }while(b == 255);
+        }
+        if(lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)){
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if(ip == iend){
+            // 最后一个序列
+            return op - dst;
+        }
+        if(iend - ip < 2){
+            return -1;
+        }
+        off = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if((len = token & 15) == 15){
+            do{
+                if(ip == iend){
+                    return -1;
+                }
+                len += b = *ip++;
+            }while(b == 255);
+        }
+        len += LZ_MINMATCH;
+        if(off == 0 || off > (size_t)(op - dst) || len > (size_t)(oend - op)){
+            return -1;
+        }
+        // 距离小于长度时是重复的片段，每次复制已写出的部分，复制的长度成倍增加
+        for(ref=op-off;len>0;len-=c){
+            c = (size_t)(op - ref) < len ? (size_t)(op - ref) : len;
+            memcpy(op, ref, c);
+            op += c;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief 压缩模式下value的存储格式：4字节的头是原长度，最高位为1时其后是压缩的数据，否则是原样的数据
+ * 区段中的value同样带头部；未压缩的数据库原样存储，没有头部
+ */
+#define VALUE_LZ   (0x80000000U)
+#define VALUE_CODE (sizeof(uint32_t))
+
+/**
+ * @brief 编码为压缩模式的存储格式，压缩后不能变小时原样存储
+ * @param[in,out] value_size 原长度，返回编码后的长度
+ * @param[out] buf 编码的结果，由调用者释放
+ * @return ==0 if successful, ==-1 error
+ */
+static int value_encode(void *value, size_t *value_size, unsigned char **buf){
+    size_t size = *value_size, n = 0;
+    if(size > INT_MAX){
+        errno = E2BIG;
+        return -1;
+    }
+    if((*buf = malloc(VALUE_CODE + size)) == NULL){
+        return -1;
+    }
+    if(size >= DB_LZ_MIN){
+        n = lz_compress(value, size, *buf + VALUE_CODE, size - size / 16);
+    }
+    if(n != 0){
+        *(uint32_t*)*buf = size | VALUE_LZ;
+    }else{
+        *(uint32_t*)*buf = size;
+        memcpy(*buf + VALUE_CODE, value, size);
+        n = size;
+    }
+    *value_size = VALUE_CODE + n;
+    return 0;
+}
+
+/**
+ * @brief 从存储的数据中取出value的[from, from+value_size)，压缩模式下解码，参数同value_read
+ * 压缩的value完整读出时直接解压到value中；只读一部分时先解压整个value
+ * @param[in] data, size 存储的数据
+ * @return >=0 读出的字节数 if success, ==-1 error
+ */
+static int value_decode(db_t *db, unsigned char *data, size_t size, size_t from, void *value, size_t value_size, size_t *total){
+    uint32_t code = 0;
+    unsigned char *tmp = NULL;
+    if(db->compress){
+        if(size < VALUE_CODE){
+            errno = EIO;
+            return -1;
+        }
+        code = *(uint32_t*)data;
+        data += VALUE_CODE;
+        size -= VALUE_CODE;
+        if(!(code & VALUE_LZ) && code != size){
+            errno = EIO;
+            return -1;
+        }
+    }
+    if(code & VALUE_LZ){
+        size_t raw = code & ~VALUE_LZ;
+        if(total == NULL && raw > value_size){
+            errno = E2BIG;
+            return -1;
+        }
+        if(total != NULL && (value_size == 0 || from >= raw)){
+            // 只取长度时不必解压
+            *total = raw;
+            return 0;
+        }
+        if(total == NULL || (from == 0 && value_size >= raw)){
+            if(total != NULL){
+                *total = raw;
+            }
+            if(lz_decompress(data, size, value, raw) != (ssize_t)raw){
+                errno = EIO;
+                return -1;
+            }
+            return raw;
+        }
+        if((tmp = malloc(raw)) == NULL){
+            return -1;
+        }
+        if(lz_decompress(data, size, tmp, raw) != (ssize_t)raw){
+            free(tmp);
+            errno = EIO;
+            return -1;
+        }
+        data = tmp;
+        size = raw;
+    }
+    if(total == NULL && size > value_size){
+        errno = E2BIG;
+        return -1;
+    }
+    if(total == NULL){
+        from = 0;
+    }else{
+        *total = size;
+        from = from < size ? from : size;
+        size = size - from < value_size ? size - from : value_size;
+    }
+    memcpy(value, data + from, size);
+    free(tmp);
+    return size;
+}
+
+/**
+ * @brief 大value存放在区段中：在文件尾追加的一段连续数据块，一次pwritev写入，之后不再修改
+ * 每个数据块保留头部，数据依次存放在头部之后，第一个数据块的头部之后是btree_value
+ * 关键字的value指向区段的第一个数据块（块内偏移为0），以此与btree_value数据块中的value区分
+ */
+#define extent_payload (db->block_size - sizeof(btree_node)) // 区段每个数据块存放的数据
+#define extent_blocks(value_size) ((sizeof(btree_value) + (value_size) + extent_payload - 1) / extent_payload)
+#define value_large(value_size) (sizeof(btree_node) + db_align(sizeof(btree_value) + (value_size), DB_ALIGNMENT) > db->block_size)
+#define value_block(db,offset) (DB_HEAD_SIZE + (((offset) - DB_HEAD_SIZE) & ~((db)->block_size-1))) // value所在的数据块
+
+/**
+ * @brief 写入区段的所有数据块，数据直接取自value，片段数达到IOV_MAX时才分多次pwritev
+ * @return ==0 if successful, ==-1 error
+ */
+static int extent_store(db_t *db, off_t self, void *value, size_t value_size){
+    static const char zero[DB_BLOCK_MAX];
+    struct iovec iov[IOV_MAX];
+    btree_node head[IOV_MAX / 2];
+    btree_value val = {value_size};
+    size_t nblock = extent_blocks(value_size), i, n = 0, nhead = 0, len, room, done = 0;
+    off_t offset = self, end = self;
+    uint32_t crc;
+    for(i=0;i<nblock;i++){
+        // 每个数据块最多4个片段：头部、btree_value、数据、补齐
+        if(n + 4 > IOV_MAX){
+            stat_write(db, 1, end - offset);
+            if(pwritev(db->fd, iov, n, offset) != end - offset){
+                errno = ENOSPC;
+                return -1;
+            }
+            offset = end;
+            n = nhead = 0;
+        }
+        btree_node *h = &head[nhead++];
+        memset(h, 0, sizeof(btree_node));
+        h->self = end;
+        h->use = 1;
+        h->type = TYPE_VALUE;
+        h->leaf = BTREE_EXTENT;
+        if(i == 0){
+            h->num = 1;// 只被一个关键字引用
+            h->last = nblock;
+        }
+        iov[n].iov_base = h;
+        iov[n++].iov_len = sizeof(btree_node);
+        crc = db_crc32c(0, h, sizeof(btree_node));
+        room = extent_payload;
+        if(i == 0){
+            iov[n].iov_base = &val;
+            iov[n++].iov_len = sizeof(btree_value);
+            room -= sizeof(btree_value);
+            crc = db_crc32c(crc, &val, sizeof(btree_value));
+        }
+        len = value_size - done < room ? value_size - done : room;
+        if(len != 0){
+            iov[n].iov_base = (char*)value + done;
+            iov[n++].iov_len = len;
+            crc = db_crc32c(crc, (char*)value + done, len);
+            done += len;
+            room -= len;
+        }
+        if(room != 0){
+            iov[n].iov_base = (void*)zero;
+            iov[n++].iov_len = room;
+            crc = db_crc32c(crc, zero, room);
+        }
+        h->crc = crc;
+        end += db->block_size;
+    }
+    stat_write(db, 1, end - offset);
+    if(pwritev(db->fd, iov, n, offset) != end - offset){
+        errno = ENOSPC;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief 释放区段的所有数据块，调用者需持有db->lock
+ * @param[in] node 数据块缓冲
+ */
+static void extent_free(db_t *db, btree_node *node, off_t self, size_t nblock){
+    size_t i;
+    for(i=0;i<nblock;i++){
+        memset(node, 0, sizeof(btree_node));
+        node->self = self + db->block_size * i;
+        node->type = TYPE_VALUE;
+        node_free(db, node);
+    }
+}
+
+/**
+ * @brief 在文件尾预留区段并写入value
+ * 启用预写日志并且需要同步时，区段先落盘，之后引用它的提交才写入日志
+ * @param[in] node 数据块缓冲，失败时用于释放已预留的数据块
+ * @return 区段的位置 if successful, ==0 error
+ */
+static off_t extent_write(db_t *db, btree_node *node, void *value, size_t value_size){
+    size_t nblock = extent_blocks(value_size);
+    pthread_mutex_lock(&db->lock);
+    off_t self = db->end;
+    if(db->map != NULL && map_grow(db, self + db->block_size * nblock) == -1){
+        pthread_mutex_unlock(&db->lock);
+        return 0;
+    }
+    db->end += db->block_size * nblock;
+    db->value_use_block += nblock;
+    db->extending++;
+    head_flush(db);
+    pthread_mutex_unlock(&db->lock);
+
+    // 预留之后不需要持有db->lock，其他线程在之后的位置分配
+    if(extent_store(db, self, value, value_size) == -1
+        || (db->wal != NULL && db->wal->sync != DB_SYNC_NONE && fdatasync(db->fd) == -1)){
+        pthread_mutex_lock(&db->lock);
+        extent_free(db, node, self, nblock);
+        db->extending--;
+        pthread_mutex_unlock(&db->lock);
+        return 0;
+    }
+    pthread_mutex_lock(&db->lock);
+    db->extending--;
+    pthread_mutex_unlock(&db->lock);
+    stat_add(db, extents, 1);
+    return self;
+}
+
+/**
+ * @brief 从区段读出存储的数据的[from, from+value_size)，调用者需持有引用该区段的Btree节点的闩锁
+ * 区段写入之后不再修改，也不在缓冲池中，直接读取文件
+ * @param[out] total 不为NULL时返回存储的总长度，否则必须完整读出
+ * @return >=0 读出的字节数 if success, ==-1 error
+ */
+static int extent_fetch(db_t *db, off_t self, size_t from, void *value, size_t value_size, size_t *total){
+    struct{
+        btree_node node;
+        btree_value val;
+    }head;
+    struct iovec iov[IOV_MAX];
+    btree_node skip;
+    size_t n = 0, len, room, done = 0, map_size = __atomic_load_n(&db->map_size, __ATOMIC_ACQUIRE);
+    off_t pos;
+
+    if(db->map != NULL){
+        if((size_t)self + db->block_size > map_size){
+            errno = EIO;
+            return -1;
+        }
+        memcpy(&head, db->map + self, sizeof(head));
+    }else{
+        stat_read(db, 1, sizeof(head));
+        if(pread(db->fd, &head, sizeof(head), self) != sizeof(head)){
+            errno = EIO;
+            return -1;
+        }
+    }
+    // 游标的副本已过期时可能读到其他数据块；启用预写日志时，整理移动的区段在写回之前，文件中的头部标记为未使用
+    if(head.node.self != self || (!head.node.use && db->wal == NULL) || head.node.last == 0 || head.node.type != TYPE_VALUE || head.node.leaf != BTREE_EXTENT
+        || head.val.size > extent_payload * head.node.last - sizeof(btree_value)
+        || (db->map != NULL && (size_t)self + db->block_size * head.node.last > map_size)
+    ){
+        errno = EIO;
+        return -1;
+    }
+    if(total == NULL){
+        if(head.val.size > value_size){
+            errno = E2BIG;
+            return -1;
+        }
+        from = 0;
+        value_size = head.val.size;
+    }else{
+        *total = head.val.size;
+        if(from > head.val.size){
+            from = head.val.size;
+        }
+        if(value_size > head.val.size - from){
+            value_size = head.val.size - from;
+        }
+    }
+
+    // 数据在文件中不连续，中间隔着各数据块的头部
+    pos = self + sizeof(btree_node) + (sizeof(btree_value) + from) / extent_payload * db->block_size + (sizeof(btree_value) + from) % extent_payload;
+    while(done < value_size){
+        room = db->block_size - (pos - self) % db->block_size;
+        len = value_size - done < room ? value_size - done : room;
+        if(db->map != NULL){
+            memcpy((char*)value + done, db->map + pos, len);
+        }else{
+            if(n != 0){
+                iov[n].iov_base = &skip;
+                iov[n++].iov_len = sizeof(btree_node);
+            }
+            iov[n].iov_base = (char*)value + done;
+            iov[n++].iov_len = len;
+        }
+        done += len;
+        pos += len + sizeof(btree_node);
+        if(n + 2 > IOV_MAX || (n != 0 && done == value_size)){
+            // 从第一个片段开始连续读取
+            ssize_t want = 0;
+            size_t k;
+            for(k=0;k<n;k++){
+                want += iov[k].iov_len;
+            }
+            stat_read(db, 1, want);
+            if(preadv(db->fd, iov, n, pos - sizeof(btree_node) - want) != want){
+                errno = EIO;
+                return -1;
+            }
+            n = 0;
+        }
+    }
+    return value_size;
+}
+
+/**
+ * @brief 从区段读出value的[from, from+value_size)，参数同extent_fetch
+ * 压缩模式下先读出头部：原样存储时跳过头部直接读入value，压缩的整个读出后解码
+ */
+static int extent_read(db_t *db, off_t self, size_t from, void *value, size_t value_size, size_t *total){
+    uint32_t code;
+    size_t size;
+    unsigned char *buf;
+    int rc;
+    if(!db->compress){
+        return extent_fetch(db, self, from, value, value_size, total);
+    }
+    if((rc = extent_fetch(db, self, 0, &code, VALUE_CODE, &size)) != VALUE_CODE){
+        errno = rc == -1 ? errno : EIO;
+        return -1;
+    }
+    if(!(code & VALUE_LZ)){
+        if(code != size - VALUE_CODE){
+            errno = EIO;
+            return -1;
+        }
+        if(total == NULL){
+            if(code > value_size){
+                errno = E2BIG;
+                return -1;
+            }
+            return extent_fetch(db, self, VALUE_CODE, value, code, &size);
+        }
+        *total = code;
+        return extent_fetch(db, self, VALUE_CODE + (from < code ? from : code), value, value_size, &size);
+    }
+    if(total == NULL && (code & ~VALUE_LZ) > value_size){
+        errno = E2BIG;
+        return -1;
+    }
+    if(total != NULL && (value_size == 0 || from >= (code & ~VALUE_LZ))){
+        // 只取长度时不必读出整个区段
+        *total = code & ~VALUE_LZ;
+        return 0;
+    }
+    if((buf = malloc(size)) == NULL){
+        return -1;
+    }
+    rc = extent_fetch(db, self, 0, buf, size, &size);
+    if(rc == (int)size){
+        rc = value_decode(db, buf, size, from, value, value_size, total);
+    }else if(rc != -1){
+        errno = EIO;
+        rc = -1;
+    }
+    free(buf);
+    return rc;
+}
+
+/**
+ * @brief 存储value：大value写入新的区段，否则写入当前的btree_value数据块
+ * @param[out] latch 写入btree_value数据块时返回其排他闩锁，由调用者释放
+ * @return value的位置 if successful, ==0 error
+ */
+static off_t value_store(db_t *db, btree_node *valnode, void *value, size_t value_size, db_latch **latch){
+    size_t pos;
+    if(value_large(value_size)){
+        return extent_write(db, valnode, value, value_size);
+    }
+    if((*latch = value_alloc(db, valnode, value_size, &pos)) == NULL){
+        return 0;
+    }
+    btree_value_ptr(valnode,pos)->size = value_size;
+    memcpy(btree_value_ptr(valnode,pos)->value, value, value_size);
+    valnode->num++;
+    node_flush(db, valnode);
+    return valnode->self + pos;// 记录value所在数据块的位置 + 偏移
+}
+
+/**
+ * @brief 释放value，数据块的引用数为0时释放该数据块或区段，否则value的空间成为空洞，调用者需持有db->lock与该数据块的排他闩锁
+ * @param[in] node 已读入的value所在数据块
+ * @param[in] offset value所在数据块的位置 + 偏移
+ */
+static void value_unref(db_t *db, btree_node *node, off_t offset){
+    node->num--;
+    if(node->num == 0 && node->leaf == BTREE_EXTENT){
+        extent_free(db, node, node->self, node->last);
+    }else if(node->num == 0){
+        if(node->self == db->current){
+            db->current = 0;
+            // head_flush(d);// node_free will flush again
+        }
+        hole_drop(db, node->self);
+        node_free(db, node);
+    }else{
+        value_hole(db, node, offset - node->self);
+        node_flush(db, node);
+    }
+}
+
+/**
+ * @brief 替换关键字的value，调用者需持有关键字所在Btree节点的排他闩锁
+ * 新value放得下时存放在关键字的槽中；不超过原来的对齐空间，或原value是数据块中最后一个、块内还有空间时原地改写，只写一个数据块；
+ * 否则另外存储，修改关键字的value之后释放原来的value
+ * @param[in] node 关键字所在的Btree节点
+ * @param[in] old, valnode 数据块缓冲
+ * @return ==1 if success, ==-1 error
+ */
+static int value_replace(db_t *db, btree_node *node, btree_key *k, btree_node *old, btree_node *valnode, void *value, size_t value_size){
+    off_t offset = k->value, self = value_block(db,offset), pos = offset - self;
+    size_t need = value_slot(value_size), slot;
+    db_latch *latch, *l_val = NULL;
+    btree_value *pval;
+
+    if(value_inline(offset) && !inline_fits(db, value_size)){
+        // 原value在关键字的槽中，新value另外存储
+        if((offset = value_store(db, valnode, value, value_size, &l_val)) == 0){
+            return -1;
+        }
+        latch_release(db, l_val);
+        k->value = offset;
+        node_flush(db, node);
+        return 1;
+    }
+    if(inline_fits(db, value_size)){
+        memcpy(inline_data(db, k), value, value_size);
+        k->value = VALUE_INLINE | value_size;
+        node_flush(db, node);
+        if(value_inline(offset)){
+            return 1;
+        }
+        // 释放原来的value
+        if((latch = latch_acquire(db, self, LATCH_X)) == NULL){
+            return -1;
+        }
+        node_seek(db, old, self);
+        pthread_mutex_lock(&db->lock);
+        value_unref(db, old, offset);
+        head_flush(db);
+        pthread_mutex_unlock(&db->lock);
+        latch_release(db, latch);
+        return 1;
+    }
+
+    // 一直持有原value数据块的闩锁，它不会再成为db->current，分配新的value时跳过它，不会等待自己
+    if((latch = latch_acquire(db, self, LATCH_X)) == NULL){
+        return -1;
+    }
+    node_seek(db, old, self);
+    if(offset != self && !value_large(value_size)){
+        pval = btree_value_ptr(old, pos);
+        slot = value_slot(pval->size);
+        if(need <= slot || (pos + slot == old->last && pos + need <= db->block_size)){
+            pval->size = value_size;
+            memcpy(pval->value, value, value_size);
+            if(pos + slot == old->last){
+                old->last = pos + need;// 最后一个value可以伸缩
+            }else if(need < slot){
+                // 多出的空间成为空洞
+                btree_value_ptr(old, pos + need)->size = slot - need - sizeof(btree_value);
+                pthread_mutex_lock(&db->lock);
+                value_hole(db, old, pos + need);
+                pthread_mutex_unlock(&db->lock);
+            }
+            node_flush(db, old);
+            latch_release(db, latch);
+            return 1;
+        }
+        // 原value所在的数据块正是db->current时，直接在其中分配
+        pthread_mutex_lock(&db->lock);
+        if(db->current == self){
+            if(old->last + need <= db->block_size){
+                pval = btree_value_ptr(old, old->last);
+                pval->size = value_size;
+                memcpy(pval->value, value, value_size);
+                k->value = self + old->last;
+                old->last += need;
+                value_hole(db, old, pos);
+                pthread_mutex_unlock(&db->lock);
+                node_flush(db, old);
+                node_flush(db, node);
+                latch_release(db, latch);
+                return 1;
+            }
+            db->current = 0;
+            head_flush(db);
+        }
+        pthread_mutex_unlock(&db->lock);
+    }
+
+    if((offset = value_store(db, valnode, value, value_size, &l_val)) == 0){
+        latch_release(db, latch);
+        return -1;
+    }
+    latch_release(db, l_val);
+    k->value = offset;
+    node_flush(db, node);
+    pthread_mutex_lock(&db->lock);
+    value_unref(db, old, self + pos);
+    head_flush(db);
+    pthread_mutex_unlock(&db->lock);
+    latch_release(db, latch);
+    return 1;
+}
+
+/**
+ * @brief 把btree_value数据块中的value移到新分配的空间，整理时使用，调用者需持有关键字所在Btree节点的排他闩锁
+ * @param[in] node 关键字所在的Btree节点
+ * @param[in] old, valnode 数据块缓冲
+ * @return ==1 if successful, ==-1 error
+ */
+static int value_move(db_t *db, btree_node *node, btree_key *k, btree_node *old, btree_node *valnode){
+    off_t offset = k->value, self = value_block(db,offset);
+    db_latch *latch, *l_val = NULL;
+    if((latch = latch_acquire(db, self, LATCH_X)) == NULL){
+        return -1;
+    }
+    // 同value_replace，原数据块不再是db->current，分配时不会等待自己
+    pthread_mutex_lock(&db->lock);
+    if(db->current == self){
+        db->current = 0;
+        head_flush(db);
+    }
+    pthread_mutex_unlock(&db->lock);
+    node_seek(db, old, self);
+    btree_value *pval = btree_value_ptr(old, offset - self);
+    if((k->value = value_store(db, valnode, pval->value, pval->size, &l_val)) == 0){
+        k->value = offset;
+        latch_release(db, latch);
+        return -1;
+    }
+    latch_release(db, l_val);
+    node_flush(db, node);
+    pthread_mutex_lock(&db->lock);
+    value_unref(db, old, offset);
+    head_flush(db);
+    pthread_mutex_unlock(&db->lock);
+    latch_release(db, latch);
+    return 1;
+}
+
+DB_INLINE int btree_insert(db_t* db, void* key, void *value, size_t value_size, int upsert, int key_type, int simd){
+    db_key_info info = key_info(db, key_type), *ki = &info;
+    if(key_type == DB_STRINGKEY && strlen((char*)key) >= ki->key_size){
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(value_size > INT_MAX){
+        errno = E2BIG;
+        return -1;
+    }
+
+    char *scratch = node_scratch();
+    if(scratch == NULL){
+        return -1;
+    }
+
+    int i,cmp,rc = -1,edge = EDGE_LEFT|EDGE_RIGHT,sub_edge;
+    size_t n;
+    btree_node *node = (btree_node *)(scratch + db->block_size * 0);
+    btree_node *sub_x = (btree_node *)(scratch + db->block_size * 1);
+    btree_node *sub_y = (btree_node *)(scratch + db->block_size * 2);
+    btree_node *valnode = (btree_node *)(scratch + db->block_size * 3);
+    db_latch *l_node, *l_x = NULL, *l_y = NULL, *l_val = NULL;
+    // 关键字只会插入到叶子节点，在由上往下的遍历中，需要将已满的节点分裂
+    // 由上往下加排他闩锁，子节点未满或分裂之后，父节点不会再被修改，即可释放
+    /*     node       */
     /*    /    \      */
     /*  sub_x  sub_y  */
     
+    if((l_node = latch_acquire(db, DB_HEAD_SIZE, LATCH_X)) == NULL){
+        return -1;
+    }
+    node_seek(db, node, DB_HEAD_SIZE);// root 读取根节点
+
+    if(node->num >= ki->M-1){
+        // root is full 根节点已满
+        
+        if(node_create(db, sub_x, node->leaf, TYPE_KEY) == -1 || node_create(db, sub_y, node->leaf, TYPE_KEY) == -1){
+            goto out;
+        }
+
+        sub_x->num = node->num;
+        memcpy((char*)sub_x + sizeof(btree_node), (char*)node + sizeof(btree_node), db->block_size - sizeof(btree_node));
+
+        node->num = 0;
+        node->leaf = BTREE_NON_LEAF;
+        btree_key_ptr(ki,node,0)->child = sub_x->self;
+
+        btree_split_child(db, ki, node, 0, sub_x, sub_y, btree_split_point(db, ki, key_type, sub_x, key, edge));
+    }
+    
+    while(node->leaf == BTREE_NON_LEAF){
+        i = key_find(ki, key_type, simd, node, key);
+        if(i >= 0){
+            // 关键字已存在
+            goto exist;
+        }
+
+        i = -(i+1);
+        sub_edge = edge & ((i == 0 ? EDGE_LEFT : 0) | (i == node->num ? EDGE_RIGHT : 0));
+        
+        // 需要判断子节点是否已满
+        if((l_x = latch_acquire(db, btree_key_ptr(ki,node,i)->child, LATCH_X)) == NULL){
+            goto out;
+        }
+        node_seek(db, sub_x, btree_key_ptr(ki,node,i)->child);
+
+        if(sub_x->num < ki->M-1){
+            // child is no full 子节点未满
+            node_swap(node, sub_x);
+            latch_swap(l_node, l_x);
+            latch_release(db, l_x);
+            l_x = NULL;
+            edge = sub_edge;
+            continue;
+        }
+
+        n = btree_split_point(db, ki, key_type, sub_x, key, sub_edge);
+        if(db->share && n == ceil(ki->M)){
+            // 不在边缘追加时先尝试移给兄弟，之后在node中重新查找要进入的子树
+            if((rc = btree_share(db, ki, node, i, sub_x, sub_y)) == -1){
+                goto out;
+            }
+            if(rc == 1){
+                rc = -1;
+                latch_release(db, l_x);
+                l_x = NULL;
+                continue;
+            }
+            rc = -1;
+        }
+
+        // child is full 子节点已满，开始分裂
+        if(node_create(db, sub_y, sub_x->leaf, TYPE_KEY) == -1){
+            goto out;
+        }
+        btree_split_child(db, ki, node, i, sub_x, sub_y, n);
+
+        // 判断上升的关键字
+        cmp = key_compare(key_type, key, btree_key_ptr(ki,node,i)->key, ki->key_size);
+        if(cmp == 0){
+            // 上升的关键字相同
+            goto exist;
+        }else if(cmp > 0){
+            // 上升的关键字更大
+            if((l_y = latch_acquire(db, sub_y->self, LATCH_X)) == NULL){
+                goto out;
+            }
+            node_swap(node, sub_y);
+            latch_swap(l_node, l_y);
+            edge = sub_edge & EDGE_RIGHT;
+        }else{
+            // 上升的关键字更小
+            node_swap(node, sub_x);
+            latch_swap(l_node, l_x);
+            edge = sub_edge & EDGE_LEFT;
+        }
+        latch_release(db, l_x);
+        latch_release(db, l_y);
+        l_x = l_y = NULL;
+    }
+
+    i = key_find(ki, key_type, simd, node, key);
+    if(i >= 0){
+        // 关键字已存在
+        goto exist;
+    }
+
+    i = -(i+1);
+
+    // 先存储值，放得下时存放在关键字的槽中，不分配btree_value
+    off_t offset = inline_fits(db, value_size) ? VALUE_INLINE | value_size : value_store(db, valnode, value, value_size, &l_val);
+    if(offset == 0){
+        goto out;
+    }
+
+    // 再存储关键字
+    // leaf node right shift one position 叶子节点右移腾出一个空位
+    keycpy(ki, btree_key_ptr(ki,node,i+1), btree_key_ptr(ki,node,i), node->num-i);
+    switch (key_type)
+    {
+    case DB_STRINGKEY:
+        strcpy((char*)(btree_key_ptr(ki,node,i)->key), key);
+        break;
+    case DB_BYTESKEY:
+    case DB_INT32KEY:
+    case DB_INT64KEY:
+        memcpy(btree_key_ptr(ki,node,i)->key, key, ki->key_size);
+        break;
+    }
+    btree_key_ptr(ki, node, i)->value = offset;
+    if(value_inline(offset)){
+        memcpy(inline_data(ki, btree_key_ptr(ki, node, i)), value, value_size);
+    }
+    node->num++;
+    node_flush(db, node);
+    pthread_mutex_lock(&db->lock);
+    db->key_total++;
+    head_flush(db);
+    pthread_mutex_unlock(&db->lock);
+    rc = 1;
+    goto out;
+
+exist:
+    // node已加排他闩锁，sub_x与sub_y已写回，可以用作数据块缓冲
+    rc = upsert ? value_replace(db, node, btree_key_ptr(ki,node,i), sub_x, valnode, value, value_size) : 0;
+
+out:
+    latch_release(db, l_val);
+    latch_release(db, l_y);
+    latch_release(db, l_x);
+    latch_release(db, l_node);
+    return rc;
+}
+
+DB_INLINE int btree_update(db_t* db, void* key, void *value, size_t value_size, int key_type, int simd){
+    db_key_info info = key_info(db, key_type), *ki = &info;
+    if(key_type == DB_STRINGKEY && strlen((char*)key) >= ki->key_size){
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(value_size > INT_MAX){
+        errno = E2BIG;
+        return -1;
+    }
+
+    char *scratch = node_scratch();
+    if(scratch == NULL){
+        return -1;
+    }
+
+    int i, rc;
+    off_t offset;
+    btree_node *node = (btree_node *)(scratch + db->block_size * 0);
+    btree_node *child = (btree_node *)(scratch + db->block_size * 1);
+    btree_node *old = (btree_node *)(scratch + db->block_size * 2);
+    btree_node *valnode = (btree_node *)(scratch + db->block_size * 3);
+    db_latch *latch, *l_child;
+    // 不改变树的结构，由上往下加排他闩锁，取得子节点之后即释放父节点
+    if((latch = latch_acquire(db, DB_HEAD_SIZE, LATCH_X)) == NULL){
+        return -1;
+    }
+    if(!bloom_maybe(db, key)){
+        latch_release(db, latch);
+        return 0;
+    }
+    node_seek(db, node, DB_HEAD_SIZE);
+    for(;;){
+        i = key_find(ki, key_type, simd, node, key);
+        if(i >= 0){
+            rc = value_replace(db, node, btree_key_ptr(ki,node,i), old, valnode, value, value_size);
+            break;
+        }
+        i = -(i+1);
+        offset = btree_key_ptr(ki, node, i)->child;
+        if(offset == 0){
+            bloom_miss(db);
+            rc = 0;
+            break;
+        }
+        if((l_child = latch_acquire(db, offset, LATCH_X)) == NULL){
+            rc = -1;
+            break;
+        }
+        node_seek(db, child, offset);
+        latch_release(db, latch);
+        node_swap(node, child);
+        latch = l_child;
+    }
+    latch_release(db, latch);
+    return rc;
+}
+
+DB_INLINE int btree_delete(db_t* db, void* key, int key_type, int simd){
+    db_key_info info = key_info(db, key_type), *ki = &info;
+    if(key_type == DB_STRINGKEY && strlen((char*)key) >= ki->key_size){
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *scratch = node_scratch();
+    if(scratch == NULL){
+        return -1;
+    }
+
+    #define LESS 1
+    #define MORE 2
+    int i,i_match=-1,flag = 0,rc = -1,n;
+    off_t sibling[2];
+    btree_node *node = (btree_node *)(scratch + db->block_size * 0);
+    btree_node *node_match = (btree_node *)(scratch + db->block_size * 1);
+    btree_node *sub_x = (btree_node *)(scratch + db->block_size * 2);
+    btree_node *sub_y = (btree_node *)(scratch + db->block_size * 3);
+    btree_node *sub_w = (btree_node *)(scratch + db->block_size * 4);
+    db_latch *l_node, *l_match = NULL, *l_x = NULL, *l_y = NULL, *l_w = NULL, *l_val = NULL;
+    /* 删除只会发生在叶子节点，在由上往下的遍历中，需要保证叶子节点有足够的关键字数（大于ceil(M)） */
+    /* 由上往下加排他闩锁，兄弟节点只在持有父节点时加锁；在非叶子节点中匹配到时，一直持有该节点直到替换关键字 */
+    /*       __  node       */
+    /*     /    /    \      */
+    /*  sub_w  sub_x sub_y  */
+
+    if((l_node = latch_acquire(db, DB_HEAD_SIZE, LATCH_X)) == NULL){
+        return -1;
+    }
+    // 一定不存在的key不必由上往下调整子树
+    if(!bloom_maybe(db, key)){
+        latch_release(db, l_node);
+        return 0;
+    }
     node_seek(db, node, DB_HEAD_SIZE);// root 读取根节点
 
-    if(node->num >= db->M-1){
-        // root is full 根节点已满
-        
-        if(node_create(db, sub_x, node->leaf, TYPE_KEY) == -1 || node_create(db, sub_y, node->leaf, TYPE_KEY) == -1){
+    while(node->leaf == BTREE_NON_LEAF){
+        switch (flag)
+        {
+        case LESS:
+            i = -0-1;
+            break;
+        case MORE:
+            i = -node->num-1;
+            break;
+        default:
+            i = key_find(ki, key_type, simd, node, key);
+            break;
+        }
+
+        // match when in internal 在非叶子节点中匹配到，需要找到在前缀或后缀关键字（该关键字只会在叶子结点中）
+        if(i >= 0){
+            // 左右子树可能都要读出，一次预读
+            sibling[0] = btree_key_ptr(ki,node,i)->child;
+            sibling[1] = btree_key_ptr(ki,node,i+1)->child;
+            node_prefetch_many(db, sibling, 2);
+            // 判断左子树是否方便删除前缀关键字（左子树关键字个数大于ceil(M)）
+            if((l_x = latch_acquire(db, btree_key_ptr(ki,node,i)->child, LATCH_X)) == NULL){
+                goto out;
+            }
+            node_seek(db, sub_x, btree_key_ptr(ki,node,i)->child);
+            if(sub_x->num > ceil(ki->M)){
+                // 寻找前缀关键字，即是寻找左子树的最大关键字
+                flag = MORE;
+                i_match = i;
+                node_swap(node_match, node);
+                latch_swap(l_match, l_node);
+                node_swap(node, sub_x);
+                latch_swap(l_node, l_x);
+            }else{
+                // 判断右子树是否方便删除后缀关键字（右子树关键字个数大于ceil(M)）
+                if((l_y = latch_acquire(db, btree_key_ptr(ki,node,i+1)->child, LATCH_X)) == NULL){
+                    goto out;
+                }
+                node_seek(db,sub_y,btree_key_ptr(ki,node,i+1)->child);
+                if(sub_y->num > ceil(ki->M)){
+                    // 寻找后缀关键字，即是寻找右子树的最小关键字
+                    flag = LESS;
+                    i_match = i;
+                    node_swap(node_match, node);
+                    latch_swap(l_match, l_node);
+                    node_swap(node, sub_y);
+                    latch_swap(l_node, l_y);
+                }else{
+                    // 左右子树都不方便，则合并
+                    if(!btree_merge(db, ki, node, i, sub_x, sub_y)){
+                        node_swap(node, sub_x);
+                        latch_swap(l_node, l_x);
+                    }
+                }
+            }
+            latch_release(db, l_x);
+            latch_release(db, l_y);
+            l_x = l_y = NULL;
+            continue;
+        }
+        
+        i = -(i+1);
+
+        // need prepare , make sure child have enough key 自上而下调整子树，保证最后在叶子节点处方便删除关键字（自上而下，确保子树关键字个数大于ceil(M)）
+        if((l_x = latch_acquire(db, btree_key_ptr(ki,node,i)->child, LATCH_X)) == NULL){
+            goto out;
+        }
+        node_seek(db, sub_x, btree_key_ptr(ki,node,i)->child);
+
+        if(sub_x->num > ceil(ki->M)){
+            // already enough
+            node_swap(node, sub_x);
+            latch_swap(l_node, l_x);
+            latch_release(db, l_x);
+            l_x = NULL;
+            continue;
+        }
+
+        // 需要从兄弟借或与兄弟合并，左右兄弟一次预读
+        n = 0;
+        if(i+1<=node->num){
+            sibling[n++] = btree_key_ptr(ki,node,i+1)->child;
+        }
+        if(i-1>=0){
+            sibling[n++] = btree_key_ptr(ki,node,i-1)->child;
+        }
+        node_prefetch_many(db, sibling, n);
+
+        if(i+1<=node->num){
+            if((l_y = latch_acquire(db, btree_key_ptr(ki,node,i+1)->child, LATCH_X)) == NULL){
+                goto out;
+            }
+            node_seek(db, sub_y, btree_key_ptr(ki,node,i+1)->child);
+        }
+
+        if(i-1>=0 && ((i+1>node->num) || sub_y->num<=ceil(ki->M))){
+            if((l_w = latch_acquire(db, btree_key_ptr(ki,node,i-1)->child, LATCH_X)) == NULL){
+                goto out;
+            }
+            node_seek(db, sub_w, btree_key_ptr(ki,node,i-1)->child);
+        }
+        
+        if(i+1<=node->num && sub_y->num>ceil(ki->M)){
+            // borrow from right 从子树的右兄弟借
+            memcpy(btree_key_ptr(ki,sub_x,sub_x->num)->key, btree_key_ptr(ki,node,i)->key, ki->key_align - sizeof(btree_key));
+            btree_key_ptr(ki,sub_x,sub_x->num)->value = btree_key_ptr(ki,node,i)->value;
+            btree_key_ptr(ki,sub_x,sub_x->num+1)->child = btree_key_ptr(ki,sub_y,0)->child;
+            sub_x->num++;
+
+            memcpy(btree_key_ptr(ki,node,i)->key, btree_key_ptr(ki,sub_y,0)->key, ki->key_align - sizeof(btree_key));
+            btree_key_ptr(ki,node,i)->value = btree_key_ptr(ki,sub_y,0)->value;
+            keycpy(ki, btree_key_ptr(ki,sub_y,0),btree_key_ptr(ki,sub_y,1), sub_y->num-1);
+            sub_y->num--;
+
+            node_flush(db,node);
+            node_flush(db,sub_x);
+            node_flush(db,sub_y);
+            node_swap(node, sub_x);
+            latch_swap(l_node, l_x);
+            stat_add(db, borrow_right, 1);
+        }else if(i-1>=0 && sub_w->num>ceil(ki->M)){
+            // borrow from left 从子树的左兄弟借
+            keycpy(ki, btree_key_ptr(ki,sub_x,1),btree_key_ptr(ki,sub_x,0), sub_x->num);
+            memcpy(btree_key_ptr(ki,sub_x,0)->key, btree_key_ptr(ki,node,i-1)->key, ki->key_align - sizeof(btree_key));
+            btree_key_ptr(ki,sub_x,0)->value = btree_key_ptr(ki,node,i-1)->value;
+            btree_key_ptr(ki,sub_x,0)->child = btree_key_ptr(ki,sub_w,sub_w->num)->child;
+            sub_x->num++;
+            
+            memcpy(btree_key_ptr(ki,node,i-1)->key, btree_key_ptr(ki,sub_w,sub_w->num-1)->key, ki->key_align - sizeof(btree_key));
+            btree_key_ptr(ki,node,i-1)->value = btree_key_ptr(ki,sub_w,sub_w->num-1)->value;
+            sub_w->num--;
+
+            node_flush(db,node);
+            node_flush(db,sub_x);
+            node_flush(db,sub_w);
+            node_swap(node, sub_x);
+            latch_swap(l_node, l_x);
+            stat_add(db, borrow_left, 1);
+        }else{
+            if(i+1<=node->num){
+                // merge with right
+                if(!btree_merge(db,ki,node,i,sub_x,sub_y)){
+                    node_swap(node, sub_x);
+                    latch_swap(l_node, l_x);
+                }
+            }else{
+                // merge with left
+                if(!btree_merge(db,ki,node,i-1,sub_w,sub_x)){
+                    node_swap(node, sub_w);
+                    latch_swap(l_node, l_w);
+                }
+            }
+        }
+        // 释放父节点、兄弟节点与合并后释放的数据块
+        latch_release(db, l_x);
+        latch_release(db, l_y);
+        latch_release(db, l_w);
+        l_x = l_y = l_w = NULL;
+    }
+
+    off_t offset = 0;
+    if(flag == LESS || flag == MORE){
+        offset = btree_key_ptr(ki,node_match,i_match)->value;
+    }else{
+        i = key_find(ki, key_type, simd, node, key);
+        if(i < 0){
+            bloom_miss(db);
+            rc = 0;
+            goto out;
+        }
+        offset = btree_key_ptr(ki,node,i)->value;
+    }
+    // value数据块在Btree节点之后加锁，存放在关键字槽中的value随关键字一起删除
+    if(!value_inline(offset) && (l_val = latch_acquire(db, value_block(db,offset), LATCH_X)) == NULL){
+        goto out;
+    }
+
+    if(flag == LESS){
+        // 找到后缀关键字，即是右子树的最小关键字
+        memcpy(btree_key_ptr(ki,node_match,i_match)->key, btree_key_ptr(ki,node,0)->key, ki->key_align - sizeof(btree_key));
+        btree_key_ptr(ki,node_match,i_match)->value = btree_key_ptr(ki,node,0)->value;
+        keycpy(ki, btree_key_ptr(ki,node,0), btree_key_ptr(ki,node,1), node->num-1);
+        node->num--;
+        node_flush(db,node_match);
+        node_flush(db,node);
+    }else if(flag == MORE){
+        // 找到前缀关键字，即是左子树的最大关键字
+        memcpy(btree_key_ptr(ki,node_match,i_match)->key, btree_key_ptr(ki,node,node->num-1)->key, ki->key_align - sizeof(btree_key));
+        btree_key_ptr(ki,node_match,i_match)->value = btree_key_ptr(ki,node,node->num-1)->value;
+        node->num--;
+        node_flush(db,node_match);
+        node_flush(db,node);
+    }else{
+        // 关键字刚好在叶子节点
+        keycpy(ki, btree_key_ptr(ki,node,i),btree_key_ptr(ki,node,i+1), node->num - i - 1);
+        node->num--;
+        node_flush(db,node);
+    }
+
+    // release value block 释放关键字对应的value
+    if(!value_inline(offset)){
+        node_seek(db, node, value_block(db,offset));
+    }
+    pthread_mutex_lock(&db->lock);
+    if(!value_inline(offset)){
+        value_unref(db, node, offset);
+    }
+    db->key_total--;
+    head_flush(db);
+    pthread_mutex_unlock(&db->lock);
+    rc = 1;
+
+out:
+    latch_release(db, l_val);
+    latch_release(db, l_w);
+    latch_release(db, l_y);
+    latch_release(db, l_x);
+    latch_release(db, l_match);
+    latch_release(db, l_node);
+    return rc;
+}
+
+/**
+ * @brief 写操作开始与结束，修改计数在两处都增加，游标据此判断叶子节点的副本是否失效
+ * 期间持有quiesce的共享锁，打开快照时等待进行中的写操作结束
+ */
+inline static void write_begin(db_t *db){
+    pthread_rwlock_rdlock(&db->quiesce);
+    __atomic_add_fetch(&db->writers, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&db->gen, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief 批量写独占执行：等待进行中的写操作结束并提交，之后的写操作等待批量写结束，用write_end结束
+ */
+inline static void batch_begin(db_t *db){
+    pthread_rwlock_wrlock(&db->quiesce);
+    __atomic_add_fetch(&db->writers, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&db->gen, 1, __ATOMIC_SEQ_CST);
+}
+
+inline static void write_end(db_t *db){
+    __atomic_add_fetch(&db->gen, 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&db->writers, 1, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock(&db->quiesce);
+}
+
+/**
+ * @brief 没有正在执行的写操作时返回修改计数，否则返回0
+ */
+inline static uint64_t write_quiet(db_t *db){
+    uint64_t gen = __atomic_load_n(&db->gen, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&db->writers, __ATOMIC_SEQ_CST) == 0 ? gen : 0;
+}
+
+/**
+ * @brief insert key 插入值，可以由多个线程同时调用
+ * @param[in] db 数据库句柄
+ * @param[in] key key_size can't exceed max_key_size 需要保证key类型和创建数据库时一致
+ * @param[in] value
+ * @param[in] value_size 超过一个数据块时存放在区段中，不能超过INT_MAX
+ * @return ==1 if success, ==0 if key repeat, ==-1 error
+*/
+int db_insert(db_t* db, void* key, void *value, size_t value_size){
+    uint64_t begin = stat_clock();
+    unsigned char *code = NULL;
+    if(db->compress){
+        // 在写操作之外压缩，不延长持有闩锁的时间
+        if(value_encode(value, &value_size, &code) == -1){
+            return -1;
+        }
+        value = code;
+    }
+    write_begin(db);
+    uint64_t epoch = wal_begin(db);
+    // 插入仍要下降到叶子节点，过滤器不能省去查找，只需加入key
+    bloom_add(db, key);
+    int rc = db->ops->insert(db, key, value, value_size, 0);
+    if(wal_end(db, epoch) == -1){
+        rc = -1;
+    }
+    write_end(db);
+    free(code);
+    bloom_grow(db);
+    stat_latency(db, DB_STAT_INSERT, begin);
+    return rc;
+}
+
+/**
+ * @brief update key 修改已存在关键字的值，可以由多个线程同时调用
+ * 新值放得下时在原来的位置改写，否则另外存储，只修改关键字指向的位置，不调整Btree
+ * @param[in] db 数据库句柄
+ * @param[in] key key_size can't exceed max_key_size 需要保证key类型和创建数据库时一致
+ * @param[in] value
+ * @param[in] value_size 不能超过INT_MAX
+ * @return ==1 if success, ==0 if key no found, ==-1 error
+*/
+int db_update(db_t* db, void* key, void *value, size_t value_size){
+    uint64_t begin = stat_clock();
+    unsigned char *code = NULL;
+    if(db->compress){
+        // 在写操作之外压缩，不延长持有闩锁的时间
+        if(value_encode(value, &value_size, &code) == -1){
+            return -1;
+        }
+        value = code;
+    }
+    write_begin(db);
+    uint64_t epoch = wal_begin(db);
+    int rc = db->ops->update(db, key, value, value_size);
+    if(wal_end(db, epoch) == -1){
+        rc = -1;
+    }
+    write_end(db);
+    free(code);
+    stat_latency(db, DB_STAT_UPDATE, begin);
+    return rc;
+}
+
+/**
+ * @brief upsert key 关键字不存在时插入，已存在时修改值（同db_update），只由上往下查找一次，可以由多个线程同时调用
+ * @param[in] db 数据库句柄
+ * @param[in] key key_size can't exceed max_key_size 需要保证key类型和创建数据库时一致
+ * @param[in] value
+ * @param[in] value_size 不能超过INT_MAX
+ * @return ==1 if success, ==-1 error
+*/
+int db_upsert(db_t* db, void* key, void *value, size_t value_size){
+    uint64_t begin = stat_clock();
+    unsigned char *code = NULL;
+    if(db->compress){
+        // 在写操作之外压缩，不延长持有闩锁的时间
+        if(value_encode(value, &value_size, &code) == -1){
+            return -1;
+        }
+        value = code;
+    }
+    write_begin(db);
+    uint64_t epoch = wal_begin(db);
+    bloom_add(db, key);
+    int rc = db->ops->insert(db, key, value, value_size, 1);
+    if(wal_end(db, epoch) == -1){
+        rc = -1;
+    }
+    write_end(db);
+    free(code);
+    bloom_grow(db);
+    stat_latency(db, DB_STAT_UPSERT, begin);
+    return rc;
+}
+
+/**
+ * @brief delete key 删除值，可以由多个线程同时调用
+ * @param[in] db 数据库句柄
+ * @param[in] key key_size can't exceed max_key_size 需要保证key类型和创建数据库时一致
+ * @return ==1 if success, ==0 if key no found, ==-1 error
+*/
+int db_delete(db_t* db, void* key){
+    uint64_t begin = stat_clock();
+    write_begin(db);
+    uint64_t epoch = wal_begin(db);
+    int rc = db->ops->delete(db, key);
+    if(wal_end(db, epoch) == -1){
+        rc = -1;
+    }
+    write_end(db);
+    stat_latency(db, DB_STAT_DELETE, begin);
+    return rc;
+}
+
+/**
+ * @brief write batch 按顺序执行一批插入/修改与删除，整批作为一个写操作提交，可以由多个线程同时调用
+ * 需要启用预写日志：整批独占执行（等待其他写操作结束，期间其他写操作等待），只有一次提交，修改过的数据块与文件头各写入日志一次，
+ * 崩溃后恢复为全部执行或全部未执行；执行中途出错（I/O错误、空间不够）时停止并撤销整批，不提交
+ * 执行之前压缩所有value并检查参数，有不合法的操作时都不执行；result记录到出错的操作为止的结果
+ * 执行期间其他线程可以读到已执行的部分，同一个key的多个操作按顺序生效
+ * @param[in] db 数据库句柄
+ * @param[in] n 操作数
+ * @param[in,out] ops 操作，result返回各操作的结果
+ * @return 修改了数据库的操作数 >=0 if success, ==-1 error（ENOTSUP 未启用预写日志，EINVAL 类型不合法或字符串key过长，E2BIG value过长或操作数超过DB_BATCH_MAX）
+*/
+int db_write_batch(db_t* db, size_t n, db_batch_op *ops){
+    uint64_t begin = stat_clock();
+    unsigned char **code = NULL;
+    size_t *code_size = NULL, i;
+    int rc = 0, count = 0, err, head_log = 0;
+    char head[DB_HEAD_PERSIST];
+    if(db->wal == NULL){
+        // 没有日志时中途出错无法撤销已写入文件的操作，整批不是原子的
+        errno = ENOTSUP;
+        return -1;
+    }
+    if(n > DB_BATCH_MAX){
+        // 未写入日志的数据块不能换出，整批修改的数据块都要放得下
+        errno = E2BIG;
+        return -1;
+    }
+    for(i=0;i<n;i++){
+        ops[i].result = -1;
+        if((ops[i].type != DB_BATCH_PUT && ops[i].type != DB_BATCH_DELETE)
+            || (db->key_type == DB_STRINGKEY && strlen((char*)ops[i].key) >= db->key_size)){
+            errno = EINVAL;
+            return -1;
+        }
+        if(ops[i].type == DB_BATCH_PUT && ops[i].value_size > INT_MAX){
+            errno = E2BIG;
+            return -1;
+        }
+    }
+    if(db->compress){
+        // 在写操作之外压缩，不延长持有闩锁的时间
+        code = calloc(n + 1, sizeof(*code));
+        code_size = malloc(sizeof(*code_size) * (n + 1));
+        if(code == NULL || code_size == NULL){
+            rc = -1;
+            goto out;
+        }
+        for(i=0;i<n;i++){
+            if(ops[i].type != DB_BATCH_PUT){
+                continue;
+            }
+            code_size[i] = ops[i].value_size;
+            if(value_encode(ops[i].value, &code_size[i], &code[i]) == -1){
+                rc = -1;
+                goto out;
+            }
+            if(code_size[i] > INT_MAX){
+                errno = E2BIG;
+                rc = -1;
+                goto out;
+            }
+        }
+    }
+
+    // 独占执行，本组只有本批，出错时撤销不影响其他写操作
+    batch_begin(db);
+    pthread_mutex_lock(&db->lock);
+    memcpy(head, db, DB_HEAD_PERSIST);
+    head_log = db->wal->head;
+    pthread_mutex_unlock(&db->lock);
+    db->wal->undo = 1;
+    uint64_t epoch = wal_begin(db);
+    for(i=0;i<n && rc != -1;i++){
+        if(ops[i].type == DB_BATCH_PUT){
+            bloom_add(db, ops[i].key);
+            if(code != NULL){
+                rc = db->ops->insert(db, ops[i].key, code[i], code_size[i], 1);
+            }else{
+                rc = db->ops->insert(db, ops[i].key, ops[i].value, ops[i].value_size, 1);
+            }
+        }else{
+            rc = db->ops->delete(db, ops[i].key);
+        }
+        ops[i].result = rc;
+        count += rc == 1;
+    }
+    if(rc == -1){
+        err = errno;
+        wal_abort(db, head, head_log);
+        errno = err;
+    }else if(wal_end(db, epoch) == -1){
+        rc = -1;
+    }
+    wal_undo_end(db->wal);
+    write_end(db);
+    bloom_grow(db);
+
+out:
+    if(code != NULL){
+        for(i=0;i<n;i++){
+            free(code[i]);
+        }
+    }
+    free(code);
+    free(code_size);
+    stat_latency(db, DB_STAT_BATCH, begin);
+    return rc == -1 ? -1 : count;
+}
+
+/**
+ * @brief 从已取得的btree_value数据块中复制value，参数同value_read
+ * @param[in] pos value在数据块中的偏移
+ */
+static int value_copy(db_t *db, btree_node *node, size_t pos, size_t from, void *value, size_t value_size, size_t *total){
+    btree_value *pval = btree_value_ptr(node, pos);
+    if(pval->size > db->block_size - pos - sizeof(btree_value)){
+        // 游标的副本已过期时可能读到
+        errno = EIO;
+        return -1;
+    }
+    return value_decode(db, pval->value, pval->size, from, value, value_size, total);
+}
+
+/**
+ * @brief 读出value的[from, from+value_size)，调用者需持有引用该value的Btree节点的闩锁
+ * @param[in] k 关键字，value存放在其槽中时直接复制，否则k->value是value所在数据块的位置 + 偏移，偏移为0时是区段
+ * @param[out] total 不为NULL时返回value的总长度，否则value必须完整读出，from被忽略
+ * @return >=0 读出的字节数 if success, ==-1 error
+ */
+static int value_read(db_t *db, btree_key *k, size_t from, void *value, size_t value_size, size_t *total){
+    db_latch *latch;
+    off_t offset = k->value, self = value_block(db,offset);
+    if(value_inline(offset)){
+        if(inline_len(offset) > db->inline_size){
+            // 游标的副本已过期时可能读到
+            errno = EIO;
+            return -1;
+        }
+        return value_decode(db, inline_data(db, k), inline_len(offset), from, value, value_size, total);
+    }
+    if(offset == self){
+        return extent_read(db, self, from, value, value_size, total);
+    }
+    btree_node *node = node_get(db, self, &latch);
+    if(node == NULL){
+        return -1;
+    }
+    int rc = value_copy(db, node, offset-self, from, value, value_size, total);
+    node_put(db, node, latch);
+    return rc;
+}
+
+/**
+ * @brief 判断存储的数据能否直接作为value引用：未压缩，或压缩模式下原样存储
+ * @param[in,out] data, size 存储的数据，可以引用时换成value
+ * @return ==1 可以引用, ==0 需要解压, ==-1 数据损坏
+ */
+static int view_raw(db_t *db, unsigned char **data, size_t *size){
+    if(!db->compress){
+        return 1;
+    }
+    uint32_t code = *size >= VALUE_CODE ? *(uint32_t*)*data : 0;
+    if(code & VALUE_LZ){
+        return 0;
+    }
+    if(*size < VALUE_CODE || code != *size - VALUE_CODE){
+        errno = EIO;
+        return -1;
+    }
+    *data += VALUE_CODE;
+    *size -= VALUE_CODE;
+    return 1;
+}
+
+/**
+ * @brief 建立关键字k的value的视图，调用者持有k所在Btree节点的共享闩锁，返回时由视图持有或已释放
+ * value在关键字的槽中或btree_value数据块中、且未压缩时直接引用，所在的数据块固定并持有共享闩锁直到释放视图；
+ * 压缩的value与区段读出到视图私有的缓冲
+ * @param[in] node, latch k所在的Btree节点与它的共享闩锁
+ * @return >=0 value的长度 if success, ==-1 error
+ */
+static int view_open(db_t *db, btree_node *node, db_latch *latch, btree_key *k, db_view *view){
+    off_t offset = k->value, self = value_block(db,offset);
+    btree_node *vnode = node;
+    db_latch *l_val = latch;
+    btree_value *pval;
+    unsigned char *data = NULL;
+    size_t size = 0, total = 0;
+    int rc = 0;
+
+    if(value_inline(offset)){
+        if(inline_len(offset) <= db->inline_size){
+            data = inline_data(db, k);
+            size = inline_len(offset);
+        }
+    }else if(offset != self){
+        // value数据块在Btree节点之后加锁，同value_read
+        if((vnode = node_get(db, self, &l_val)) == NULL){
+            node_put(db, node, latch);
+            return -1;
+        }
+        pval = btree_value_ptr(vnode, offset - self);
+        if(pval->size <= db->block_size - (offset - self) - sizeof(btree_value)){
+            data = pval->value;
+            size = pval->size;
+        }
+    }
+    if(data != NULL && (rc = view_raw(db, &data, &size)) == 1){
+        if(vnode != node){
+            node_put(db, node, latch);
+        }
+        view->data = data;
+        view->size = size;
+        view->node = vnode;
+        view->latch = l_val;
+        return size;
+    }
+    if(vnode != node){
+        node_put(db, vnode, l_val);
+    }
+
+    // 先取得长度再完整读出，数据损坏时由value_read返回EIO
+    if(rc != -1 && (rc = value_read(db, k, 0, NULL, 0, &total)) != -1){
+        if((view->copy = malloc(total + 1)) == NULL || (rc = value_read(db, k, 0, view->copy, total, NULL)) == -1){
+            free(view->copy);
+            view->copy = NULL;
+            rc = -1;
+        }
+    }
+    node_put(db, node, latch);
+    if(rc == -1){
+        return -1;
+    }
+    view->data = view->copy;
+    view->size = total;
+    return total;
+}
+
+/**
+ * @brief 由上往下查找key，加共享闩锁，取得子节点之后释放父节点
+ * @param[out] found, latch 找到时关键字所在的节点与它的共享闩锁，用node_put释放
+ * @return 关键字 if found, ==NULL 不存在（ENOMSG）或error
+ */
+DB_INLINE btree_key* btree_find(db_t* db, void* key, btree_node **found, db_latch **latch, int key_type, int simd){
+    db_key_info info = key_info(db, key_type), *ki = &info;
+    if(key_type == DB_STRINGKEY && strlen((char*)key) >= ki->key_size){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    btree_node *node, *child;
+    db_latch *l_child;
+    int i;
+    off_t offset;
+
+    // 只读访问，不需要复制数据块
+    if((node = node_get(db, DB_HEAD_SIZE, latch)) == NULL){
+        return NULL;
+    }
+    if(!bloom_maybe(db, key)){
+        node_put(db, node, *latch);
+        errno = ENOMSG;
+        return NULL;
+    }
+    for(;;){
+        i = key_find(ki, key_type, simd, node, key);
+        if(i >= 0){
+            *found = node;
+            return btree_key_ptr(ki, node, i);
+        }
+        i = -(i+1);
+        offset = btree_key_ptr(ki, node, i)->child;
+        if(offset == 0){
+            bloom_miss(db);
+            errno = ENOMSG;
+            break;
+        }
+        if((child = node_get(db, offset, &l_child)) == NULL){
+            break;
+        }
+        node_put(db, node, *latch);
+        node = child;
+        *latch = l_child;
+    }
+    node_put(db, node, *latch);
+    return NULL;
+}
+
+DB_INLINE int btree_search(db_t* db, void* key, size_t from, void *value, size_t value_size, size_t *total, int key_type, int simd){
+    btree_node *node;
+    db_latch *latch;
+    btree_key *k = btree_find(db, key, &node, &latch, key_type, simd);
+    if(k == NULL){
+        return -1;
+    }
+    int rc = value_read(db, k, from, value, value_size, total);
+    node_put(db, node, latch);
+    return rc;
+}
+
+DB_INLINE int btree_view(db_t* db, void* key, db_view *view, int key_type, int simd){
+    btree_node *node;
+    db_latch *latch;
+    btree_key *k = btree_find(db, key, &node, &latch, key_type, simd);
+    if(k == NULL){
+        return -1;
+    }
+    return view_open(db, node, latch, k, view);
+}
+
+/**
+ * @brief 为每种key类型生成特化的Btree操作
+ * key_type与simd是常量，内联之后比较、节点内查找与key_align、M都在编译期确定，不再经过函数指针
+ */
+#define btree_ops(name,key_type,simd,qual)                                                   \
+qual static int btree_insert_##name(db_t *db, void *key, void *value, size_t value_size, int upsert){ \
+    return btree_insert(db, key, value, value_size, upsert, key_type, simd);               \
+}                                                                                          \
+qual static int btree_delete_##name(db_t *db, void *key){                                  \
+    return btree_delete(db, key, key_type, simd);                                          \
+}                                                                                          \
+qual static int btree_search_##name(db_t *db, void *key, size_t from, void *value, size_t value_size, size_t *total){ \
+    return btree_search(db, key, from, value, value_size, total, key_type, simd);          \
+}                                                                                          \
+qual static int btree_update_##name(db_t *db, void *key, void *value, size_t value_size){  \
+    return btree_update(db, key, value, value_size, key_type, simd);                       \
+}                                                                                          \
+qual static int btree_view_##name(db_t *db, void *key, db_view *view){                     \
+    return btree_view(db, key, view, key_type, simd);                                      \
+}                                                                                          \
+static const db_ops ops_##name = {btree_insert_##name, btree_delete_##name, btree_search_##name, btree_update_##name, btree_view_##name};
+
+btree_ops(string,DB_STRINGKEY,0,)
+btree_ops(bytes,DB_BYTESKEY,0,)
+btree_ops(int32,DB_INT32KEY,0,)
+btree_ops(int64,DB_INT64KEY,0,)
+#ifdef DB_SIMD
+btree_ops(simd_int32,DB_INT32KEY,1,DB_AVX2)
+btree_ops(simd_int64,DB_INT64KEY,1,DB_AVX2)
+#endif
+
+/**
+ * @brief 选择key类型对应的特化操作，整数key在CPU支持AVX2时使用SIMD版本
+ */
+static const db_ops* btree_ops_select(int key_type){
+    switch (key_type)
+    {
+    case DB_STRINGKEY:
+        return &ops_string;
+    case DB_BYTESKEY:
+        return &ops_bytes;
+    case DB_INT32KEY:
+#ifdef DB_SIMD
+        if(__builtin_cpu_supports("avx2")){
+            return &ops_simd_int32;
+        }
+#endif
+        return &ops_int32;
+    default:
+#ifdef DB_SIMD
+        if(__builtin_cpu_supports("avx2")){
+            return &ops_simd_int64;
+        }
+#endif
+        return &ops_int64;
+    }
+}
+
+/**
+ * @brief search key 查询值，可以由多个线程同时调用
+ * @param[in] db 数据库句柄
+ * @param[in] key key_size can't exceed max_key_size 需要保证key类型和创建数据库时一致
+ * @param[out] value
+ * @param[in] value_size 需要保证空间足够大
+ * @return >=0 if success, ==-1 error
+*/
+int db_search(db_t* db, void* key, void *value, size_t value_size){
+    uint64_t begin = stat_clock();
+    int rc = db->ops->search(db, key, 0, value, value_size, NULL);
+    stat_latency(db, DB_STAT_SEARCH, begin);
+    return rc;
+}
+
+/**
+ * @brief search key from offset 分段读取值，用于大value，不需要一次提供完整的缓冲，可以由多个线程同时调用
+ * @param[in] db 数据库句柄
+ * @param[in] key key_size can't exceed max_key_size 需要保证key类型和创建数据库时一致
+ * @param[in] offset 从value的第offset个字节开始读取
+ * @param[out] value
+ * @param[in] value_size 最多读取的字节数
+ * @param[out] total value的总长度，可以为NULL
+ * @return >=0 读取的字节数，offset不小于value的长度时为0, ==-1 error
+*/
+int db_search_stream(db_t* db, void* key, size_t offset, void *value, size_t value_size, size_t *total){
+    size_t size;
+    uint64_t begin = stat_clock();
+    int rc = db->ops->search(db, key, offset, value, value_size < INT_MAX ? value_size : INT_MAX, &size);
+    stat_latency(db, DB_STAT_SEARCH, begin);
+    if(rc >= 0 && total != NULL){
+        *total = size;
+    }
+    return rc;
+}
+
+/**
+ * @brief search value size 只取value的长度，不读出value，用于确定db_search的缓冲大小；压缩的value不解压
+ * @param[in] db 数据库句柄
+ * @param[in] key key_size can't exceed max_key_size 需要保证key类型和创建数据库时一致
+ * @param[out] size value的长度
+ * @return ==0 if success, ==-1 error
+*/
+int db_search_size(db_t* db, void* key, size_t *size){
+    char none;
+    uint64_t begin = stat_clock();
+    int rc = db->ops->search(db, key, 0, &none, 0, size);
+    stat_latency(db, DB_STAT_SEARCH, begin);
+    return rc >= 0 ? 0 : -1;
+}
+
+/**
+ * @brief get value view 取得value的只读视图，不复制到调用者的缓冲，也不需要预先知道长度，可以由多个线程同时调用
+ * 未压缩的value直接引用缓冲池的帧或mmap映射，所在的数据块持有共享闩锁，修改它的写操作等待，直到db_view_release；
+ * 压缩的value与区段中的大value读出到视图私有的缓冲
+ * 持有视图的线程在释放之前不能再调用其他读写操作（包括再取一个视图），否则可能与等待该数据块的写操作互相等待
+ * @param[in] db 数据库句柄
+ * @param[in] key key_size can't exceed max_key_size 需要保证key类型和创建数据库时一致
+ * @param[out] view 成功时view->data与view->size是value，用db_view_release释放
+ * @return >=0 value的长度 if success, ==-1 error
+*/
+int db_get_view(db_t* db, void* key, db_view *view){
+    uint64_t begin = stat_clock();
+    memset(view, 0, sizeof(db_view));
+    view->db = db;
+    int rc = db->ops->view(db, key, view);
+    stat_latency(db, DB_STAT_SEARCH, begin);
+    return rc;
+}
+
+/**
+ * @brief release value view 释放视图，解除数据块的固定与闩锁，之后view->data不再有效；未成功取得的视图也可以释放
+ */
+void db_view_release(db_view *view){
+    if(view->node != NULL){
+        node_put(view->db, view->node, view->latch);
+    }
+    free(view->copy);
+    memset(view, 0, sizeof(db_view));
+}
+
+/**
+ * @brief db_search_many的输入，按key排序
+ */
+typedef struct{
+    void *key;
+    size_t i;          /** 在调用者数组中的下标 */
+    int pos;           /** 在当前节点中要进入的子树，>=0；已找到或不存在时为-1 */
+}many_key;
+
+/**
+ * @brief 找到的关键字的value位置，按位置排序后每个btree_value数据块只取一次
+ */
+typedef struct{
+    off_t value;
+    size_t i;
+}many_value;
+
+/**
+ * @brief db_search_many的状态
+ */
+typedef struct{
+    db_t *db;
+    many_key *key;
+    size_t nkey;
+    many_value *found;
+    size_t nfound;
+    struct{
+        btree_node *node;
+        db_latch *latch;
+    }*hold;            /** 已加共享闩锁的Btree节点，读完所有value之后才释放，value不会被移动或释放 */
+    size_t nhold;
+    size_t cap;
+    void **values;
+    size_t *value_sizes;
+    int *results;
+}db_many;
+
+static int cmp_many_key(const void *a, const void *b, void *arg){
+    db_t *db = arg;
+    return db->key_cmp(((many_key*)a)->key, ((many_key*)b)->key, db->key_size);
+}
+
+static int cmp_many_value(const void *a, const void *b){
+    off_t x = ((many_value*)a)->value, y = ((many_value*)b)->value;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief 由上往下查找[lo, hi)的key，同一子树的key一起进入，每个节点只访问一次
+ * 节点读出失败时，该子树中的key返回-errno，其余继续
+ * @return ==0 if successful, ==-1 内存不足
+ */
+static int many_descend(db_many *m, off_t offset, size_t lo, size_t hi){
+    db_t *db = m->db;
+    btree_node *node;
+    db_latch *latch;
+    off_t child[DB_PREFETCH];
+    size_t j, k;
+    int i, n = 0;
+
+    if(m->nhold == m->cap){
+        void *hold = realloc(m->hold, sizeof(*m->hold) * m->cap * 2);
+        if(hold == NULL){
+            return -1;
+        }
+        m->hold = hold;
+        m->cap *= 2;
+    }
+    if((node = node_get(db, offset, &latch)) == NULL){
+        for(j=lo;j<hi;j++){
+            m->results[m->key[j].i] = -errno;
+        }
+        return 0;
+    }
+    m->hold[m->nhold].node = node;
+    m->hold[m->nhold++].latch = latch;
+
+    for(j=lo;j<hi;j++){
+        m->key[j].pos = -1;
+        // 持有根节点的闩锁时排除一定不存在的key
+        if(offset == DB_HEAD_SIZE && !bloom_maybe(db, m->key[j].key)){
+            continue;
+        }
+        i = key_binary_search(db, node, m->key[j].key);
+        if(i >= 0 && value_inline(btree_key_ptr(db, node, i)->value)){
+            // value存放在关键字的槽中，直接复制
+            k = m->key[j].i;
+            m->results[k] = value_read(db, btree_key_ptr(db, node, i), 0, m->values[k], m->value_sizes[k], NULL);
+            m->results[k] = m->results[k] >= 0 ? m->results[k] : -errno;
+        }else if(i >= 0){
+            m->found[m->nfound].value = btree_key_ptr(db, node, i)->value;
+            m->found[m->nfound++].i = m->key[j].i;
+        }else if(btree_key_ptr(db, node, -(i+1))->child != 0){
+            m->key[j].pos = -(i+1);
+        }else{
+            bloom_miss(db);
+        }
+    }
+
+    // key已排序，进入同一子树的key相邻；先一次预读要进入的子树
+    for(j=lo;j<hi;j++){
+        if(m->key[j].pos >= 0 && (n == 0 || child[n-1] != btree_key_ptr(db, node, m->key[j].pos)->child)){
+            child[n++] = btree_key_ptr(db, node, m->key[j].pos)->child;
+            if(n == DB_PREFETCH){
+                node_prefetch_many(db, child, n);
+                n = 0;
+            }
+        }
+    }
+    node_prefetch_many(db, child, n);
+
+    for(j=lo;j<hi;j=k){
+        for(k=j+1;k<hi && m->key[k].pos==m->key[j].pos;k++);
+        if(m->key[j].pos >= 0 && many_descend(m, btree_key_ptr(db, node, m->key[j].pos)->child, j, k) == -1){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief search many keys 一次查询多个key，可以由多个线程同时调用
+ * key排序后由上往下只遍历一次，进入同一子树的key共享路径上的节点，子树一次预读；
+ * 找到的value按位置排序，同一个btree_value数据块只取一次
+ * 遍历期间路径上的节点都持有共享闩锁，直到读完所有value，期间其他线程不能修改这些节点
+ * @param[in] db 数据库句柄
+ * @param[in] n key的个数
+ * @param[in] keys key_size can't exceed max_key_size 需要保证key类型和创建数据库时一致
+ * @param[out] values 每个key的value缓冲
+ * @param[in] value_sizes 每个缓冲的大小
+ * @param[out] results 每个key的结果，>=0 value的长度, ==-ENOMSG key no found, ==-E2BIG 缓冲不够, ==-EINVAL key过长, 其他负数为-errno
+ * @return 找到的key数 >=0 if success, ==-1 error
+*/
+int db_search_many(db_t* db, size_t n, void **keys, void **values, size_t *value_sizes, int *results){
+    uint64_t begin = stat_clock();
+    db_many m = {db};
+    btree_node *node;
+    db_latch *latch;
+    size_t i, j, k;
+    off_t self;
+    int rc = -1;
+
+    m.key = malloc(sizeof(many_key) * n + 1);
+    m.found = malloc(sizeof(many_value) * n + 1);
+    m.cap = DB_BULK_LEVEL;
+    m.hold = malloc(sizeof(*m.hold) * m.cap);
+    m.values = values;
+    m.value_sizes = value_sizes;
+    m.results = results;
+    if(m.key == NULL || m.found == NULL || m.hold == NULL){
+        goto out;
+    }
+    for(i=0;i<n;i++){
+        results[i] = -ENOMSG;
+        if(db->key_type == DB_STRINGKEY && strlen((char*)keys[i]) >= db->key_size){
+            results[i] = -EINVAL;
+            continue;
+        }
+        m.key[m.nkey].key = keys[i];
+        m.key[m.nkey++].i = i;
+    }
+    qsort_r(m.key, m.nkey, sizeof(many_key), cmp_many_key, db);
+
+    if(m.nkey != 0 && many_descend(&m, DB_HEAD_SIZE, 0, m.nkey) == -1){
+        goto out;
+    }
+
+    qsort(m.found, m.nfound, sizeof(many_value), cmp_many_value);
+    for(j=0;j<m.nfound;j=k){
+        self = value_block(db, m.found[j].value);
+        for(k=j+1;k<m.nfound && value_block(db, m.found[k].value)==self;k++);
+        if(m.found[j].value == self){
+            // 区段，逐个读出
+            for(;j<k;j++){
+                i = m.found[j].i;
+                results[i] = extent_read(db, self, 0, values[i], value_sizes[i], NULL);
+                results[i] = results[i] >= 0 ? results[i] : -errno;
+            }
+            continue;
+        }
+        // 一次只持有一个btree_value数据块的闩锁，写操作可能持有其他数据块的排他闩锁
+        if((node = node_get(db, self, &latch)) == NULL){
+            for(;j<k;j++){
+                results[m.found[j].i] = -errno;
+            }
+            continue;
+        }
+        for(;j<k;j++){
+            i = m.found[j].i;
+            results[i] = value_copy(db, node, m.found[j].value - self, 0, values[i], value_sizes[i], NULL);
+            results[i] = results[i] >= 0 ? results[i] : -errno;
+        }
+        node_put(db, node, latch);
+    }
+    for(rc=0,i=0;i<n;i++){
+        rc += results[i] >= 0;
+    }
+
+out:
+    // 由下往上释放
+    while(m.nhold > 0){
+        m.nhold--;
+        node_put(db, m.hold[m.nhold].node, m.hold[m.nhold].latch);
+    }
+    free(m.key);
+    free(m.found);
+    free(m.hold);
+    stat_latency(db, DB_STAT_SEARCH_MANY, begin);
+    return rc;
+}
+
+/**
+ * @brief 读出快照中的数据块：保存了旧版本时取旧版本，否则该数据块打开快照以来没有修改，读出当前内容
+ * 持有该数据块的snap_latch的共享锁，写操作不能同时保存该数据块的旧版本并写入，因此不需要闩锁；只等待写入同一段数据块的写操作
+ * @return ==0 if successful, ==-1 error
+ */
+static int snap_read(db_snapshot *snap, off_t offset, btree_node *node){
+    db_t *db = snap->db;
+    pthread_rwlock_t *latch = &db->snap_latch[snap_hash(offset, DB_SNAP_LATCH - 1)];
+    snap_entry *e;
+    int rc = 0;
+    pthread_rwlock_rdlock(latch);
+    pthread_rwlock_rdlock(&snap->lock);
+    e = snap_lookup(snap, offset);
+    pthread_rwlock_unlock(&snap->lock);
+    if(__atomic_load_n(&snap->stale, __ATOMIC_ACQUIRE)){
+        errno = ESTALE;
+        rc = -1;
+    }else if(e != NULL){
+        rc = snap_load(db, e->image, node);
+    }else if(offset < (off_t)DB_HEAD_SIZE || offset >= snap->end || (offset - DB_HEAD_SIZE) % db->block_size != 0){
+        errno = EIO;
+        rc = -1;
+    }else if(node_seek(db, node, offset) == -1){
+        rc = -1;
+    }
+    pthread_rwlock_unlock(latch);
+    return rc;
+}
+
+/**
+ * @brief 读出快照中关键字k的value，存放在关键字槽中时直接复制，区段逐个数据块读出
+ * @param[in] k 快照中的关键字
+ * @param[in] buf 一个数据块的缓冲
+ * @return >=0 value的长度 if success, ==-1 error
+ */
+static int snap_value(db_snapshot *snap, btree_key *k, void *value, size_t value_size, btree_node *buf){
+    db_t *db = snap->db;
+    off_t offset = k->value, self = value_block(db,offset);
+    btree_value *pval = btree_value_ptr(buf, sizeof(btree_node));
+    size_t size, done = 0, len, pos = sizeof(btree_node) + sizeof(btree_value);
+    unsigned char *data = value;
+    int rc;
+
+    if(value_inline(offset)){
+        return value_decode(db, inline_data(db, k), inline_len(offset), 0, value, value_size, NULL);
+    }
+    if(snap_read(snap, self, buf) == -1){
+        return -1;
+    }
+    if(offset != self){
+        return value_copy(db, buf, offset-self, 0, value, value_size, NULL);
+    }
+    size = pval->size;
+    if(buf->type != TYPE_VALUE || buf->leaf != BTREE_EXTENT || buf->last == 0 || size > extent_payload * buf->last - sizeof(btree_value)){
+        errno = EIO;
+        return -1;
+    }
+    if(db->compress){
+        // 先读出存储的数据再解码
+        if((data = malloc(size)) == NULL){
+            return -1;
+        }
+    }else if(size > value_size){
+        errno = E2BIG;
+        return -1;
+    }
+    while(done < size){
+        len = size - done < db->block_size - pos ? size - done : db->block_size - pos;
+        memcpy(data + done, (char*)buf + pos, len);
+        done += len;
+        self += db->block_size;
+        pos = sizeof(btree_node);
+        if(done < size && snap_read(snap, self, buf) == -1){
+            break;
+        }
+    }
+    rc = done < size ? -1 : (int)size;
+    if(db->compress){
+        if(rc != -1){
+            rc = value_decode(db, data, size, 0, value, value_size, NULL);
+        }
+        free(data);
+    }
+    return rc;
+}
+
+/**
+ * @brief open snapshot 打开只读快照，等待进行中的写操作结束，之后的写操作不影响快照读到的数据
+ * 快照打开期间，每个数据块第一次修改前复制一份旧版本，超过db_options.snap_memory的部分写入临时文件，最后一个快照关闭时全部释放；
+ * 旧版本保存失败时快照失效，之后读取返回ESTALE；不能整理（EBUSY）
+ * @param[in] db 数据库句柄
+ * @param[out] snap 快照
+ * @return ==0 if successful, ==-1 error
+*/
+int db_snapshot_open(db_t *db, db_snapshot **snap){
+    *snap = calloc(1, sizeof(db_snapshot));
+    if(*snap == NULL){
+        return -1;
+    }
+    (*snap)->bucket = calloc(DB_SNAP_BUCKET, sizeof(snap_entry*));
+    if((*snap)->bucket == NULL){
+        free(*snap);
+        return -1;
+    }
+    (*snap)->db = db;
+    (*snap)->mask = DB_SNAP_BUCKET - 1;
+    rwlock_init(&(*snap)->lock);
+
+    pthread_rwlock_wrlock(&db->quiesce);
+    pthread_mutex_lock(&db->lock);
+    (*snap)->end = db->end;
+    pthread_mutex_unlock(&db->lock);
+    pthread_rwlock_wrlock(&db->snap_lock);
+    (*snap)->next = db->snap;
+    __atomic_store_n(&db->snap, *snap, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&db->snap_lock);
+    pthread_rwlock_unlock(&db->quiesce);
+    return 0;
+}
+
+/**
+ * @brief close snapshot 关闭快照，释放只被该快照引用的旧版本，快照的游标需已关闭
+ * @param[in] snap 快照
+*/
+void db_snapshot_close(db_snapshot *snap){
+    db_t *db = snap->db;
+    db_snapshot **p;
+    snap_entry *e, *next;
+    size_t i;
+
+    pthread_rwlock_wrlock(&db->snap_lock);
+    for(p=&db->snap;*p!=snap;p=&(*p)->next);
+    __atomic_store_n(p, snap->next, __ATOMIC_RELEASE);
+    for(i=0;i<=snap->mask;i++){
+        for(e=snap->bucket[i];e!=NULL;e=next){
+            next = e->next;
+            if(--e->image->ref == 0){
+                snap_release(db, e->image);
+            }
+            free(e);
+        }
+    }
+    if(db->snap == NULL){
+        snap_store_reset(db);
+    }
+    pthread_rwlock_unlock(&db->snap_lock);
+    pthread_rwlock_destroy(&snap->lock);
+    free(snap->bucket);
+    free(snap);
+}
+
+/**
+ * @brief search key in snapshot 在快照中查找，可以由多个线程同时调用，不加闩锁，不等待写操作
+ * @param[in] snap 快照
+ * @param[in] key
+ * @param[out] value
+ * @param[in] value_size
+ * @return >=0 value的长度 if success, ==-1 error, errno==ENOMSG 快照中没有该key, errno==ESTALE 内存不够保存旧版本，快照已失效
+*/
+int db_snapshot_search(db_snapshot *snap, void *key, void *value, size_t value_size){
+    db_t *db = snap->db;
+    if(db->key_type == DB_STRINGKEY && strlen((char*)key) >= db->key_size){
+        errno = EINVAL;
+        return -1;
+    }
+    char *scratch = node_scratch();
+    if(scratch == NULL){
+        return -1;
+    }
+    btree_node *node = (btree_node *)(scratch + db->block_size * 0);
+    btree_node *valnode = (btree_node *)(scratch + db->block_size * 1);
+    off_t offset = DB_HEAD_SIZE;
+    int i;
+
+    for(;;){
+        if(snap_read(snap, offset, node) == -1){
+            return -1;
+        }
+        if((i = key_binary_search(db, node, key)) >= 0){
+            return snap_value(snap, btree_key_ptr(db, node, i), value, value_size, valnode);
+        }
+        offset = btree_key_ptr(db, node, -(i+1))->child;
+        if(offset == 0){
+            errno = ENOMSG;
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief 游标，按key顺序遍历[lo, hi)
+ * 每次由根节点往下定位，并保存所在叶子节点的副本；之后没有写操作时，直接在副本中移动，否则从当前关键字重新定位
+ * 快照的游标在快照中定位，副本一直有效
+ */
+#define CURSOR_INIT   0 /** 刚打开，next从lo开始，prev从hi开始 */
+#define CURSOR_ON     1 /** 位于key */
+#define CURSOR_SEEK   2 /** 位于key之前，next返回第一个不小于key的关键字，prev返回最后一个小于key的关键字 */
+#define CURSOR_BEFORE 3 /** 已越过起点 */
+#define CURSOR_AFTER  4 /** 已越过终点 */
+
+struct db_cursor_s{
+    db_t *db;
+    db_snapshot *snap;                  /** 所属的快照，NULL表示读当前数据 */
+    int state;                          /** CURSOR_INIT, CURSOR_ON, CURSOR_SEEK, CURSOR_BEFORE, CURSOR_AFTER */
+    int index;                          /** 当前关键字在副本中的位置，-1表示副本无效 */
+    uint64_t gen;                       /** 副本对应的修改计数 */
+    btree_node *leaf;                   /** 当前关键字所在叶子节点的副本 */
+    unsigned char *lo;                  /** 起点（包含），NULL表示不限 */
+    unsigned char *hi;                  /** 终点（不包含），NULL表示不限 */
+    unsigned char *key;                 /** 当前关键字 */
+};
+
+/**
+ * @brief 预读node的子树[from, to)，只预读未缓存的数据块，调用者持有node的闩锁
+ */
+static void cursor_prefetch(db_t *db, btree_node *node, int from, int to){
+    off_t child[DB_CURSOR_READAHEAD];
+    int i, n = 0;
+    if(from < 0){
+        from = 0;
+    }
+    if(to > (int)node->num + 1){
+        to = node->num + 1;
+    }
+    for(i=from;i<to && n<DB_CURSOR_READAHEAD;i++){
+        child[n++] = btree_key_ptr(db, node, i)->child;
+    }
+    node_prefetch_many(db, child, n);
+}
+
+/**
+ * @brief 复制关键字，string类型只复制到'\0'
+ */
+inline static void key_copy(db_t *db, void *dest, void *src){
+    if(db->key_type == DB_STRINGKEY){
+        strcpy((char*)dest, (char*)src);
+    }else{
+        memcpy(dest, src, db->key_size);
+    }
+}
+
+/**
+ * @brief 在快照中定位，参数与结果同cursor_locate；读的是副本，不加闩锁，候选关键字所在节点的副本保留到读出结果
+ */
+static int snap_locate(db_cursor *cursor, void *key, int strict, int forward, void *value, size_t value_size, int *size){
+    db_t *db = cursor->db;
+    char *scratch = node_scratch();
+    if(scratch == NULL){
+        return -1;
+    }
+    btree_node *node = (btree_node *)(scratch + db->block_size * 0);
+    btree_node *found = (btree_node *)(scratch + db->block_size * 1);
+    btree_node *valnode = (btree_node *)(scratch + db->block_size * 2);
+    off_t offset = DB_HEAD_SIZE;
+    int i, p, hit, leaf, found_p = -1;
+
+    cursor->index = -1;
+    for(;;){
+        if(snap_read(cursor->snap, offset, node) == -1){
+            return -1;
+        }
+        hit = 0;
+        if(key == NULL){
+            p = forward ? 0 : node->num;
+        }else if((i = key_binary_search(db, node, key)) >= 0){
+            hit = forward && !strict;
+            p = forward ? i + 1 : i;
+        }else{
+            p = -(i+1);
+        }
+        leaf = hit || node->leaf == BTREE_LEAF;
+        offset = btree_key_ptr(db, node, p)->child;
+        if(hit || (forward ? p < (int)node->num : p > 0)){
+            found_p = hit ? p - 1 : forward ? p : p - 1;
+            node_swap(node, found);
+        }
+        if(leaf){
+            break;
+        }
+    }
+
+    if(found_p < 0){
+        return 0;
+    }
+    btree_key *k = btree_key_ptr(db, found, found_p);
+    key_copy(db, cursor->key, k->key);
+    if((*size = snap_value(cursor->snap, k, value, value_size, valnode)) == -1){
+        *size = -errno;
+    }
+    if(found->leaf == BTREE_LEAF){
+        memcpy(cursor->leaf, found, db->block_size);
+        cursor->index = found_p;
+    }
+    return 1;
+}
+
+/**
+ * @brief 由根节点往下定位，forward时定位到第一个不小于key（strict时大于key）的关键字，否则定位到最后一个小于key的关键字
+ * key为NULL时表示无穷小（forward）或无穷大，结果写入cursor->key，value的长度写入size（出错时为-errno）
+ * 加共享闩锁由上往下，叶子节点中没有结果时，结果是路径上最近一个有后继（或前驱）关键字的祖先，该祖先的闩锁一直持有到读出结果
+ * @return ==1 if successful, ==0 if end, ==-1 error
+ */
+static int cursor_locate(db_cursor *cursor, void *key, int strict, int forward, void *value, size_t value_size, int *size){
+    if(cursor->snap != NULL){
+        return snap_locate(cursor, key, strict, forward, value, value_size, size);
+    }
+    db_t *db = cursor->db;
+    uint64_t gen = write_quiet(db);
+    btree_node *node = NULL, *found = NULL, *child;
+    db_latch *latch = NULL, *l_found = NULL, *l_child;
+    off_t offset = DB_HEAD_SIZE;
+    int i, p, hit, found_p = 0;
+
+    cursor->index = -1;
+    for(;;){
+        if((child = node_get(db, offset, &l_child)) == NULL){
+            if(node != NULL && node != found){
+                node_put(db, node, latch);
+            }
+            if(found != NULL){
+                node_put(db, found, l_found);
+            }
+            return -1;
+        }
+        if(node != NULL && node != found){
+            node_put(db, node, latch);
+        }
+        node = child;
+        latch = l_child;
+
+        // 子树p的关键字都在node[p-1]与node[p]之间
+        hit = 0;
+        if(key == NULL){
+            p = forward ? 0 : node->num;
+        }else if((i = key_binary_search(db, node, key)) >= 0){
+            hit = forward && !strict;
+            p = forward ? i + 1 : i;
+        }else{
+            p = -(i+1);
+        }
+
+        if(hit || (forward ? p < (int)node->num : p > 0)){
+            // 新的候选，替换更上层的候选
+            if(found != NULL){
+                node_put(db, found, l_found);
+            }
+            found = node;
+            l_found = latch;
+            found_p = hit ? p - 1 : forward ? p : p - 1;
+        }
+        if(hit || node->leaf == BTREE_LEAF){
+            if(node != found){
+                node_put(db, node, latch);
+            }
+            break;
+        }
+        if(forward){
+            cursor_prefetch(db, node, p + 1, p + 1 + DB_CURSOR_READAHEAD);
+        }else{
+            cursor_prefetch(db, node, p - DB_CURSOR_READAHEAD, p);
+        }
+        offset = btree_key_ptr(db, node, p)->child;
+    }
+
+    if(found == NULL){
+        return 0;
+    }
+    btree_key *k = btree_key_ptr(db, found, found_p);
+    key_copy(db, cursor->key, k->key);
+    if((*size = value_read(db, k, 0, value, value_size, NULL)) == -1){
+        *size = -errno;
+    }
+    if(found->leaf == BTREE_LEAF && gen != 0){
+        // 定位时没有写操作，之后可以在副本中移动
+        memcpy(cursor->leaf, found, db->block_size);
+        cursor->index = found_p;
+        cursor->gen = gen;
+    }
+    node_put(db, found, l_found);
+    return 1;
+}
+
+/**
+ * @brief 在叶子节点的副本中移动，副本之后没有写操作时才有效
+ * @return ==1 if successful, ==0 需要重新定位
+ */
+static int cursor_step(db_cursor *cursor, int forward, void *value, size_t value_size, int *size){
+    db_t *db = cursor->db;
+    int j = forward ? cursor->index + 1 : cursor->index - 1;
+    if(cursor->index < 0 || j < 0 || j >= (int)cursor->leaf->num || (cursor->snap == NULL && __atomic_load_n(&db->gen, __ATOMIC_SEQ_CST) != cursor->gen)){
+        return 0;
+    }
+    btree_key *k = btree_key_ptr(db, cursor->leaf, j);
+    if(cursor->snap != NULL){
+        char *scratch = node_scratch();
+        if(scratch == NULL || (*size = snap_value(cursor->snap, k, value, value_size, (btree_node *)scratch)) == -1){
+            *size = -errno;
+        }
+    }else if((*size = value_read(db, k, 0, value, value_size, NULL)) == -1){
+        *size = -errno;
+    }
+    if(cursor->snap == NULL && __atomic_load_n(&db->gen, __ATOMIC_SEQ_CST) != cursor->gen){
+        // 读value时有写操作开始，结果不可信
+        return 0;
+    }
+    key_copy(db, cursor->key, k->key);
+    cursor->index = j;
+    return 1;
+}
+
+/**
+ * @brief open cursor 打开游标，遍历[lo, hi)
+ * 游标只能由一个线程使用，其他线程可以同时读写数据库
+ * @param[in] db 数据库句柄
+ * @param[out] cursor 游标
+ * @param[in] lo 起点（包含），NULL表示从第一个关键字开始
+ * @param[in] hi 终点（不包含），NULL表示到最后一个关键字为止
+ * @return ==0 if successful, ==-1 error
+*/
+int db_cursor_open(db_t *db, db_cursor **cursor, void *lo, void *hi){
+    if(db->key_type == DB_STRINGKEY && ((lo != NULL && strlen((char*)lo) >= db->key_size) || (hi != NULL && strlen((char*)hi) >= db->key_size))){
+        errno = EINVAL;
+        return -1;
+    }
+    *cursor = calloc(1, sizeof(db_cursor) + db->block_size + db->key_size * 3);
+    if(*cursor == NULL){
+        return -1;
+    }
+    (*cursor)->db = db;
+    (*cursor)->state = CURSOR_INIT;
+    (*cursor)->index = -1;
+    (*cursor)->leaf = (btree_node *)(*cursor + 1);
+    (*cursor)->key = (unsigned char *)(*cursor)->leaf + db->block_size;
+    if(lo != NULL){
+        (*cursor)->lo = (*cursor)->key + db->key_size;
+        key_copy(db, (*cursor)->lo, lo);
+    }
+    if(hi != NULL){
+        (*cursor)->hi = (*cursor)->key + db->key_size * 2;
+        key_copy(db, (*cursor)->hi, hi);
+    }
+    return 0;
+}
+
+/**
+ * @brief open cursor in snapshot 在快照中打开游标，遍历快照打开时的[lo, hi)，不受之后写操作的影响
+ * 游标只能由一个线程使用，需在快照关闭之前关闭
+ * @param[in] snap 快照
+ * @param[out] cursor 游标，之后与db_cursor_open打开的游标用法相同
+ * @param[in] lo 起点（包含），NULL表示从第一个关键字开始
+ * @param[in] hi 终点（不包含），NULL表示到最后一个关键字为止
+ * @return ==0 if successful, ==-1 error
+*/
+int db_snapshot_cursor(db_snapshot *snap, db_cursor **cursor, void *lo, void *hi){
+    if(db_cursor_open(snap->db, cursor, lo, hi) == -1){
+        return -1;
+    }
+    (*cursor)->snap = snap;
+    return 0;
+}
+
+/**
+ * @brief seek cursor 定位游标，之后next返回第一个不小于key的关键字，prev返回最后一个小于key的关键字
+ * @param[in] cursor 游标
+ * @param[in] key
+ * @return ==0 if successful, ==-1 error
+*/
+int db_cursor_seek(db_cursor *cursor, void *key){
+    db_t *db = cursor->db;
+    if(db->key_type == DB_STRINGKEY && strlen((char*)key) >= db->key_size){
+        errno = EINVAL;
+        return -1;
+    }
+    key_copy(db, cursor->key, key);
+    cursor->state = CURSOR_SEEK;
+    cursor->index = -1;
+    return 0;
+}
+
+/**
+ * @brief 移动游标，检查范围
+ */
+static int cursor_move(db_cursor *cursor, int forward, void *key, void *value, size_t value_size){
+    db_t *db = cursor->db;
+    void *from = forward ? cursor->lo : cursor->hi;
+    int rc, size = 0;
+    switch (cursor->state)
+    {
+    case CURSOR_ON:
+        rc = cursor_step(cursor, forward, value, value_size, &size);
+        if(rc == 0){
+            rc = cursor_locate(cursor, cursor->key, 1, forward, value, value_size, &size);
+        }
+        break;
+    case CURSOR_SEEK:
+        // next从max(key, lo)开始，prev从min(key, hi)开始
+        if(from == NULL || (forward ? 1 : -1) * db->key_cmp(cursor->key, from, db->key_size) > 0){
+            from = cursor->key;
+        }
+        rc = cursor_locate(cursor, from, 0, forward, value, value_size, &size);
+        break;
+    case CURSOR_BEFORE:
+    case CURSOR_AFTER:
+        if(cursor->state == (forward ? CURSOR_AFTER : CURSOR_BEFORE)){
+            errno = ENOMSG;
             return -1;
         }
+        rc = cursor_locate(cursor, from, 0, forward, value, value_size, &size);
+        break;
+    default:
+        rc = cursor_locate(cursor, from, 0, forward, value, value_size, &size);
+        break;
+    }
+    if(rc == -1){
+        cursor->index = -1;
+        return -1;
+    }
+    if(rc == 0
+        || (forward && cursor->hi != NULL && db->key_cmp(cursor->key, cursor->hi, db->key_size) >= 0)
+        || (!forward && cursor->lo != NULL && db->key_cmp(cursor->key, cursor->lo, db->key_size) < 0)
+    ){
+        cursor->state = forward ? CURSOR_AFTER : CURSOR_BEFORE;
+        cursor->index = -1;
+        errno = ENOMSG;
+        return -1;
+    }
+    cursor->state = CURSOR_ON;
+    if(key != NULL){
+        key_copy(db, key, cursor->key);
+    }
+    if(size < 0){
+        errno = -size;
+        return -1;
+    }
+    return size;
+}
 
-        sub_x->num = node->num;
-        memcpy((char*)sub_x + sizeof(btree_node), (char*)node + sizeof(btree_node), DB_BLOCK_SIZE - sizeof(btree_node));
+/**
+ * @brief next 移动到下一个关键字
+ * @param[in] cursor 游标
+ * @param[out] key 可以为NULL，空间不小于max_key_size
+ * @param[out] value
+ * @param[in] value_size 空间不够时返回E2BIG，游标仍然移动，可以用db_cursor_get重新读取
+ * @return >=0 value的长度 if successful, ==-1 error, errno==ENOMSG if end
+*/
+int db_cursor_next(db_cursor *cursor, void *key, void *value, size_t value_size){
+    return cursor_move(cursor, 1, key, value, value_size);
+}
 
-        node->num = 0;
-        node->leaf = BTREE_NON_LEAF;
-        btree_key_ptr(db,node,0)->child = sub_x->self;
+/**
+ * @brief prev 移动到上一个关键字
+ * @param[in] cursor 游标
+ * @param[out] key 可以为NULL，空间不小于max_key_size
+ * @param[out] value
+ * @param[in] value_size 空间不够时返回E2BIG，游标仍然移动，可以用db_cursor_get重新读取
+ * @return >=0 value的长度 if successful, ==-1 error, errno==ENOMSG if end
+*/
+int db_cursor_prev(db_cursor *cursor, void *key, void *value, size_t value_size){
+    return cursor_move(cursor, 0, key, value, value_size);
+}
 
-        btree_split_child(db, node, 0, sub_x, sub_y);
+/**
+ * @brief 重新读取游标当前的关键字与value
+ * @return >=0 value的长度 if successful, ==-1 error, errno==ENOMSG 当前关键字已被删除
+*/
+int db_cursor_get(db_cursor *cursor, void *key, void *value, size_t value_size){
+    if(cursor->state != CURSOR_ON){
+        errno = ENOMSG;
+        return -1;
     }
-    
-    while(node->leaf == BTREE_NON_LEAF){
-        i = key_binary_search(db, node, key);
-        if(i >= 0){
-            // 关键字已存在
-            return 0;
+    if(key != NULL){
+        key_copy(cursor->db, key, cursor->key);
+    }
+    if(cursor->snap != NULL){
+        return db_snapshot_search(cursor->snap, cursor->key, value, value_size);
+    }
+    return db_search(cursor->db, cursor->key, value, value_size);
+}
+
+/**
+ * @brief close cursor 关闭游标
+ * @param[in] cursor 游标
+*/
+void db_cursor_close(db_cursor *cursor){
+    free(cursor);
+}
+
+/**
+ * @brief 开始整理，分配半空数据块的位图，正在写入的区段读不出来，稍后再开始
+ * @return ==0 if successful, ==1 有正在写入的区段, ==-1 error
+ */
+static int compact_start(db_t *db){
+    db_compaction *cp = &db->compaction;
+    int rc = 0;
+    pthread_mutex_lock(&db->lock);
+    if(db->extending != 0){
+        rc = 1;
+    }else if((cp->sparse = calloc((db->end - DB_HEAD_SIZE) / db->block_size / 8 + 1, 1)) == NULL){
+        rc = -1;
+    }else{
+        cp->phase = COMPACT_PLAN;
+        cp->pos = DB_HEAD_SIZE + db->block_size;
+        cp->end = db->end;
+        cp->nsparse = (db->end - DB_HEAD_SIZE) / db->block_size;
+        cp->blocks = 1;
+        cp->bytes = 0;
+    }
+    pthread_mutex_unlock(&db->lock);
+    return rc;
+}
+
+/**
+ * @brief 结束整理，调用者需持有db->lock
+ */
+static void compact_finish(db_t *db){
+    db_compaction *cp = &db->compaction;
+    free(cp->sparse);
+    cp->sparse = NULL;
+    cp->nsparse = 0;
+    cp->limit = 0;
+    cp->phase = COMPACT_IDLE;
+}
+
+/**
+ * @brief 逐个访问数据块，value占用不到一半的btree_value数据块记入位图，其中的value按字节数计入需要的空间，其他数据块原样计入
+ * 访问完之后确定limit，留出1/8的余量给整理期间的写操作，文件不比limit大时不需要整理
+ * @return ==0 if successful, ==-1 error
+ */
+static int compact_plan(db_t *db, size_t *steps){
+    db_compaction *cp = &db->compaction;
+    btree_node *node;
+    db_latch *latch;
+    size_t p, slot, used, n;
+    off_t limit;
+    for(;*steps>0 && cp->pos<cp->end;cp->pos+=db->block_size,(*steps)--){
+        if((node = node_get(db, cp->pos, &latch)) == NULL){
+            return -1;
+        }
+        if(node->use && node->type == TYPE_VALUE && node->leaf == BTREE_EXTENT){
+            cp->blocks += node->last;
+            cp->pos += db->block_size * (node->last - 1);
+        }else if(node->use && node->type == TYPE_VALUE){
+            for(p=sizeof(btree_node),used=0;p<node->last;p+=slot){
+                slot = value_slot(btree_value_ptr(node, p)->size);
+                used += btree_value_ptr(node, p)->size & VALUE_HOLE ? 0 : slot;
+            }
+            if(used * 2 < db->block_size){
+                n = (cp->pos - DB_HEAD_SIZE) / db->block_size;
+                cp->sparse[n / 8] |= 1 << (n % 8);
+                cp->bytes += used;
+            }else{
+                cp->blocks++;
+            }
+        }else if(node->use){
+            cp->blocks++;
         }
+        node_put(db, node, latch);
+    }
+    if(cp->pos < cp->end){
+        return 0;
+    }
 
-        i = -(i+1);
-        
-        // 需要判断子节点是否已满
-        node_seek(db, sub_x, btree_key_ptr(db,node,i)->child);
+    n = cp->blocks + (cp->bytes + db->block_size - sizeof(btree_node) - 1) / (db->block_size - sizeof(btree_node));
+    limit = DB_HEAD_SIZE + db->block_size * (n + n / 8 + 1);
+    pthread_mutex_lock(&db->lock);
+    if(limit >= db->end){
+        compact_finish(db);
+    }else{
+        cp->phase = COMPACT_SWEEP;
+        cp->limit = limit;
+        cp->prev = 0;
+        cp->started = 0;
+        cp->pass = 0;
+        cp->stuck = 0;
+        cp->dst = limit;
+        if(db->current != 0 && compact_skip(db, db->current)){
+            db->current = 0;
+            head_flush(db);
+        }
+    }
+    pthread_mutex_unlock(&db->lock);
+    return 0;
+}
 
-        if(sub_x->num < db->M-1){
-            // child is no full 子节点未满
-            memcpy(node, sub_x, DB_BLOCK_SIZE);
-            continue;
+/**
+ * @brief 沿空闲链表摘除limit之后的数据块，之后从空闲链表分配的数据块都在limit之前
+ * 持有db->lock，修改空闲数据块时加闩锁但不等待
+ * @return ==0 if successful, ==1 闩锁被占用，稍后继续, ==-1 error
+ */
+static int compact_sweep(db_t *db, size_t *steps){
+    db_compaction *cp = &db->compaction;
+    char *scratch = node_scratch();
+    if(scratch == NULL){
+        return -1;
+    }
+    btree_node *node = (btree_node *)(scratch + db->block_size * 0);
+    btree_node *prev = (btree_node *)(scratch + db->block_size * 1);
+    db_latch *latch;
+    off_t next;
+    int rc = 0;
+    pthread_mutex_lock(&db->lock);
+    // 上次停下的数据块可能已被重新分配，从链表头重新开始，已摘除的不会再回到链表中
+    if(cp->prev != 0 && (node_seek(db, prev, cp->prev) == -1 || prev->use)){
+        cp->prev = 0;
+    }
+    while(*steps > 0){
+        next = cp->prev == 0 ? db->free : prev->free;
+        if(next == 0){
+            cp->phase = COMPACT_MOVE;
+            break;
+        }
+        if(node_seek(db, node, next) == -1){
+            rc = -1;
+            break;
+        }
+        if(next < cp->limit){
+            cp->prev = next;
+            node_swap(node, prev);
+        }else if(cp->prev == 0){
+            db->free = node->free;
+            head_flush(db);
+        }else if((latch = latch_acquire(db, cp->prev, LATCH_TRY)) != NULL){
+            prev->free = node->free;
+            node_flush(db, prev);
+            latch_release(db, latch);
+        }else{
+            rc = 1;
+            break;
         }
+        (*steps)--;
+    }
+    pthread_mutex_unlock(&db->lock);
+    return rc;
+}
 
-        // child is full 子节点已满，开始分裂
-        if(node_create(db, sub_y, sub_x->leaf, TYPE_KEY) == -1){
+/**
+ * @brief 把Btree节点复制到前面的空闲数据块，修改父节点中的child之后释放原来的数据块
+ * 调用者需持有父节点与该节点的排他闩锁，移动之后child与latch换成新的位置
+ * @param[in] k 父节点中指向该节点的关键字
+ * @param[in] tmp 数据块缓冲
+ * @return ==1 if moved, ==0 没有可用的空闲数据块, ==-1 error
+ */
+static int compact_node(db_t *db, btree_node *parent, btree_key *k, btree_node *child, btree_node *tmp, db_latch **latch){
+    db_latch *l_new = NULL;
+    off_t self;
+    if(node_create(db, tmp, child->leaf, TYPE_KEY) == -1){
+        return -1;
+    }
+    // 空闲链表已用完时在文件尾追加，移动没有意义；新数据块的闩锁可能还被释放它的线程持有
+    if(tmp->self >= db->compaction.limit || (l_new = latch_acquire(db, tmp->self, LATCH_TRY)) == NULL){
+        node_destroy(db, tmp);
+        return 0;
+    }
+    self = tmp->self;
+    memcpy(tmp, child, db->block_size);
+    tmp->self = self;
+    node_flush(db, tmp);
+    k->child = self;
+    node_flush(db, parent);
+    node_destroy(db, child);
+    latch_release(db, *latch);
+    *latch = l_new;
+    memcpy(child, tmp, db->block_size);
+    return 1;
+}
+
+/**
+ * @brief 把limit之后的区段移到更前面的连续空闲数据块：只在dst与区段之间寻找，这些空闲数据块等待截断，不在空闲链表中，其他线程不会分配
+ * 逐块复制并修改头部，直接写入文件；使用缓冲池时同时写入缓冲池，缓冲池中可能还有这些数据块释放时的脏帧，日志中也可能有它们更早的镜像
+ * 启用预写日志时文件中的副本在写回提交的镜像之前标记为未使用，读区段时不检查头部的use；本组释放、尚未提交的数据块不作为目标
+ * 调用者需持有关键字所在Btree节点的排他闩锁，读区段的线程都持有该闩锁
+ * @param[in] buf 数据块缓冲
+ * @return ==1 if moved, ==0 没有足够的连续空闲数据块, ==-1 error
+ */
+static int compact_extent(db_t *db, btree_key *k, btree_node *buf){
+    db_compaction *cp = &db->compaction;
+    off_t self = k->value, dst = 0, b;
+    size_t nblock, run = 0, i;
+    stat_read(db, 1, sizeof(btree_node));
+    if(pread(db->fd, buf, sizeof(btree_node), self) != sizeof(btree_node)){
+        return -1;
+    }
+    nblock = buf->last;
+    pthread_mutex_lock(&db->lock);
+    // 已预留的区段可能还没有写入，读出来像是空闲的
+    if(db->extending != 0){
+        pthread_mutex_unlock(&db->lock);
+        return 0;
+    }
+    for(b=cp->dst;run<nblock && b<self;b+=db->block_size){
+        if(node_seek(db, buf, b) == -1){
+            pthread_mutex_unlock(&db->lock);
             return -1;
         }
-        btree_split_child(db, node, i, sub_x, sub_y);
+        if(!buf->use && pool_logged(db, b)){
+            // 本组释放的数据块，提交之前崩溃时恢复为使用中，文件中的内容不能覆盖
+            run = 0;
+            continue;
+        }
+        if(!buf->use){
+            dst = run++ == 0 ? b : dst;
+            continue;
+        }
+        run = 0;
+        if(buf->type == TYPE_VALUE && buf->leaf == BTREE_EXTENT && buf->num != 0){
+            b += db->block_size * (buf->last - 1);// 跳过其他区段
+        }
+        if(cp->dst + db->block_size > b){
+            cp->dst = b + db->block_size;
+        }
+    }
+    if(run < nblock){
+        pthread_mutex_unlock(&db->lock);
+        return 0;
+    }
+    db->value_use_block += nblock;
+    head_flush(db);
+    pthread_mutex_unlock(&db->lock);
 
-        // 判断上升的关键字
-        rc = db->key_cmp(key, btree_key_ptr(db,node,i)->key, db->key_size);
-        if(rc == 0){
-            // 上升的关键字相同
-            return 0;
-        }else if(rc > 0){
-            // 上升的关键字更大
-            memcpy(node, sub_y, DB_BLOCK_SIZE);
+    for(i=0;i<nblock;i++){
+        stat_read(db, 1, db->block_size);
+        if(pread(db->fd, buf, db->block_size, self + db->block_size * i) != db->block_size){
+            break;
+        }
+        buf->self = dst + db->block_size * i;
+        buf->use = 1;// 来源可能是之前移动、还没有写回的副本
+        // 先写入缓冲池，之后该数据块之前的脏帧不会再写回覆盖文件中的副本；启用预写日志时帧在提交之前不会被换出
+        if(db->pool != NULL && node_flush(db, buf) == -1){
+            break;
+        }
+        // 启用预写日志时文件中的副本标记为未使用，崩溃在提交之前时，恢复后是没有被引用的空闲数据块；使用中的镜像经过缓冲池与修改关键字一起提交
+        buf->use = db->wal == NULL;
+        node_seal(buf, db->block_size);
+        stat_write(db, 1, db->block_size);
+        if(pwrite(db->fd, buf, db->block_size, buf->self) != db->block_size){
+            break;
+        }
+    }
+    pthread_mutex_lock(&db->lock);
+    if(i < nblock){
+        extent_free(db, buf, dst, nblock);
+        pthread_mutex_unlock(&db->lock);
+        return -1;
+    }
+    k->value = dst;
+    extent_free(db, buf, self, nblock);
+    pthread_mutex_unlock(&db->lock);
+    return 1;
+}
+
+/**
+ * @brief 由根节点往下到已处理的key之后的第一个叶子节点，把路径上limit之后的子节点移到前面，并移动路径上各节点中limit之后的value
+ * 不改变树的结构，由上往下加排他闩锁，取得子节点之后即释放父节点
+ * 叶子节点中没有key之后的关键字时，key推进到路径上最近一个有后继关键字的祖先中的后继，没有这样的祖先时遍历结束
+ * @return ==0 if successful, ==-1 error
+ */
+static int compact_move(db_t *db, size_t *steps){
+    db_compaction *cp = &db->compaction;
+    char *scratch = node_scratch();
+    if(scratch == NULL){
+        return -1;
+    }
+    btree_node *node = (btree_node *)(scratch + db->block_size * 0);
+    btree_node *child = (btree_node *)(scratch + db->block_size * 1);
+    btree_node *old = (btree_node *)(scratch + db->block_size * 2);
+    btree_node *valnode = (btree_node *)(scratch + db->block_size * 3);
+    btree_node *tmp = (btree_node *)(scratch + db->block_size * 4);
+    off_t next[sizeof(cp->key) / sizeof(off_t)], offset;// 后继关键字，按off_t对齐
+    int i, j, rc = 0, found = 0;
+    btree_key *k;
+    db_latch *latch, *l_child;
+    (*steps)--;
+    if((latch = latch_acquire(db, DB_HEAD_SIZE, LATCH_X)) == NULL){
+        return -1;
+    }
+    node_seek(db, node, DB_HEAD_SIZE);
+    for(;;){
+        for(j=0;j<node->num && rc!=-1;j++){
+            k = btree_key_ptr(db, node, j);
+            if(value_inline(k->value)){
+                continue;
+            }
+            offset = value_block(db,k->value);
+            if(k->value != offset){
+                if(!compact_skip(db, offset)){
+                    continue;
+                }
+                rc = value_move(db, node, k, old, valnode);
+            }else{
+                if(offset < cp->limit){
+                    continue;
+                }
+                if((rc = compact_extent(db, k, old)) == 1){
+                    node_flush(db, node);
+                }
+            }
+            if(rc == 0){
+                cp->stuck = 1;
+            }else if(rc == 1 && *steps > 0){
+                (*steps)--;
+            }
+        }
+        if(rc == -1){
+            break;
+        }
+        i = 0;
+        if(cp->started){
+            i = key_binary_search(db, node, cp->key);
+            i = i >= 0 ? i + 1 : -(i + 1);
+        }
+        if(i < node->num){
+            key_copy(db, next, btree_key_ptr(db, node, i)->key);
+            found = 1;
+        }
+        offset = btree_key_ptr(db, node, i)->child;
+        if(offset == 0){
+            break;
+        }
+        if((l_child = latch_acquire(db, offset, LATCH_X)) == NULL){
+            rc = -1;
+            break;
+        }
+        node_seek(db, child, offset);
+        if(offset >= cp->limit && (rc = compact_node(db, node, btree_key_ptr(db, node, i), child, tmp, &l_child)) == -1){
+            latch_release(db, l_child);
+            break;
+        }
+        if(offset >= cp->limit && rc == 0){
+            cp->stuck = 1;
+        }else if(offset >= cp->limit && *steps > 0){
+            (*steps)--;
+        }
+        latch_release(db, latch);
+        node_swap(node, child);
+        latch = l_child;
+    }
+    if(rc != -1){
+        if(!found && cp->stuck && cp->pass == 0){
+            // 第一次遍历腾出了空间，再遍历一次
+            cp->pass++;
+            cp->stuck = 0;
+            cp->started = 0;
+            cp->dst = cp->limit;
+        }else if(!found){
+            cp->phase = COMPACT_TRUNCATE;
+        }else if(i < node->num){
+            // 叶子节点中的关键字都已处理
+            key_copy(db, cp->key, btree_key_ptr(db, node, node->num - 1)->key);
         }else{
-            // 上升的关键字更小
-            memcpy(node, sub_x, DB_BLOCK_SIZE);
+            key_copy(db, cp->key, next);
         }
+        cp->started = found;
+        rc = 0;
     }
+    latch_release(db, latch);
+    return rc;
+}
 
-    i = key_binary_search(db, node, key);
-    if(i >= 0){
-        // 关键字已存在
-        return 0;
+/**
+ * @brief 从文件尾往前截断空闲的数据块，遇到使用中的数据块或到达limit时结束
+ * 持有db->lock，逐个加闩锁（不等待）之后缩短db->end；未启用预写日志时立即截断文件，否则由compact_checkpoint截断
+ * @return ==0 if successful, ==1 有正在写入的区段或闩锁被占用，稍后继续, ==-1 error
+ */
+static int compact_truncate(db_t *db, size_t *steps){
+    db_compaction *cp = &db->compaction;
+    btree_node *node = (btree_node *)node_scratch();
+    if(node == NULL){
+        return -1;
+    }
+    db_latch *latch;
+    off_t end;
+    int rc = 0;
+    pthread_mutex_lock(&db->lock);
+    // 正在写入的区段还读不出来
+    if(db->extending != 0){
+        pthread_mutex_unlock(&db->lock);
+        return 1;
     }
+    end = db->end;
+    while(*steps > 0){
+        if(db->end <= cp->limit){
+            cp->phase = COMPACT_RELINK;
+            break;
+        }
+        if((latch = latch_acquire(db, db->end - db->block_size, LATCH_TRY)) == NULL){
+            rc = 1;
+            break;
+        }
+        if(node_seek(db, node, db->end - db->block_size) == -1){
+            latch_release(db, latch);
+            rc = -1;
+            break;
+        }
+        if(node->use){
+            latch_release(db, latch);
+            cp->phase = COMPACT_RELINK;
+            break;
+        }
+        // db_value_stat加闩锁之后检查文件尾
+        __atomic_store_n(&db->end, db->end - db->block_size, __ATOMIC_SEQ_CST);
+        latch_release(db, latch);
+        (*steps)--;
+    }
+    if(db->end < end){
+        pool_drop(db->pool, db->end);
+        head_flush(db);
+        if(db->wal == NULL && ftruncate(db->fd, db->end) == -1){
+            rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&db->lock);
+    return rc;
+}
 
-    i = -(i+1);
+/**
+ * @brief 启用预写日志时，在没有写操作的间隙截断并做检查点
+ * 日志中可能还有文件尾之后的数据块镜像，之后在文件尾追加的区段不写入日志，恢复时会被这些镜像覆盖，所以清空日志之后才能在截断的位置追加
+ * 新的写操作在此期间等待，查询可以继续
+ * @return 同compact_truncate
+ */
+static int compact_checkpoint(db_t *db, size_t *steps){
+    db_wal *wal = db->wal;
+    int rc;
+    pthread_mutex_lock(&wal->lock);
+    // 关闭当前的组，等待组内的写操作结束并提交
+    while(wal->active != 0){
+        wal->closing = 1;
+        pthread_cond_wait(&wal->cond, &wal->lock);
+    }
+    rc = compact_truncate(db, steps);
+    if(rc != -1 && wal_checkpoint(db) == -1){
+        rc = -1;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return rc;
+}
 
-    // 寻找合适的btree_value数据块
-    if(db->current != 0L){
-        node_seek(db, valnode, db->current);
-        if(valnode->last + db_align(sizeof(btree_value) + value_size, DB_ALIGNMENT) > DB_BLOCK_SIZE){
-            // 当前的btree_value数据块不够空间分配
-            db->current = 0L;
+/**
+ * @brief 把limit与文件尾之间的空闲数据块放回空闲链表，limit随之增长，到达文件尾时整理结束
+ * @return ==0 if successful, ==1 有正在写入的区段或闩锁被占用，稍后继续, ==-1 error
+ */
+static int compact_relink(db_t *db, size_t *steps){
+    db_compaction *cp = &db->compaction;
+    btree_node *node = (btree_node *)node_scratch();
+    if(node == NULL){
+        return -1;
+    }
+    db_latch *latch;
+    int rc = 0;
+    pthread_mutex_lock(&db->lock);
+    if(db->extending != 0){
+        pthread_mutex_unlock(&db->lock);
+        return 1;
+    }
+    while(*steps > 0 && cp->limit < db->end){
+        if((latch = latch_acquire(db, cp->limit, LATCH_TRY)) == NULL){
+            rc = 1;
+            break;
+        }
+        if(node_seek(db, node, cp->limit) == -1){
+            latch_release(db, latch);
+            rc = -1;
+            break;
+        }
+        if(!node->use){
+            node->free = db->free;
+            db->free = node->self;
+            node_flush(db, node);
             head_flush(db);
         }
+        latch_release(db, latch);
+        cp->limit += db->block_size;
+        (*steps)--;
     }
-    if(db->current == 0L && node_create(db, valnode, 0, TYPE_VALUE) == -1){
-        return -1;
+    if(cp->limit >= db->end){
+        compact_finish(db);
     }
+    pthread_mutex_unlock(&db->lock);
+    return rc;
+}
 
-    // 先存储值
-    btree_value_ptr(valnode,valnode->last)->size = value_size;
-    memcpy(btree_value_ptr(valnode,valnode->last)->value, value, value_size);
-    size_t last = valnode->last;
-    valnode->last += db_align(sizeof(btree_value) + value_size, DB_ALIGNMENT);
-    valnode->num++;
-    node_flush(db, valnode);
-
-    // 再存储关键字
-    // leaf node right shift one position 叶子节点右移腾出一个空位
-    keycpy(db, btree_key_ptr(db,node,i+1), btree_key_ptr(db,node,i), node->num-i);
-    switch (db->key_type)
-    {
-    case DB_STRINGKEY:
-        strcpy((char*)(btree_key_ptr(db,node,i)->key), key);
-        break;
-    case DB_BYTESKEY:
-    case DB_INT32KEY:
-    case DB_INT64KEY:
-        memcpy(btree_key_ptr(db,node,i)->key, key, db->key_size);
-        break;
+/**
+ * @brief 放弃未完成的整理，关闭数据库时调用，此时没有其他线程
+ * 先摘除空闲链表中limit之后的数据块，再把它们全部放回
+ */
+static void compact_abort(db_t *db){
+    size_t steps = SIZE_MAX;
+    if(db->compaction.phase == COMPACT_PLAN){
+        compact_finish(db);
+        return;
     }
-    btree_key_ptr(db, node, i)->value = valnode->self + last; // 记录value所在数据块的位置 + 偏移
-    node->num++;
-    node_flush(db, node);
-    db->key_total++;
-    head_flush(db);
-    return 1;
+    while(db->compaction.phase == COMPACT_SWEEP && compact_sweep(db, &steps) == 0);
+    db->compaction.phase = COMPACT_RELINK;
+    compact_relink(db, &steps);
 }
 
 /**
- * @brief delete key 删除值
+ * @brief compact database 在线整理：把文件尾部的Btree节点、区段与value，以及半空的数据块中的value移到前面，修改引用它们的关键字，最后截断文件尾
+ * 分多次调用，每次最多处理steps个数据块或value，可以与其他线程的操作交替进行；同一时间只能有一个线程整理，不能与批量加载同时进行
+ * 区段只能移到连续的空闲数据块中，文件只截断到最后一个使用中的数据块之后；关闭数据库时放弃未完成的整理
  * @param[in] db 数据库句柄
- * @param[in] key key_size can't exceed max_key_size 需要保证key类型和创建数据库时一致
- * @return ==1 if success, ==0 if key no found, ==-1 error
+ * @param[in] steps 本次最多处理的数据块或value数
+ * @return ==1 整理未完成，需要再次调用, ==0 整理完成或不需要整理, ==-1 error, errno==EBUSY 有打开的快照
 */
-int db_delete(db_t* db, void* key){
-    if(db->key_type == DB_STRINGKEY && strlen((char*)key) >= db->key_size){
-        errno = EINVAL;
+int db_compact(db_t *db, size_t steps){
+    db_compaction *cp = &db->compaction;
+    int rc = 0;
+    write_begin(db);
+    if(__atomic_load_n(&db->snap, __ATOMIC_ACQUIRE) != NULL){
+        // 整理直接写入空闲数据块并截断文件，不经过node_flush，快照保存不到旧版本
+        write_end(db);
+        errno = EBUSY;
         return -1;
     }
-
-    #define LESS 1
-    #define MORE 2
-    int i,i_match=-1,flag = 0;
-    btree_node *node = (btree_node *)((char*)db + DB_HEAD_SIZE + DB_BLOCK_SIZE * 0);
-    btree_node *node_match = (btree_node *)((char*)db + DB_HEAD_SIZE + DB_BLOCK_SIZE * 1);
-    btree_node *sub_x = (btree_node *)((char*)db + DB_HEAD_SIZE + DB_BLOCK_SIZE * 2);
-    btree_node *sub_y = (btree_node *)((char*)db + DB_HEAD_SIZE + DB_BLOCK_SIZE * 3);
-    btree_node *sub_w = (btree_node *)((char*)db + DB_HEAD_SIZE + DB_BLOCK_SIZE * 4);
-    /* 删除只会发生在叶子节点，在由上往下的遍历中，需要保证叶子节点有足够的关键字数（大于ceil(M)） */
-    /*       __  node       */
-    /*     /    /    \      */
-    /*  sub_w  sub_x sub_y  */
-
-    node_seek(db, node, DB_HEAD_SIZE);// root 读取根节点
-
-    while(node->leaf == BTREE_NON_LEAF){
-        switch (flag)
-        {
-        case LESS:
-            i = -0-1;
+    uint64_t epoch = wal_begin(db);
+    if(cp->phase == COMPACT_IDLE){
+        rc = compact_start(db);
+    }
+    // 启用预写日志时在组提交之后截断
+    while(rc == 0 && steps > 0 && cp->phase != COMPACT_IDLE && (cp->phase != COMPACT_TRUNCATE || db->wal == NULL)){
+        switch(cp->phase){
+        case COMPACT_PLAN:
+            rc = compact_plan(db, &steps);
             break;
-        case MORE:
-            i = -node->num-1;
+        case COMPACT_SWEEP:
+            rc = compact_sweep(db, &steps);
+            break;
+        case COMPACT_MOVE:
+            rc = compact_move(db, &steps);
+            break;
+        case COMPACT_TRUNCATE:
+            rc = compact_truncate(db, &steps);
             break;
         default:
-            i = key_binary_search(db, node, key);
+            rc = compact_relink(db, &steps);
             break;
         }
+    }
+    if(wal_end(db, epoch) == -1){
+        rc = -1;
+    }
+    write_end(db);
+    if(rc == 0 && steps > 0 && cp->phase == COMPACT_TRUNCATE && db->wal != NULL){
+        rc = compact_checkpoint(db, &steps);
+    }
+    return rc == -1 ? -1 : rc == 1 || cp->phase != COMPACT_IDLE;
+}
 
-        // match when in internal 在非叶子节点中匹配到，需要找到在前缀或后缀关键字（该关键字只会在叶子结点中）
-        if(i >= 0){
-            // 判断左子树是否方便删除前缀关键字（左子树关键字个数大于ceil(M)）
-            node_seek(db, sub_x, btree_key_ptr(db,node,i)->child);
-            if(sub_x->num > ceil(db->M)){
-                // 寻找前缀关键字，即是寻找左子树的最大关键字
-                flag = MORE;
-                i_match = i;
-                memcpy(node_match, node, DB_BLOCK_SIZE);
-                memcpy(node, sub_x, DB_BLOCK_SIZE);
-            }else{
-                // 判断右子树是否方便删除后缀关键字（右子树关键字个数大于ceil(M)）
-                node_seek(db,sub_y,btree_key_ptr(db,node,i+1)->child);
-                if(sub_y->num > ceil(db->M)){
-                    // 寻找后缀关键字，即是寻找右子树的最小关键字
-                    flag = LESS;
-                    i_match = i;
-                    memcpy(node_match, node, DB_BLOCK_SIZE);
-                    memcpy(node, sub_y, DB_BLOCK_SIZE);
-                }else{
-                    // 左右子树都不方便，则合并
-                    if(!btree_merge(db, node, i, sub_x, sub_y)){
-                        memcpy(node, sub_x, DB_BLOCK_SIZE);
-                    }
-                }
-            }
-            continue;
-        }
-        
-        i = -(i+1);
+/**
+ * @brief 批量加载时，每次预留一段连续的数据块，在内存中填满后一次写入
+ */
+typedef struct{
+    char *buf;        /** 预留区间的数据块 */
+    off_t base;       /** 预留区间的起点 */
+    size_t used;      /** 已分配的块数 */
+}bulk_run;
 
-        // need prepare , make sure child have enough key 自上而下调整子树，保证最后在叶子节点处方便删除关键字（自上而下，确保子树关键字个数大于ceil(M)）
-        node_seek(db, sub_x, btree_key_ptr(db,node,i)->child);
+/**
+ * @brief 批量加载时，树每一层的最右节点
+ */
+typedef struct{
+    btree_node *node;   /** 正在填充的节点 */
+    btree_node *prev;   /** node的左兄弟，已填满，写出前保留，以便结束时与node重新分配 */
+    btree_node *parent; /** prev在父节点中的位置 */
+    int slot;
+    int pend;           /** node已满，下一个关键字暂存在key中，之后上升到父节点或放回node */
+    btree_key *key;
+}bulk_level;
 
-        if(sub_x->num > ceil(db->M)){
-            // already enough
-            memcpy(node, sub_x, DB_BLOCK_SIZE);
-            continue;
-        }
+typedef struct{
+    db_t *db;
+    size_t fill;        /** 每个节点填充的关键字数 */
+    int height;         /** 已创建的层数 */
+    off_t end;          /** 文件尾，预留区间与区段从这里分配 */
+    int closing;        /** 结束时写出预留区间，不再预留下一段 */
+    bulk_run tree;      /** 树节点的预留区间 */
+    bulk_run value;     /** btree_value数据块的预留区间 */
+    btree_node *valnode;/** 当前的btree_value数据块，在value.buf中 */
+    bulk_level level[DB_BULK_LEVEL];
+}db_bulk;
 
-        if(i+1<=node->num){
-            node_seek(db, sub_y, btree_key_ptr(db,node,i+1)->child);
-        }
+/**
+ * @brief 写出已填满的预留区间，并预留下一段；结束时只写出
+ */
+static int bulk_run_flush(db_bulk *bulk, bulk_run *run){
+    db_t *db = bulk->db;
+    size_t i;
+    for(i=0;i<run->used;i++){
+        node_seal((btree_node *)(run->buf + db->block_size * i), db->block_size);
+    }
+    if(run->used != 0){
+        stat_write(db, 1, db->block_size * run->used);
+    }
+    if(run->used != 0 && pwrite(db->fd, run->buf, db->block_size * run->used, run->base) != db->block_size * run->used){
+        return -1;
+    }
+    if(bulk->closing){
+        return 0;
+    }
+    run->base = bulk->end;
+    run->used = 0;
+    bulk->end += db->block_size * DB_BULK_RUN;
+    return 0;
+}
 
-        if(i-1>=0 && ((i+1>node->num) || sub_y->num<=ceil(db->M))){
-            node_seek(db, sub_w, btree_key_ptr(db,node,i-1)->child);
-        }
-        
-        if(i+1<=node->num && sub_y->num>ceil(db->M)){
-            // borrow from right 从子树的右兄弟借
-            memcpy(btree_key_ptr(db,sub_x,sub_x->num)->key, btree_key_ptr(db,node,i)->key, db->key_align - sizeof(btree_key));
-            btree_key_ptr(db,sub_x,sub_x->num)->value = btree_key_ptr(db,node,i)->value;
-            btree_key_ptr(db,sub_x,sub_x->num+1)->child = btree_key_ptr(db,sub_y,0)->child;
-            sub_x->num++;
+/**
+ * @brief 从预留区间分配一个数据块
+ */
+static btree_node* bulk_run_alloc(db_bulk *bulk, bulk_run *run){
+    db_t *db = bulk->db;
+    if(run->used == DB_BULK_RUN && bulk_run_flush(bulk, run) == -1){
+        return NULL;
+    }
+    btree_node *node = (btree_node *)(run->buf + db->block_size * run->used);
+    memset(node, 0, db->block_size);
+    node->self = run->base + db->block_size * run->used++;
+    node->use = 1;
+    return node;
+}
 
-            memcpy(btree_key_ptr(db,node,i)->key, btree_key_ptr(db,sub_y,0)->key, db->key_align - sizeof(btree_key));
-            btree_key_ptr(db,node,i)->value = btree_key_ptr(db,sub_y,0)->value;
-            keycpy(db, btree_key_ptr(db,sub_y,0),btree_key_ptr(db,sub_y,1), sub_y->num-1);
-            sub_y->num--;
+/**
+ * @brief 写出一个已完成的树节点，返回它的位置
+ */
+static off_t bulk_release(db_bulk *bulk, btree_node *node){
+    db_t *db = bulk->db;
+    btree_node *dest = bulk_run_alloc(bulk, &bulk->tree);
+    if(dest == NULL){
+        return -1;
+    }
+    off_t self = dest->self;
+    memcpy(dest, node, db->block_size);
+    dest->self = self;
+    dest->use = 1;
+    dest->type = TYPE_KEY;
+    db->key_use_block++;
+    return self;
+}
 
-            node_flush(db,node);
-            node_flush(db,sub_x);
-            node_flush(db,sub_y);
-            memcpy(node,sub_x,DB_BLOCK_SIZE);
-        }else if(i-1>=0 && sub_w->num>ceil(db->M)){
-            // borrow from left 从子树的左兄弟借
-            keycpy(db, btree_key_ptr(db,sub_x,1),btree_key_ptr(db,sub_x,0), sub_x->num);
-            memcpy(btree_key_ptr(db,sub_x,0)->key, btree_key_ptr(db,node,i-1)->key, db->key_align - sizeof(btree_key));
-            btree_key_ptr(db,sub_x,0)->value = btree_key_ptr(db,node,i-1)->value;
-            btree_key_ptr(db,sub_x,0)->child = btree_key_ptr(db,sub_w,sub_w->num)->child;
-            sub_x->num++;
-            
-            memcpy(btree_key_ptr(db,node,i-1)->key, btree_key_ptr(db,sub_w,sub_w->num-1)->key, db->key_align - sizeof(btree_key));
-            btree_key_ptr(db,node,i-1)->value = btree_key_ptr(db,sub_w,sub_w->num-1)->value;
-            sub_w->num--;
+/**
+ * @brief 写出level层的prev，并填写它在父节点中的位置
+ */
+static int bulk_release_prev(db_bulk *bulk, bulk_level *level){
+    off_t self;
+    if(level->prev == NULL){
+        return 0;
+    }
+    if((self = bulk_release(bulk, level->prev)) == -1){
+        return -1;
+    }
+    btree_key_ptr(bulk->db, level->parent, level->slot)->child = self;
+    return 0;
+}
 
-            node_flush(db,node);
-            node_flush(db,sub_x);
-            node_flush(db,sub_w);
-            memcpy(node,sub_x,DB_BLOCK_SIZE);
-        }else{
-            if(i+1<=node->num){
-                // merge with right
-                if(!btree_merge(db,node,i,sub_x,sub_y)){
-                    memcpy(node,sub_x,DB_BLOCK_SIZE);
-                }
-            }else{
-                // merge with left
-                if(!btree_merge(db,node,i-1,sub_w,sub_x)){
-                    memcpy(node,sub_w,DB_BLOCK_SIZE);
-                }
-            }
+/**
+ * @brief 向第h层追加关键字（key与value），非叶子层的左子树在写出时填写
+ */
+static int bulk_add(db_bulk *bulk, int h, btree_key *key){
+    db_t *db = bulk->db;
+    bulk_level *level = &bulk->level[h];
+    btree_node *node;
+
+    if(h == bulk->height){
+        // 新的一层
+        if(h == DB_BULK_LEVEL){
+            errno = E2BIG;
+            return -1;
         }
+        level->node = calloc(1, db->block_size);
+        level->key = malloc(db->key_align);
+        if(level->node == NULL || level->key == NULL){
+            return -1;
+        }
+        level->node->leaf = h == 0 ? BTREE_LEAF : BTREE_NON_LEAF;
+        bulk->height++;
     }
 
-    off_t offset = 0;
-    if(flag == LESS){
-        // 找到后缀关键字，即是右子树的最小关键字
-        offset = btree_key_ptr(db,node_match,i_match)->value;
-
-        memcpy(btree_key_ptr(db,node_match,i_match)->key, btree_key_ptr(db,node,0)->key, db->key_align - sizeof(btree_key));
-        btree_key_ptr(db,node_match,i_match)->value = btree_key_ptr(db,node,0)->value;
-        keycpy(db, btree_key_ptr(db,node,0), btree_key_ptr(db,node,1), node->num-1);
-        node->num--;
-        node_flush(db,node_match);
-        node_flush(db,node);
-    }else if(flag == MORE){
-        // 找到前缀关键字，即是左子树的最大关键字
-        offset = btree_key_ptr(db,node_match,i_match)->value;
+    node = level->node;
+    if(level->pend){
+        // node已完成：先写出左兄弟，暂存的关键字上升到父节点，再开始新的节点
+        if(bulk_release_prev(bulk, level) == -1){
+            return -1;
+        }
+        if(level->prev == NULL && (level->prev = malloc(db->block_size)) == NULL){
+            return -1;
+        }
+        node_swap(level->prev, level->node);
+        if(bulk_add(bulk, h+1, level->key) == -1){
+            return -1;
+        }
+        // 父节点在上面的调用中记录了prev的位置
+        level->pend = 0;
+        node = level->node;
+        memset(node, 0, db->block_size);
+        node->leaf = h == 0 ? BTREE_LEAF : BTREE_NON_LEAF;
+    }
 
-        memcpy(btree_key_ptr(db,node_match,i_match)->key, btree_key_ptr(db,node,node->num-1)->key, db->key_align - sizeof(btree_key));
-        btree_key_ptr(db,node_match,i_match)->value = btree_key_ptr(db,node,node->num-1)->value;
-        node->num--;
-        node_flush(db,node_match);
-        node_flush(db,node);
+    if(node->num < bulk->fill){
+        memcpy(btree_key_ptr(db, node, node->num), key, db->key_align);
+        btree_key_ptr(db, node, node->num)->child = 0;
+        if(h > 0){
+            bulk->level[h-1].parent = node;
+            bulk->level[h-1].slot = node->num;
+        }
+        node->num++;
     }else{
-        i = key_binary_search(db,node,key);
-        if(i < 0){
-            return 0;
+        // node已满，关键字暂存，它的左子树是node最右的子树
+        memcpy(level->key, key, db->key_align);
+        level->key->child = 0;
+        level->pend = 1;
+        if(h > 0){
+            bulk->level[h-1].parent = node;
+            bulk->level[h-1].slot = node->num;
         }
+    }
+    return 0;
+}
 
-        // 关键字刚好在叶子节点
-        offset = btree_key_ptr(db,node,i)->value;
-        keycpy(db, btree_key_ptr(db,node,i),btree_key_ptr(db,node,i+1), node->num - i - 1);
-        node->num--;
-        node_flush(db,node);
+/**
+ * @brief 第h层最右的两个节点重新分配关键字，使最右节点不少于ceil(M)
+ * @param[in] sep 两个节点在父节点中的分隔关键字
+ */
+static void bulk_rebalance(db_t *db, btree_node *left, btree_node *right, btree_key *sep){
+    size_t total = left->num + 1 + right->num, n = (total - 1) / 2, m = left->num - n;
+    if(right->num >= ceil(db->M) || m == 0){
+        return;
     }
+    // right右移m个位置，腾出的位置放入分隔关键字与left右侧的m-1个关键字
+    keycpy(db, btree_key_ptr(db, right, m), btree_key_ptr(db, right, 0), right->num);
+    memcpy(btree_key_ptr(db, right, m-1)->key, sep->key, db->key_align - sizeof(btree_key));
+    btree_key_ptr(db, right, m-1)->value = sep->value;
+    btree_key_ptr(db, right, m-1)->child = btree_key_ptr(db, left, left->num)->child;
+    memcpy(btree_key_ptr(db, right, 0), btree_key_ptr(db, left, n+1), db->key_align * (m-1));
+    right->num += m;
 
-    // release value block 释放关键字对应的value
-    node_seek(db, node, DB_HEAD_SIZE + ((offset - DB_HEAD_SIZE)& ~(DB_BLOCK_SIZE-1)));
-    node->num--;
-    // btree_value的数据块，引用数为0时，释放该数据块
-    if(node->num == 0){
-        if(node->self == db->current){
-            db->current = 0;
-            // head_flush(d);// node_destroy will flush again
+    memcpy(sep->key, btree_key_ptr(db, left, n)->key, db->key_align - sizeof(btree_key));
+    sep->value = btree_key_ptr(db, left, n)->value;
+    left->num = n;
+}
+
+/**
+ * @brief 结束批量加载：自下而上把暂存的关键字放回节点、重新分配最右的节点并写出，最高层写入根节点
+ */
+static int bulk_finish(db_bulk *bulk, btree_node *root){
+    db_t *db = bulk->db;
+    off_t last = 0;
+    int h;
+    for(h=0;h<bulk->height;h++){
+        bulk_level *level = &bulk->level[h];
+        btree_node *node = level->node;
+        if(level->pend){
+            // fill <= M-2，一定放得下
+            memcpy(btree_key_ptr(db, node, node->num)->key, level->key->key, db->key_align - sizeof(btree_key));
+            btree_key_ptr(db, node, node->num)->value = level->key->value;
+            node->num++;
+            level->pend = 0;
+        }
+        btree_key_ptr(db, node, node->num)->child = last;
+
+        if(level->prev != NULL){
+            bulk_level *up = &bulk->level[h+1];
+            btree_key *sep = up->pend ? up->key : btree_key_ptr(db, up->node, up->node->num - 1);
+            bulk_rebalance(db, level->prev, node, sep);
+            if(bulk_release_prev(bulk, level) == -1){
+                return -1;
+            }
+        }
+
+        if(h == bulk->height - 1){
+            // 最高层只有一个节点，作为根节点
+            root->num = node->num;
+            root->leaf = node->leaf;
+            memcpy((char*)root + sizeof(btree_node), (char*)node + sizeof(btree_node), db->block_size - sizeof(btree_node));
+        }else if((last = bulk_release(bulk, node)) == -1){
+            return -1;
         }
-        node_destroy(db, node);
-    }else{
-        node_flush(db, node);
     }
-    db->key_total--;
-    head_flush(db);
-    return 1;
+    return 0;
+}
+
+/**
+ * @brief 把预留区间中未使用的数据块加入空闲链表，然后写出
+ */
+static int bulk_run_close(db_bulk *bulk, bulk_run *run){
+    db_t *db = bulk->db;
+    btree_node *node;
+    while(run->used < DB_BULK_RUN){
+        node = (btree_node *)(run->buf + db->block_size * run->used);
+        memset(node, 0, db->block_size);
+        node->self = run->base + db->block_size * run->used++;
+        node->free = db->free;
+        db->free = node->self;
+    }
+    return bulk_run_flush(bulk, run);
 }
 
 /**
- * @brief search key 查询值
+ * @brief bulk load 批量加载，自下而上构建Btree，只能用于空的数据库
+ * 按fill填充每个节点，value紧密存放在btree_value数据块中，所有数据块只写一次，并以连续的大块写入文件尾
  * @param[in] db 数据库句柄
- * @param[in] key key_size can't exceed max_key_size 需要保证key类型和创建数据库时一致
- * @param[out] value
- * @param[in] value_size 需要保证空间足够大
- * @return >=0 if success, ==-1 error
+ * @param[in] next 数据源，必须按key严格升序
+ * @param[in] arg 数据源的参数
+ * @param[in] fill 节点的填充率，0 < fill <= 1
+ * @return >=0 加载的key总数 if successful, ==-1 error
 */
-int db_search(db_t* db, void* key, void *value, size_t value_size){
-    if(db->key_type == DB_STRINGKEY && strlen((char*)key) >= db->key_size){
+long db_bulk_load(db_t *db, db_iterator next, void *arg, double fill){
+    if(fill <= 0 || fill > 1){
         errno = EINVAL;
         return -1;
     }
 
-    btree_node *node = (btree_node *)((char*)db + DB_HEAD_SIZE + DB_BLOCK_SIZE * 0);
-    int i;
-    off_t offset = DB_HEAD_SIZE;
+    char *scratch = node_scratch();
+    if(scratch == NULL){
+        return -1;
+    }
 
-    do{
-        node_seek(db, node, offset);
-        i = key_binary_search(db, node, key);
-        if(i >= 0){
-            offset = btree_key_ptr(db, node, i)->value;
-            node_seek(db, node, DB_HEAD_SIZE + ((offset - DB_HEAD_SIZE)& ~(DB_BLOCK_SIZE-1)));
-            btree_value *pval = btree_value_ptr(node, offset-node->self);
-            if(pval->size > value_size){
-                errno = E2BIG;
-                return -1;
-            }
-            memcpy(value,pval->value, pval->size);
-            return pval->size;
-        }
-        i = -(i+1);
-        offset = btree_key_ptr(db, node, i)->child;
-    }while(offset != 0);
+    // 加载期间持有根节点的排他闩锁与db->lock，其他线程的读写操作在根节点等待
+    write_begin(db);
+    uint64_t epoch = wal_begin(db);
+    db_latch *latch = latch_acquire(db, DB_HEAD_SIZE, LATCH_X);
+    if(latch == NULL){
+        wal_end(db, epoch);
+        write_end(db);
+        return -1;
+    }
+    pthread_mutex_lock(&db->lock);
 
-    errno = ENOMSG;
-    return -1;
-}
+    if(db->key_total != 0){
+        errno = ENOTEMPTY;
+        pthread_mutex_unlock(&db->lock);
+        latch_release(db, latch);
+        wal_end(db, epoch);
+        write_end(db);
+        return -1;
+    }
+
+    db_bulk bulk;
+    memset(&bulk, 0, sizeof(bulk));
+    bulk.db = db;
+    bulk.end = db->end;
+    // 至少ceil(M)，最多M-2，留出结束时放回暂存关键字的位置
+    bulk.fill = (size_t)((db->M - 1) * fill);
+    if(bulk.fill < ceil(db->M)){
+        bulk.fill = ceil(db->M);
+    }
+    if(bulk.fill > db->M - 2){
+        bulk.fill = db->M - 2;
+    }
 
-/***************************************/
-#include <stdio.h>
-#include <unistd.h>
-#include <string.h>
-#include <assert.h>
+    btree_node *root = (btree_node *)(scratch + db->block_size * 0);
+    btree_key *key = (btree_key *)(scratch + db->block_size * 1);
+    btree_key *prev = (btree_key *)(scratch + db->block_size * 2);
+    void *k, *v;
+    unsigned char *code = NULL;
+    size_t value_size, key_use_block = db->key_use_block, value_use_block = db->value_use_block;
+    off_t free_head = db->free, current = db->current;
+    long total = 0;
+    int rc, h, err;
 
-#define COUNT 100000
-#define PATH "./test.db"
+    bulk.tree.buf = malloc(db->block_size * DB_BULK_RUN);
+    bulk.value.buf = malloc(db->block_size * DB_BULK_RUN);
+    if(bulk.tree.buf == NULL || bulk.value.buf == NULL){
+        goto failed;
+    }
+    bulk_run_flush(&bulk, &bulk.tree);
+    bulk_run_flush(&bulk, &bulk.value);
 
-int main(){
-    db_t* db;
-    int i,rc;
-    char value[128];
+    while((rc = next(arg, &k, &v, &value_size)) == 1){
+        if(db->key_type == DB_STRINGKEY && strlen((char*)k) >= db->key_size){
+            errno = EINVAL;
+            goto failed;
+        }
+        if(value_size > INT_MAX){
+            errno = E2BIG;
+            goto failed;
+        }
 
-    // 创建数据库
-    unlink(PATH);
-    assert(db_create(PATH,DB_INT32KEY,sizeof(int)) == 0);
+        memset(key, 0, db->key_align);
+        switch (db->key_type)
+        {
+        case DB_STRINGKEY:
+            strcpy((char*)key->key, k);
+            break;
+        default:
+            memcpy(key->key, k, db->key_size);
+            break;
+        }
+        if(total != 0 && db->key_cmp(key->key, prev->key, db->key_size) <= 0){
+            // 必须严格升序
+            errno = EINVAL;
+            goto failed;
+        }
+        bloom_add(db, key->key);
 
-    // 打开数据库
-    assert(db_open(&db,PATH) == 0);
+        // 存储值，压缩模式下先编码
+        if(db->compress){
+            free(code);
+            if(value_encode(v, &value_size, &code) == -1){
+                code = NULL;
+                goto failed;
+            }
+            v = code;
+        }
+        btree_node *valnode = bulk.valnode;
+        if(inline_fits(db, value_size)){
+            // 小value存放在关键字的槽中
+            memcpy(inline_data(db, key), v, value_size);
+            key->value = VALUE_INLINE | value_size;
+        }else if(value_large(value_size)){
+            // 大value直接写入文件尾的区段
+            if(extent_store(db, bulk.end, v, value_size) == -1){
+                goto failed;
+            }
+            key->value = bulk.end;
+            bulk.end += db->block_size * extent_blocks(value_size);
+            db->value_use_block += extent_blocks(value_size);
+        }else{
+            if(valnode == NULL || valnode->last + db_align(sizeof(btree_value) + value_size, DB_ALIGNMENT) > db->block_size){
+                if((valnode = bulk_run_alloc(&bulk, &bulk.value)) == NULL){
+                    goto failed;
+                }
+                valnode->type = TYPE_VALUE;
+                valnode->last = sizeof(btree_node);
+                bulk.valnode = valnode;
+                db->value_use_block++;
+            }
+            btree_value_ptr(valnode,valnode->last)->size = value_size;
+            memcpy(btree_value_ptr(valnode,valnode->last)->value, v, value_size);
+            key->value = valnode->self + valnode->last;
+            valnode->last += db_align(sizeof(btree_value) + value_size, DB_ALIGNMENT);
+            valnode->num++;
+        }
 
-    // 插入操作
-    for(i=0;i<COUNT;i++){
-        sprintf(value,"%d",i);
-        assert(db_insert(db,&i,value,strlen(value)) == 1);
+        if(bulk_add(&bulk, 0, key) == -1){
+            goto failed;
+        }
+        memcpy(prev, key, db->key_align);
+        total++;
+    }
+    if(rc == -1){
+        goto failed;
+    }
+    if(total == 0){
+        goto done;
     }
-    printf("insert key from %d to %d\n",0,COUNT);
 
-    //查询操作
-    i = 0;
-    bzero(value,sizeof(value));
-    rc = db_search(db,&i,value,sizeof(value));
-    assert(rc >= 0);
-    printf("search key: %d value: %.*s\n",i,rc,value);
+    if(node_seek(db, root, DB_HEAD_SIZE) == -1 || bulk_finish(&bulk, root) == -1){
+        goto failed;
+    }
+    // 最后一个btree_value数据块可以继续分配
+    db->current = bulk.valnode != NULL ? bulk.valnode->self : 0;
+    bulk.closing = 1;
+    if(bulk_run_close(&bulk, &bulk.tree) == -1 || bulk_run_close(&bulk, &bulk.value) == -1){
+        goto failed;
+    }
+    if(db->map != NULL && map_grow(db, bulk.end) == -1){
+        goto failed;
+    }
+    // 新的数据块落盘之后，才写入根节点与文件头
+    if(db->wal != NULL && db->wal->sync != DB_SYNC_NONE && fsync(db->fd) == -1){
+        goto failed;
+    }
 
-    // 删除操作
-    for(i=0;i<COUNT;i++){
-        assert(db_delete(db,&i) == 1);
+    if(node_flush(db, root) == -1){
+        goto failed;
     }
-    printf("delete key from %d to %d\n",0,COUNT);
+    db->key_total = total;
+    db->end = bulk.end;
+    head_flush(db);
+    goto done;
 
-    // 关闭数据库
-    db_close(db);
+failed:
+    // 恢复文件头，丢弃已写入的数据块
+    db->key_use_block = key_use_block;
+    db->value_use_block = value_use_block;
+    db->free = free_head;
+    db->current = current;
+    err = errno;
+    if(ftruncate(db->fd, db->end) == -1){
+        // 文件尾之后的数据块不属于任何提交，下次打开时截断
+        errno = err;
+    }
+    total = -1;
 
-    return 0;
-}
\ No newline at end of file
+done:
+    for(h=0;h<bulk.height;h++){
+        free(bulk.level[h].node);
+        free(bulk.level[h].prev);
+        free(bulk.level[h].key);
+    }
+    free(bulk.tree.buf);
+    free(bulk.value.buf);
+    free(code);
+    pthread_mutex_unlock(&db->lock);
+    latch_release(db, latch);
+    if(wal_end(db, epoch) == -1){
+        total = -1;
+    }
+    write_end(db);
+    bloom_grow(db);
+    return total;
+}
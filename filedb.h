@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2022, LiuYuguang <l13660020946@live.com>
+ */
+/**
+ * @brief 超简单的文件数据库，对外的接口，参数与返回值的详细说明见filedb.c
+ */
+#ifndef FILEDB_H
+#define FILEDB_H
+
+#include <stddef.h>            // for size_t
+
+#define DB_BLOCK_SIZE (8192UL) // 默认的数据块大小，创建数据库时可以指定
+#define DB_BLOCK_MIN  (4096UL) // block size must be pow of 2! 数据块大小的范围
+#define DB_BLOCK_MAX  (65536UL)
+
+/**
+ * @brief 创建数据库时，指定的key类型
+ */
+#define DB_STRINGKEY 0 /** 4 <= max_key_size <= 128, include '\0', 包含'\0'在内 */
+#define DB_BYTESKEY  1 /** 4 <= max_key_size <= 128 */
+#define DB_INT32KEY  2 /** max_key_size = sizeof(int32_t) */
+#define DB_INT64KEY  3 /** max_key_size = sizeof(int64_t) */
+
+/**
+ * @brief 创建数据库的选项，记录在文件头中，之后每次打开都生效
+ */
+#define DB_COMPRESS 0x1 /** value压缩存储（内置的LZ4格式编解码），压缩后不能变小的value原样存储 */
+#define DB_INLINE_VALUE(size) ((size) << 8) /** 不超过size字节的value直接存放在关键字的槽中，1 <= size <= DB_INLINE_MAX */
+#define DB_INLINE_MAX 128
+
+/**
+ * @brief 打开数据库的选项
+ */
+#define DB_MMAP 0x1 /** 使用mmap存储引擎，数据块直接在映射中读写，不使用缓冲池 */
+#define DB_WAL  0x2 /** 启用预写日志 */
+#define DB_URING 0x4 /** 缓冲池用io_uring批量预读与写回数据块，内核不支持时退回pread/pwrite；DB_MMAP时忽略
+                         * 进程被杀死时内核异步回收io_uring，文件锁稍后才释放，立即重新打开可能返回EAGAIN */
+
+/**
+ * @brief 预写日志的持久化级别
+ */
+#define DB_SYNC_NONE  0 /** 不主动同步日志，只保证进程崩溃时的一致性 */
+#define DB_SYNC_BATCH 1 /** 组提交：每组提交同步一次日志，写操作等待所在的组同步之后返回 */
+#define DB_SYNC_OP    2 /** 写操作结束时关闭所在的组，尽快提交并同步日志之后返回 */
+#define DB_SYNC_PERIOD 3 /** 每wal_batch次提交同步一次日志，不等待；掉电时可能丢失最近未同步的提交 */
+
+typedef struct{
+    int flags;         /** DB_MMAP, DB_WAL, DB_URING */
+    size_t cache_size; /** 缓冲池的内存预算（字节），0表示DB_POOL_SIZE */
+    size_t map_size;   /** mmap预留的虚拟地址空间（字节），文件不能超过该大小，0表示DB_MAP_SIZE */
+    int sync;          /** 预写日志的持久化级别，DB_SYNC_NONE, DB_SYNC_BATCH, DB_SYNC_OP, DB_SYNC_PERIOD */
+    size_t wal_batch;  /** DB_SYNC_PERIOD时，每多少次提交同步一次，0表示DB_WAL_BATCH */
+    size_t wal_size;   /** 日志超过该大小（字节）时做检查点，0表示DB_WAL_SIZE */
+    double fill;       /** 节点的填充率，0.5 < fill <= 1：在树的右（左）边缘追加时，分裂后满的一侧保留该比例的关键字；
+                        * 随机插入时已满的节点先移给未达到该比例的兄弟，不分裂。0表示边缘追加按0.9分裂，随机插入总是从中间分裂 */
+    size_t snap_memory;/** 快照保存的旧版本在内存中的上限（字节），超过时写入临时文件，0表示DB_SNAP_MEMORY */
+}db_options;
+
+/**
+ * @brief 缓冲池的统计
+ */
+typedef struct{
+    size_t frames;     /** 帧数 */
+    size_t hit;        /** 命中次数 */
+    size_t miss;       /** 未命中次数 */
+    size_t dirty;      /** 未写回的帧数 */
+}db_cache_info;
+
+/**
+ * @brief btree_value数据块的空间统计
+ */
+typedef struct{
+    size_t blocks;     /** btree_value数据块数，不含区段 */
+    size_t extent_blocks;/** 区段的数据块数 */
+    size_t values;     /** 数据块中的value数 */
+    size_t used;       /** value占用的字节数，包括btree_value与对齐 */
+    size_t holes;      /** 空洞数 */
+    size_t hole_bytes; /** 空洞的字节数，可以被新的value重用 */
+    size_t tail_bytes; /** 数据块尾部未分配的字节数 */
+}db_value_info;
+
+/**
+ * @brief 运行时统计的操作，延迟直方图的下标
+ */
+#define DB_STAT_INSERT  0
+#define DB_STAT_UPDATE  1
+#define DB_STAT_UPSERT  2
+#define DB_STAT_DELETE  3
+#define DB_STAT_SEARCH  4 /** 包括db_search_stream、db_search_size与db_get_view */
+#define DB_STAT_SEARCH_MANY 5 /** 每次db_search_many记录一次 */
+#define DB_STAT_BATCH   6 /** 每次db_write_batch记录一次 */
+#define DB_STAT_OPS     7
+#define DB_STAT_BUCKETS 32 /** 第i个桶是[2^i, 2^(i+1))纳秒，最后一个桶包括更长的 */
+
+/**
+ * @brief 运行时统计，打开数据库以来的累计值；编译时定义DB_NO_STATS则不统计
+ */
+typedef struct{
+    size_t reads;        /** 读数据库文件的次数，包括io_uring的读请求，不含mmap的缺页 */
+    size_t read_bytes;
+    size_t writes;       /** 写数据库文件与日志的次数，包括io_uring的写请求 */
+    size_t write_bytes;
+    size_t splits;       /** 节点分裂次数，包括根节点 */
+    size_t merges;       /** 节点合并次数 */
+    size_t borrow_left;  /** 删除时从左兄弟借关键字的次数 */
+    size_t borrow_right; /** 删除时从右兄弟借关键字的次数 */
+    size_t shares;       /** 插入时已满的节点移给兄弟、不必分裂的次数，指定db_options.fill时才有 */
+    size_t free_pops;    /** 从空闲链表取出的数据块数，其余在文件尾追加 */
+    size_t value_blocks; /** 新分配的btree_value数据块数 */
+    size_t extents;      /** 新写入的区段数 */
+    size_t bloom_negatives;      /** 布隆过滤器判断一定不存在、不必访问Btree的查询、修改与删除数 */
+    size_t bloom_false_positives;/** 过滤器判断可能存在、Btree中却没有的次数，误判率约为它与前者之和的比 */
+    size_t bloom_bytes;  /** 布隆过滤器占用的内存，db_stats时读取，未启用时为0 */
+    size_t height;       /** 树高，只有根节点时为1，db_stats时由根节点往下数 */
+    size_t latency[DB_STAT_OPS][DB_STAT_BUCKETS]; /** 各操作的延迟直方图，各桶之和即操作次数 */
+}db_stats_info;
+
+/**
+ * @brief 批量加载的数据源，按key升序返回
+ * @param[in] arg 调用者的参数
+ * @param[out] key
+ * @param[out] value
+ * @param[out] value_size
+ * @return ==1 if successful, ==0 if end, ==-1 error
+ */
+typedef int (*db_iterator)(void *arg, void **key, void **value, size_t *value_size);
+
+typedef struct db_s db_t;             /** 数据库句柄 */
+typedef struct db_cursor_s db_cursor; /** 游标 */
+typedef struct db_snapshot_s db_snapshot; /** 只读快照 */
+
+/**
+ * @brief value的只读视图，db_get_view返回，db_view_release释放
+ */
+typedef struct{
+    const void *data;  /** value，释放之前有效，不能修改 */
+    size_t size;       /** value的长度 */
+    db_t *db;          /** 以下由库内部使用 */
+    void *node;        /** 直接引用时固定的数据块 */
+    void *latch;       /** 该数据块的共享闩锁 */
+    void *copy;        /** 压缩的value与区段读出到这里 */
+}db_view;
+
+#define DB_BATCH_PUT    0 /** 同db_upsert */
+#define DB_BATCH_DELETE 1 /** 同db_delete */
+
+/**
+ * @brief db_write_batch的一个操作
+ */
+typedef struct{
+    int type;          /** DB_BATCH_PUT, DB_BATCH_DELETE */
+    void *key;         /** 需要保证key类型和创建数据库时一致 */
+    void *value;       /** DB_BATCH_PUT时的value */
+    size_t value_size;
+    int result;        /** 执行后填入，同db_upsert、db_delete的返回值，没有执行时为-1 */
+}db_batch_op;
+
+/** 创建、打开、关闭 */
+int db_create(char *path, int key_type, size_t max_key_size);
+int db_create_ex(char *path, int key_type, size_t max_key_size, size_t block_size, int flags);
+int db_open(db_t **db, char *path);
+int db_open_ex(db_t **db, char *path, db_options *options);
+void db_close(db_t *db);
+
+/** 读写，可以由多个线程同时调用 */
+int db_insert(db_t* db, void* key, void *value, size_t value_size);
+int db_update(db_t* db, void* key, void *value, size_t value_size);
+int db_upsert(db_t* db, void* key, void *value, size_t value_size);
+int db_delete(db_t* db, void* key);
+int db_write_batch(db_t* db, size_t n, db_batch_op *ops);
+int db_search(db_t* db, void* key, void *value, size_t value_size);
+int db_search_stream(db_t* db, void* key, size_t offset, void *value, size_t value_size, size_t *total);
+int db_search_many(db_t* db, size_t n, void **keys, void **values, size_t *value_sizes, int *results);
+int db_search_size(db_t* db, void* key, size_t *size);
+int db_get_view(db_t* db, void* key, db_view *view);
+void db_view_release(db_view *view);
+
+/** 游标，按key顺序双向遍历[lo, hi) */
+int db_cursor_open(db_t *db, db_cursor **cursor, void *lo, void *hi);
+int db_cursor_seek(db_cursor *cursor, void *key);
+int db_cursor_next(db_cursor *cursor, void *key, void *value, size_t value_size);
+int db_cursor_prev(db_cursor *cursor, void *key, void *value, size_t value_size);
+int db_cursor_get(db_cursor *cursor, void *key, void *value, size_t value_size);
+void db_cursor_close(db_cursor *cursor);
+
+/** 只读快照，读到打开时的数据，不受之后写操作的影响 */
+int db_snapshot_open(db_t *db, db_snapshot **snap);
+int db_snapshot_search(db_snapshot *snap, void *key, void *value, size_t value_size);
+int db_snapshot_cursor(db_snapshot *snap, db_cursor **cursor, void *lo, void *hi);
+void db_snapshot_close(db_snapshot *snap);
+
+/** 维护与统计 */
+int db_sync(db_t *db);
+int db_checker(db_t *db);
+int db_verify(db_t *db);
+void db_cache_stat(db_t *db, db_cache_info *info);
+int db_stats(db_t *db, db_stats_info *stats);
+int db_value_stat(db_t *db, db_value_info *info);
+int db_compact(db_t *db, size_t steps);
+int db_bloom_rebuild(db_t *db, size_t bits_per_key);
+long db_bulk_load(db_t *db, db_iterator next, void *arg, double fill);
+
+#endif